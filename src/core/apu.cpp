@@ -0,0 +1,608 @@
+#include "apu.h"
+#include "dma.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
+using namespace std;
+
+static const uint64_t RATIO = ((uint64_t) APU::SAMPLE_RATE << 32) / APU::CPU_RATE;
+static const float PULSE_GAIN = 0.00752f;
+static const float TRIANGLE_GAIN = 0.00851f;
+static const float NOISE_GAIN = 0.00494f;
+static const float DMC_GAIN = 0.00335f;
+static const float LEAK = 0.999f;
+static const float OUTPUT_SCALE = 30000.0f;
+
+static const uint8_t LENGTH_TABLE[32] = {
+    10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+    12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+static const uint8_t DUTY_TABLE[4] = { 0x02, 0x06, 0x1E, 0xF9 };
+static const uint16_t NOISE_PERIODS[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+static const uint16_t DMC_PERIODS[16] = {
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54
+};
+static const uint32_t FRAME_STEPS[2][5] = {
+    { 7457, 14913, 22371, 29829, 29830 },
+    { 7457, 14913, 22371, 37281, 37282 }
+};
+
+struct NoiseSequence {
+    uint16_t order[0x8000];
+    uint16_t index[0x8000];
+    uint16_t cycle[0x8000];
+    vector<uint16_t> cycle_start;
+    vector<uint16_t> cycle_length;
+};
+
+static inline uint16_t clock_lfsr(uint16_t lfsr, unsigned tap)
+{
+    uint16_t feedback = (lfsr ^ (lfsr >> tap)) & 0x01;
+    return (lfsr >> 1) | (feedback << 14);
+}
+
+static const NoiseSequence *noise_sequences()
+{
+    static NoiseSequence sequences[2];
+    static once_flag once;
+    call_once(once, [] {
+        for (unsigned mode = 0; mode < 2; ++mode) {
+            NoiseSequence &sequence = sequences[mode];
+            vector<bool> seen(0x8000);
+            unsigned position = 0;
+            for (unsigned state = 0; state < 0x8000; ++state) {
+                if (seen[state])
+                    continue;
+                uint16_t id = sequence.cycle_start.size();
+                sequence.cycle_start.push_back(position);
+                for (uint16_t lfsr = state; !seen[lfsr]; lfsr = clock_lfsr(lfsr, mode ? 6 : 1)) {
+                    seen[lfsr] = true;
+                    sequence.order[position] = lfsr;
+                    sequence.index[lfsr] = position++;
+                    sequence.cycle[lfsr] = id;
+                }
+                sequence.cycle_length.push_back(position - sequence.cycle_start.back());
+            }
+        }
+    });
+    return sequences;
+}
+
+static uint16_t advance_lfsr(uint16_t lfsr, uint8_t mode, uint64_t steps)
+{
+    const NoiseSequence &sequence = noise_sequences()[mode ? 1 : 0];
+    lfsr &= 0x7FFF;
+    uint16_t id = sequence.cycle[lfsr];
+    uint64_t start = sequence.cycle_start[id];
+    uint64_t length = sequence.cycle_length[id];
+    return sequence.order[start + (sequence.index[lfsr] - start + steps % length) % length];
+}
+
+static inline uint8_t triangle_value(uint8_t step)
+{
+    return step < 16 ? 15 - step : step - 16;
+}
+
+static inline uint64_t steps_before(uint64_t time, uint64_t to, uint64_t period)
+{
+    return time < to ? (to - time + period - 1) / period : 0;
+}
+
+const float *APU::build_kernel()
+{
+    static float taps[BLEP_PHASES * BLEP_TAPS];
+    static once_flag once;
+    call_once(once, [] {
+        const double cutoff = 0.9;
+        for (unsigned phase = 0; phase < BLEP_PHASES; ++phase) {
+            double row[BLEP_TAPS];
+            double sum = 0.0;
+            for (unsigned k = 0; k < BLEP_TAPS; ++k) {
+                double t = (double) k - (BLEP_TAPS / 2 - 1) - (double) phase / BLEP_PHASES;
+                double x = M_PI * cutoff * t;
+                double sinc = fabs(x) < 1e-9 ? 1.0 : sin(x) / x;
+                double window = 0.42 + 0.5 * cos(2.0 * M_PI * t / BLEP_TAPS) + 0.08 * cos(4.0 * M_PI * t / BLEP_TAPS);
+                row[k] = sinc * window;
+                sum += row[k];
+            }
+            for (unsigned k = 0; k < BLEP_TAPS; ++k)
+                taps[phase * BLEP_TAPS + k] = row[k] / sum;
+        }
+    });
+    return taps;
+}
+
+void APU::add_delta(uint64_t cycle, float amount)
+{
+    if (!sink)
+        return;
+    uint64_t position = (cycle - block_start) * RATIO + block_phase;
+    const float *taps = kernel + ((position >> 27) & (BLEP_PHASES - 1)) * BLEP_TAPS;
+    float *out = deltas + (position >> 32);
+    for (unsigned k = 0; k < BLEP_TAPS; ++k)
+        out[k] += amount * taps[k];
+}
+
+void APU::set_level(uint8_t &level, uint8_t value, uint64_t cycle, float gain)
+{
+    if (value == level)
+        return;
+    add_delta(cycle, ((int) value - (int) level) * gain);
+    level = value;
+}
+
+uint8_t APU::envelope_volume(const Envelope &envelope, uint8_t constant, uint8_t volume)
+{
+    return constant ? volume : envelope.decay;
+}
+
+void APU::clock_envelope(Envelope &envelope, uint8_t loop, uint8_t volume)
+{
+    if (envelope.start) {
+        envelope.start = 0;
+        envelope.decay = 15;
+        envelope.divider = volume;
+    } else if (!envelope.divider) {
+        envelope.divider = volume;
+        if (envelope.decay)
+            --envelope.decay;
+        else if (loop)
+            envelope.decay = 15;
+    } else {
+        --envelope.divider;
+    }
+}
+
+uint16_t APU::sweep_target(unsigned index)
+{
+    const Pulse &pulse = regs.pulse[index];
+    uint16_t change = pulse.period >> pulse.sweep_shift;
+    if (pulse.sweep_negate)
+        return pulse.period - change - (index == 0);
+    return pulse.period + change;
+}
+
+uint8_t APU::pulse_volume(unsigned index)
+{
+    const Pulse &pulse = regs.pulse[index];
+    if (!pulse.length || pulse.period < 8 || (!pulse.sweep_negate && sweep_target(index) > 0x7FF))
+        return 0;
+    return envelope_volume(pulse.envelope, pulse.constant, pulse.volume);
+}
+
+void APU::run_pulse(unsigned index, uint64_t from, uint64_t to)
+{
+    Pulse &pulse = regs.pulse[index];
+    uint8_t volume = pulse_volume(index);
+    uint64_t period = (pulse.period + 1) * 2;
+    uint64_t time = from + pulse.timer;
+    set_level(pulse.level, (DUTY_TABLE[pulse.duty] >> pulse.step) & 0x01 ? volume : 0, from, PULSE_GAIN);
+    if (!sink || !volume) {
+        uint64_t steps = steps_before(time, to, period);
+        pulse.step = (pulse.step + steps) & 0x07;
+        time += steps * period;
+    }
+    for (; time < to; time += period) {
+        pulse.step = (pulse.step + 1) & 0x07;
+        set_level(pulse.level, (DUTY_TABLE[pulse.duty] >> pulse.step) & 0x01 ? volume : 0, time, PULSE_GAIN);
+    }
+    pulse.timer = time - to;
+}
+
+void APU::run_triangle(uint64_t from, uint64_t to)
+{
+    Triangle &triangle = regs.triangle;
+    set_level(triangle.level, triangle_value(triangle.step), from, TRIANGLE_GAIN);
+    if (!triangle.length || !triangle.linear || triangle.period < 2)
+        return;
+    uint64_t period = triangle.period + 1;
+    uint64_t time = from + triangle.timer;
+    if (!sink) {
+        uint64_t steps = steps_before(time, to, period);
+        triangle.step = (triangle.step + steps) & 0x1F;
+        time += steps * period;
+    }
+    for (; time < to; time += period) {
+        triangle.step = (triangle.step + 1) & 0x1F;
+        set_level(triangle.level, triangle_value(triangle.step), time, TRIANGLE_GAIN);
+    }
+    triangle.timer = time - to;
+}
+
+void APU::run_noise(uint64_t from, uint64_t to)
+{
+    Noise &noise = regs.noise;
+    uint8_t volume = noise.length ? envelope_volume(noise.envelope, noise.constant, noise.volume) : 0;
+    unsigned tap = noise.mode ? 6 : 1;
+    uint64_t time = from + noise.timer;
+    set_level(noise.level, noise.lfsr & 0x01 ? 0 : volume, from, NOISE_GAIN);
+    if (!sink || !volume) {
+        uint64_t steps = steps_before(time, to, noise.period);
+        noise.lfsr = advance_lfsr(noise.lfsr, noise.mode, steps);
+        time += steps * noise.period;
+    }
+    for (; time < to; time += noise.period) {
+        noise.lfsr = clock_lfsr(noise.lfsr, tap);
+        set_level(noise.level, noise.lfsr & 0x01 ? 0 : volume, time, NOISE_GAIN);
+    }
+    noise.timer = time - to;
+}
+
+void APU::run_dmc(uint64_t from, uint64_t to)
+{
+    Dmc &dmc = regs.dmc;
+    uint64_t time = from + dmc.timer;
+    set_level(dmc.level, dmc.output, from, DMC_GAIN);
+    for (; time < to; time += dmc.period) {
+        if (!dmc.silence) {
+            if (dmc.shift & 0x01) {
+                if (dmc.output <= 125)
+                    dmc.output += 2;
+            } else if (dmc.output >= 2) {
+                dmc.output -= 2;
+            }
+            set_level(dmc.level, dmc.output, time, DMC_GAIN);
+        }
+        dmc.shift >>= 1;
+        if (--dmc.bits)
+            continue;
+        dmc.bits = 8;
+        dmc.silence = !dmc.buffer_full;
+        if (dmc.buffer_full) {
+            dmc.shift = dmc.buffer;
+            dmc.buffer_full = 0;
+            fetch_sample();
+        }
+    }
+    dmc.timer = time - to;
+}
+
+void APU::fetch_sample()
+{
+    Dmc &dmc = regs.dmc;
+    if (dmc.buffer_full || !dmc.remaining)
+        return;
+    dmc.buffer = dma.peek(dmc.addr);
+    dmc.buffer_full = 1;
+    dmc.addr = dmc.addr == 0xFFFF ? 0x8000 : dmc.addr + 1;
+    if (--dmc.remaining)
+        return;
+    if (dmc.loop) {
+        dmc.addr = dmc.start;
+        dmc.remaining = dmc.sample_length;
+    } else if (dmc.irq_enabled) {
+        regs.dmc_irq = 1;
+    }
+}
+
+void APU::clock_quarter_frame()
+{
+    for (unsigned i = 0; i < 2; ++i)
+        clock_envelope(regs.pulse[i].envelope, regs.pulse[i].halt, regs.pulse[i].volume);
+    clock_envelope(regs.noise.envelope, regs.noise.halt, regs.noise.volume);
+    Triangle &triangle = regs.triangle;
+    if (triangle.linear_reload)
+        triangle.linear = triangle.linear_load;
+    else if (triangle.linear)
+        --triangle.linear;
+    if (!triangle.control)
+        triangle.linear_reload = 0;
+}
+
+void APU::clock_half_frame()
+{
+    for (unsigned i = 0; i < 2; ++i) {
+        Pulse &pulse = regs.pulse[i];
+        if (!pulse.halt && pulse.length)
+            --pulse.length;
+        uint16_t target = sweep_target(i);
+        if (!pulse.sweep_divider && pulse.sweep_enabled && pulse.sweep_shift && pulse.period >= 8 && target <= 0x7FF)
+            pulse.period = target;
+        if (!pulse.sweep_divider || pulse.sweep_reload) {
+            pulse.sweep_divider = pulse.sweep_period;
+            pulse.sweep_reload = 0;
+        } else {
+            --pulse.sweep_divider;
+        }
+    }
+    if (!regs.triangle.control && regs.triangle.length)
+        --regs.triangle.length;
+    if (!regs.noise.halt && regs.noise.length)
+        --regs.noise.length;
+}
+
+void APU::clock_frame()
+{
+    clock_quarter_frame();
+    if (regs.frame_step & 0x01)
+        clock_half_frame();
+    if (regs.frame_step < 3) {
+        ++regs.frame_step;
+        return;
+    }
+    if (!regs.frame_mode && !regs.irq_inhibit)
+        regs.frame_irq = 1;
+    regs.frame_start += FRAME_STEPS[regs.frame_mode][4];
+    regs.frame_step = 0;
+}
+
+void APU::end_block(uint64_t cycle)
+{
+    uint64_t position = (cycle - block_start) * RATIO + block_phase;
+    unsigned count = position >> 32;
+    if (sink && count) {
+        float carry = integrator;
+        unsigned i = 0;
+#ifdef __SSE2__
+        const __m128 leak1 = _mm_set1_ps(LEAK);
+        const __m128 leak2 = _mm_set1_ps(LEAK * LEAK);
+        const __m128 powers = _mm_setr_ps(LEAK, LEAK * LEAK, LEAK * LEAK * LEAK, LEAK * LEAK * LEAK * LEAK);
+        const __m128 scale = _mm_set1_ps(OUTPUT_SCALE);
+        __m128 sums[2];
+        for (; i + 8 <= count; i += 8) {
+            for (unsigned half = 0; half < 2; ++half) {
+                __m128 sum = _mm_loadu_ps(deltas + i + half * 4);
+                sum = _mm_add_ps(sum, _mm_mul_ps(leak1, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(sum), 4))));
+                sum = _mm_add_ps(sum, _mm_mul_ps(leak2, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(sum), 8))));
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(carry), powers));
+                carry = _mm_cvtss_f32(_mm_shuffle_ps(sum, sum, 0xFF));
+                sums[half] = _mm_mul_ps(sum, scale);
+            }
+            __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(sums[0]), _mm_cvtps_epi32(sums[1]));
+            _mm_storeu_si128((__m128i *) (samples + i), packed);
+        }
+#endif // __SSE2__
+        for (; i < count; ++i) {
+            carry = carry * LEAK + deltas[i];
+            float sample = carry * OUTPUT_SCALE;
+            samples[i] = (int16_t) lrintf(min(max(sample, -32768.0f), 32767.0f));
+        }
+        integrator = fabsf(carry) < 1e-20f ? 0.0f : carry;
+        sink->write(samples, count);
+    }
+    memmove(deltas, deltas + count, BLEP_TAPS * sizeof(float));
+    memset(deltas + BLEP_TAPS, 0, count * sizeof(float));
+    block_start = cycle;
+    block_phase = (uint32_t) position;
+}
+
+APU::APU(DMA &dma) : dma(dma), clock(nullptr), sink(nullptr), kernel(build_kernel())
+{
+    noise_sequences();
+    reset();
+}
+
+void APU::set_clock(const uint64_t *clock)
+{
+    this->clock = clock;
+}
+
+void APU::set_sink(AudioSink *sink)
+{
+    this->sink = sink;
+    integrator = 0.0f;
+    memset(deltas, 0, sizeof(deltas));
+}
+
+void APU::reset()
+{
+    memset(&regs, 0, sizeof(regs));
+    regs.noise.lfsr = 1;
+    regs.noise.period = NOISE_PERIODS[0];
+    regs.dmc.period = DMC_PERIODS[0];
+    regs.dmc.bits = 8;
+    regs.dmc.silence = 1;
+    block_start = 0;
+    block_phase = 0;
+    integrator = 0.0f;
+    memset(deltas, 0, sizeof(deltas));
+}
+
+void APU::run_until(uint64_t cycle)
+{
+    while (regs.cycle < cycle) {
+        uint64_t frame_event = regs.frame_start + FRAME_STEPS[regs.frame_mode][regs.frame_step];
+        uint64_t block_end = block_start + BLOCK_CYCLES;
+        uint64_t end = min(min(cycle, frame_event), block_end);
+        if (end > regs.cycle) {
+            run_pulse(0, regs.cycle, end);
+            run_pulse(1, regs.cycle, end);
+            run_triangle(regs.cycle, end);
+            run_noise(regs.cycle, end);
+            run_dmc(regs.cycle, end);
+            regs.cycle = end;
+        }
+        if (regs.cycle >= frame_event)
+            clock_frame();
+        if (regs.cycle >= block_end)
+            end_block(regs.cycle);
+    }
+}
+
+void APU::sync()
+{
+    if (clock)
+        run_until(*clock);
+}
+
+void APU::flush()
+{
+    sync();
+    end_block(regs.cycle);
+}
+
+uint8_t APU::read_status()
+{
+    uint8_t data = (regs.pulse[0].length ? 0x01 : 0) | (regs.pulse[1].length ? 0x02 : 0) |
+        (regs.triangle.length ? 0x04 : 0) | (regs.noise.length ? 0x08 : 0) |
+        (regs.dmc.remaining ? 0x10 : 0) | (regs.frame_irq ? 0x40 : 0) | (regs.dmc_irq ? 0x80 : 0);
+    regs.frame_irq = 0;
+    return data;
+}
+
+void APU::write_register(uint16_t addr, uint8_t data)
+{
+    switch (addr) {
+    case 0x4000:
+    case 0x4004: {
+        Pulse &pulse = regs.pulse[(addr >> 2) & 0x01];
+        pulse.duty = data >> 6;
+        pulse.halt = (data >> 5) & 0x01;
+        pulse.constant = (data >> 4) & 0x01;
+        pulse.volume = data & 0x0F;
+        break;
+    }
+    case 0x4001:
+    case 0x4005: {
+        Pulse &pulse = regs.pulse[(addr >> 2) & 0x01];
+        pulse.sweep_enabled = data >> 7;
+        pulse.sweep_period = (data >> 4) & 0x07;
+        pulse.sweep_negate = (data >> 3) & 0x01;
+        pulse.sweep_shift = data & 0x07;
+        pulse.sweep_reload = 1;
+        break;
+    }
+    case 0x4002:
+    case 0x4006: {
+        Pulse &pulse = regs.pulse[(addr >> 2) & 0x01];
+        pulse.period = (pulse.period & 0x0700) | data;
+        break;
+    }
+    case 0x4003:
+    case 0x4007: {
+        unsigned index = (addr >> 2) & 0x01;
+        Pulse &pulse = regs.pulse[index];
+        pulse.period = (pulse.period & 0x00FF) | ((data & 0x07) << 8);
+        if (regs.enabled & (1 << index))
+            pulse.length = LENGTH_TABLE[data >> 3];
+        pulse.step = 0;
+        pulse.envelope.start = 1;
+        break;
+    }
+    case 0x4008:
+        regs.triangle.control = data >> 7;
+        regs.triangle.linear_load = data & 0x7F;
+        break;
+    case 0x400A:
+        regs.triangle.period = (regs.triangle.period & 0x0700) | data;
+        break;
+    case 0x400B:
+        regs.triangle.period = (regs.triangle.period & 0x00FF) | ((data & 0x07) << 8);
+        if (regs.enabled & 0x04)
+            regs.triangle.length = LENGTH_TABLE[data >> 3];
+        regs.triangle.linear_reload = 1;
+        break;
+    case 0x400C:
+        regs.noise.halt = (data >> 5) & 0x01;
+        regs.noise.constant = (data >> 4) & 0x01;
+        regs.noise.volume = data & 0x0F;
+        break;
+    case 0x400E:
+        regs.noise.mode = data >> 7;
+        regs.noise.period = NOISE_PERIODS[data & 0x0F];
+        break;
+    case 0x400F:
+        if (regs.enabled & 0x08)
+            regs.noise.length = LENGTH_TABLE[data >> 3];
+        regs.noise.envelope.start = 1;
+        break;
+    case 0x4010:
+        regs.dmc.irq_enabled = data >> 7;
+        regs.dmc.loop = (data >> 6) & 0x01;
+        regs.dmc.period = DMC_PERIODS[data & 0x0F];
+        if (!regs.dmc.irq_enabled)
+            regs.dmc_irq = 0;
+        break;
+    case 0x4011:
+        regs.dmc.output = data & 0x7F;
+        break;
+    case 0x4012:
+        regs.dmc.start = 0xC000 | (data << 6);
+        break;
+    case 0x4013:
+        regs.dmc.sample_length = (data << 4) | 0x01;
+        break;
+    case 0x4015:
+        regs.enabled = data & 0x1F;
+        if (!(data & 0x01))
+            regs.pulse[0].length = 0;
+        if (!(data & 0x02))
+            regs.pulse[1].length = 0;
+        if (!(data & 0x04))
+            regs.triangle.length = 0;
+        if (!(data & 0x08))
+            regs.noise.length = 0;
+        if (!(data & 0x10)) {
+            regs.dmc.remaining = 0;
+        } else if (!regs.dmc.remaining) {
+            regs.dmc.addr = regs.dmc.start;
+            regs.dmc.remaining = regs.dmc.sample_length;
+            fetch_sample();
+        }
+        regs.dmc_irq = 0;
+        break;
+    case 0x4017:
+        regs.frame_mode = data >> 7;
+        regs.irq_inhibit = (data >> 6) & 0x01;
+        if (regs.irq_inhibit)
+            regs.frame_irq = 0;
+        regs.frame_start = regs.cycle + 3 + (regs.cycle & 0x01);
+        regs.frame_step = 0;
+        if (regs.frame_mode) {
+            clock_quarter_frame();
+            clock_half_frame();
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+bool APU::irq_pending()
+{
+    return regs.frame_irq || regs.dmc_irq;
+}
+
+uint64_t APU::next_frame_irq_cycle()
+{
+    if (regs.frame_mode || regs.irq_inhibit)
+        return UINT64_MAX;
+    return regs.frame_start + FRAME_STEPS[0][3];
+}
+
+uint64_t APU::next_dmc_irq_cycle()
+{
+    const Dmc &dmc = regs.dmc;
+    if (!dmc.irq_enabled || dmc.loop || !dmc.remaining)
+        return UINT64_MAX;
+    uint64_t fetch = regs.cycle + dmc.timer + (uint64_t) (dmc.bits - 1) * dmc.period;
+    return fetch + (uint64_t) (dmc.remaining - 1) * 8 * dmc.period + 1;
+}
+
+size_t APU::state_size()
+{
+    return sizeof(regs);
+}
+
+void APU::save_state(uint8_t *buffer)
+{
+    memcpy(buffer, &regs, sizeof(regs));
+}
+
+void APU::load_state(const uint8_t *buffer)
+{
+    memcpy(&regs, buffer, sizeof(regs));
+    block_start = regs.cycle;
+    block_phase = 0;
+    memset(deltas, 0, sizeof(deltas));
+}
@@ -0,0 +1,143 @@
+#ifndef APU_H
+#define APU_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "audio.h"
+
+class DMA;
+
+class APU {
+public:
+    static const unsigned SAMPLE_RATE = 48000;
+    static const uint64_t CPU_RATE = 1789773;
+private:
+    static const unsigned BLEP_PHASES = 32;
+    static const unsigned BLEP_TAPS = 16;
+    static const unsigned BUFFER_SIZE = 1024;
+    static const uint64_t BLOCK_CYCLES = 32768;
+    struct Envelope {
+        uint8_t start;
+        uint8_t divider;
+        uint8_t decay;
+    };
+    struct Pulse {
+        uint32_t timer;
+        uint16_t period;
+        uint8_t duty;
+        uint8_t step;
+        uint8_t length;
+        uint8_t halt;
+        uint8_t constant;
+        uint8_t volume;
+        Envelope envelope;
+        uint8_t sweep_enabled;
+        uint8_t sweep_period;
+        uint8_t sweep_negate;
+        uint8_t sweep_shift;
+        uint8_t sweep_divider;
+        uint8_t sweep_reload;
+        uint8_t level;
+    };
+    struct Triangle {
+        uint32_t timer;
+        uint16_t period;
+        uint8_t step;
+        uint8_t length;
+        uint8_t control;
+        uint8_t linear;
+        uint8_t linear_load;
+        uint8_t linear_reload;
+        uint8_t level;
+    };
+    struct Noise {
+        uint32_t timer;
+        uint16_t period;
+        uint16_t lfsr;
+        uint8_t mode;
+        uint8_t length;
+        uint8_t halt;
+        uint8_t constant;
+        uint8_t volume;
+        Envelope envelope;
+        uint8_t level;
+    };
+    struct Dmc {
+        uint32_t timer;
+        uint16_t period;
+        uint16_t start;
+        uint16_t addr;
+        uint16_t sample_length;
+        uint16_t remaining;
+        uint8_t irq_enabled;
+        uint8_t loop;
+        uint8_t output;
+        uint8_t shift;
+        uint8_t bits;
+        uint8_t buffer;
+        uint8_t buffer_full;
+        uint8_t silence;
+        uint8_t level;
+    };
+    struct Registers {
+        uint64_t cycle;
+        uint64_t frame_start;
+        uint8_t frame_mode;
+        uint8_t frame_step;
+        uint8_t irq_inhibit;
+        uint8_t frame_irq;
+        uint8_t dmc_irq;
+        uint8_t enabled;
+        Pulse pulse[2];
+        Triangle triangle;
+        Noise noise;
+        Dmc dmc;
+    };
+    DMA &dma;
+    const uint64_t *clock;
+    AudioSink *sink;
+    const float *kernel;
+    Registers regs;
+    uint64_t block_start;
+    uint32_t block_phase;
+    float integrator;
+    float deltas[BUFFER_SIZE + BLEP_TAPS];
+    int16_t samples[BUFFER_SIZE];
+    static const float *build_kernel();
+    void add_delta(uint64_t cycle, float amount);
+    void set_level(uint8_t &level, uint8_t value, uint64_t cycle, float gain);
+    uint8_t envelope_volume(const Envelope &envelope, uint8_t constant, uint8_t volume);
+    void clock_envelope(Envelope &envelope, uint8_t loop, uint8_t volume);
+    uint16_t sweep_target(unsigned index);
+    uint8_t pulse_volume(unsigned index);
+    void run_pulse(unsigned index, uint64_t from, uint64_t to);
+    void run_triangle(uint64_t from, uint64_t to);
+    void run_noise(uint64_t from, uint64_t to);
+    void run_dmc(uint64_t from, uint64_t to);
+    void fetch_sample();
+    void clock_quarter_frame();
+    void clock_half_frame();
+    void clock_frame();
+    void end_block(uint64_t cycle);
+public:
+    APU(DMA &dma);
+    APU(const APU &) = delete;
+    APU &operator=(const APU &) = delete;
+    void set_clock(const uint64_t *clock);
+    void set_sink(AudioSink *sink);
+    void reset();
+    void run_until(uint64_t cycle);
+    void sync();
+    void flush();
+    uint8_t read_status();
+    void write_register(uint16_t addr, uint8_t data);
+    bool irq_pending();
+    uint64_t next_frame_irq_cycle();
+    uint64_t next_dmc_irq_cycle();
+    size_t state_size();
+    void save_state(uint8_t *buffer);
+    void load_state(const uint8_t *buffer);
+};
+
+#endif // APU_H
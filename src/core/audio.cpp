@@ -0,0 +1,90 @@
+#include "audio.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+static void put_le(uint8_t *buffer, uint32_t value, unsigned bytes)
+{
+    for (unsigned i = 0; i < bytes; ++i)
+        buffer[i] = value >> (i * 8);
+}
+
+AudioSink::~AudioSink() {}
+
+NullAudioSink::NullAudioSink() : samples(0) {}
+
+void NullAudioSink::write(const int16_t *, size_t count)
+{
+    samples += count;
+}
+
+uint64_t NullAudioSink::get_samples()
+{
+    return samples;
+}
+
+void WavAudioSink::write_header()
+{
+    uint32_t size = data_size > 0xFFFFFFFFULL - 36 ? 0xFFFFFFFF - 36 : (uint32_t) data_size;
+    uint8_t header[44];
+    memcpy(header, "RIFF", 4);
+    put_le(header + 4, 36 + size, 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    put_le(header + 16, 16, 4);
+    put_le(header + 20, 1, 2);
+    put_le(header + 22, 1, 2);
+    put_le(header + 24, rate, 4);
+    put_le(header + 28, rate * 2, 4);
+    put_le(header + 32, 2, 2);
+    put_le(header + 34, 16, 2);
+    memcpy(header + 36, "data", 4);
+    put_le(header + 40, size, 4);
+    if (fseek(file, 0, SEEK_SET) || fwrite(header, 1, sizeof(header), file) != sizeof(header))
+        ++errors;
+}
+
+WavAudioSink::WavAudioSink(const string &filename, unsigned rate) : rate(rate), data_size(0), errors(0)
+{
+    file = fopen(filename.c_str(), "wb");
+    if (!file)
+        throw runtime_error("unable to open wav file");
+    write_header();
+}
+
+WavAudioSink::~WavAudioSink()
+{
+    close();
+}
+
+void WavAudioSink::write(const int16_t *samples, size_t count)
+{
+    uint8_t buffer[2048];
+    while (count) {
+        size_t chunk = min(count, sizeof(buffer) / 2);
+        for (size_t i = 0; i < chunk; ++i)
+            put_le(buffer + i * 2, (uint16_t) samples[i], 2);
+        if (fwrite(buffer, 2, chunk, file) != chunk)
+            ++errors;
+        data_size += chunk * 2;
+        samples += chunk;
+        count -= chunk;
+    }
+}
+
+void WavAudioSink::close()
+{
+    if (!file)
+        return;
+    write_header();
+    if (fclose(file))
+        ++errors;
+    file = nullptr;
+}
+
+uint64_t WavAudioSink::get_errors()
+{
+    return errors;
+}
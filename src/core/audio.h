@@ -0,0 +1,41 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+class AudioSink {
+public:
+    virtual ~AudioSink();
+    virtual void write(const int16_t *samples, size_t count) = 0;
+};
+
+class NullAudioSink : public AudioSink {
+private:
+    uint64_t samples;
+public:
+    NullAudioSink();
+    void write(const int16_t *samples, size_t count) override;
+    uint64_t get_samples();
+};
+
+class WavAudioSink : public AudioSink {
+private:
+    FILE *file;
+    unsigned rate;
+    uint64_t data_size;
+    uint64_t errors;
+    void write_header();
+public:
+    WavAudioSink(const std::string &filename, unsigned rate);
+    ~WavAudioSink();
+    WavAudioSink(const WavAudioSink &) = delete;
+    WavAudioSink &operator=(const WavAudioSink &) = delete;
+    void write(const int16_t *samples, size_t count) override;
+    void close();
+    uint64_t get_errors();
+};
+
+#endif // AUDIO_H
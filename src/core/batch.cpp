@@ -0,0 +1,194 @@
+#include "batch.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+static const size_t CACHE_LINE = 64;
+
+template <typename T>
+static T *aligned_array(vector<uint8_t> &storage, size_t count)
+{
+    storage.resize(count * sizeof(T) + CACHE_LINE);
+    uintptr_t addr = (uintptr_t) storage.data();
+    return (T *) ((addr + CACHE_LINE - 1) & ~(uintptr_t) (CACHE_LINE - 1));
+}
+
+void Batch::worker_loop(unsigned id)
+{
+    uint64_t seen = 0;
+    for (;;) {
+        {
+            unique_lock<std::mutex> lock(mutex);
+            start_cond.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+        }
+        run_worker(id);
+        unique_lock<std::mutex> lock(mutex);
+        if (--pending == 0)
+            done_cond.notify_one();
+    }
+}
+
+void Batch::run_worker(unsigned id)
+{
+    for (unsigned i = 0; i < threads; ++i) {
+        Cursor &cursor = cursors[(id + i) % threads];
+        for (;;) {
+            size_t index = cursor.next.fetch_add(1, memory_order_relaxed);
+            if (index >= cursor.end)
+                break;
+            step(index);
+        }
+    }
+}
+
+void Batch::step(size_t index)
+{
+    Instance &instance = instances[index];
+    if (job_inputs) {
+        instance.nes.set_buttons(0, job_inputs[index * 2]);
+        instance.nes.set_buttons(1, job_inputs[index * 2 + 1]);
+    }
+    if (!instance.halted) {
+        try {
+            if (job_frames) {
+                for (unsigned i = 0; i < job_frames; ++i)
+                    instance.nes.run_frame();
+            } else {
+                instance.nes.run_cycles(job_cycles);
+            }
+        } catch (const runtime_error &e) {
+            instance.halted = true;
+            instance.error = e.what();
+        }
+    }
+    uint8_t *out = observations.data() + index * observed.size();
+    for (size_t i = 0; i < observed.size(); ++i)
+        out[i] = instance.nes.peek(observed[i]);
+}
+
+void Batch::run_job()
+{
+    size_t begin = 0;
+    for (unsigned i = 0; i < threads; ++i) {
+        size_t end = count * (i + 1) / threads;
+        cursors[i].next.store(begin, memory_order_relaxed);
+        cursors[i].end = end;
+        begin = end;
+    }
+    {
+        lock_guard<std::mutex> lock(mutex);
+        pending = workers.size();
+        ++generation;
+    }
+    start_cond.notify_all();
+    run_worker(0);
+    unique_lock<std::mutex> lock(mutex);
+    done_cond.wait(lock, [&] { return pending == 0; });
+}
+
+Batch::Batch(const vector<uint8_t> &cartridge, size_t count, unsigned threads) :
+    count(count), threads(threads), generation(0), pending(0), stopping(false),
+    job_cycles(0), job_frames(0), job_inputs(nullptr)
+{
+    if (!this->threads)
+        this->threads = thread::hardware_concurrency();
+    if (!this->threads)
+        this->threads = 1;
+    cursors = aligned_array<Cursor>(cursor_storage, this->threads);
+    for (unsigned i = 0; i < this->threads; ++i) {
+        new (&cursors[i]) Cursor();
+        cursors[i].next.store(0);
+        cursors[i].end = 0;
+    }
+    instances = aligned_array<Instance>(instance_storage, count);
+    size_t built = 0;
+    try {
+        for (size_t i = 0; i < count; ++i) {
+            new (&instances[i]) Instance();
+            built = i + 1;
+            instances[i].halted = false;
+            instances[i].nes.load_cartridge(cartridge);
+        }
+        for (unsigned i = 1; i < this->threads; ++i)
+            workers.push_back(thread(&Batch::worker_loop, this, i));
+    } catch (...) {
+        release(built);
+        throw;
+    }
+}
+
+Batch::~Batch()
+{
+    release(count);
+}
+
+void Batch::release(size_t built)
+{
+    {
+        lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    start_cond.notify_all();
+    for (thread &worker : workers)
+        worker.join();
+    for (unsigned i = 0; i < threads; ++i)
+        cursors[i].~Cursor();
+    for (size_t i = 0; i < built; ++i)
+        instances[i].~Instance();
+}
+
+size_t Batch::size()
+{
+    return count;
+}
+
+unsigned Batch::thread_count()
+{
+    return threads;
+}
+
+NES &Batch::instance(size_t index)
+{
+    return instances[index].nes;
+}
+
+bool Batch::halted(size_t index)
+{
+    return instances[index].halted;
+}
+
+const string &Batch::error(size_t index)
+{
+    return instances[index].error;
+}
+
+void Batch::set_observed(const vector<uint16_t> &addrs)
+{
+    observed = addrs;
+    observations.assign(count * observed.size(), 0);
+}
+
+void Batch::run_cycles(uint64_t cycles, const uint8_t *inputs)
+{
+    job_cycles = cycles;
+    job_frames = 0;
+    job_inputs = inputs;
+    run_job();
+}
+
+void Batch::run_frames(unsigned frames, const uint8_t *inputs)
+{
+    job_cycles = 0;
+    job_frames = frames;
+    job_inputs = inputs;
+    run_job();
+}
+
+const uint8_t *Batch::get_observations()
+{
+    return observations.data();
+}
@@ -0,0 +1,64 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "nes.h"
+
+class Batch {
+private:
+    struct alignas(64) Instance {
+        NES nes;
+        bool halted;
+        std::string error;
+    };
+    struct alignas(64) Cursor {
+        std::atomic<size_t> next;
+        size_t end;
+    };
+    std::vector<uint8_t> instance_storage;
+    std::vector<uint8_t> cursor_storage;
+    Instance *instances;
+    Cursor *cursors;
+    size_t count;
+    unsigned threads;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable start_cond;
+    std::condition_variable done_cond;
+    uint64_t generation;
+    unsigned pending;
+    bool stopping;
+    uint64_t job_cycles;
+    unsigned job_frames;
+    const uint8_t *job_inputs;
+    std::vector<uint16_t> observed;
+    std::vector<uint8_t> observations;
+    void worker_loop(unsigned id);
+    void run_worker(unsigned id);
+    void step(size_t index);
+    void run_job();
+    void release(size_t built);
+public:
+    Batch(const std::vector<uint8_t> &cartridge, size_t count, unsigned threads = 0);
+    ~Batch();
+    Batch(const Batch &) = delete;
+    Batch &operator=(const Batch &) = delete;
+    size_t size();
+    unsigned thread_count();
+    NES &instance(size_t index);
+    bool halted(size_t index);
+    const std::string &error(size_t index);
+    void set_observed(const std::vector<uint16_t> &addrs);
+    void run_cycles(uint64_t cycles, const uint8_t *inputs = nullptr);
+    void run_frames(unsigned frames, const uint8_t *inputs = nullptr);
+    const uint8_t *get_observations();
+};
+
+#endif // BATCH_H
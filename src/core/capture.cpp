@@ -0,0 +1,234 @@
+#include "capture.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#include "apu.h"
+#include "ppu.h"
+
+using namespace std;
+
+static const uint32_t NES_PALETTE[64] = {
+    0x545454, 0x001E74, 0x081090, 0x300088, 0x440064, 0x5C0030, 0x540400, 0x3C1800,
+    0x202A00, 0x083A00, 0x004000, 0x003C00, 0x00323C, 0x000000, 0x000000, 0x000000,
+    0x989698, 0x084CC4, 0x3032EC, 0x5C1EE4, 0x8814B0, 0xA01464, 0x982220, 0x783C00,
+    0x545A00, 0x287200, 0x087C00, 0x007628, 0x006678, 0x000000, 0x000000, 0x000000,
+    0xECEEEC, 0x4C9AEC, 0x787CEC, 0xB062EC, 0xE454EC, 0xEC58B4, 0xEC6A64, 0xD48820,
+    0xA0AA00, 0x74C400, 0x4CD020, 0x38CC6C, 0x38B4CC, 0x3C3C3C, 0x000000, 0x000000,
+    0xECEEEC, 0xA8CCEC, 0xBCBCEC, 0xD4B2EC, 0xECAEEC, 0xECAED4, 0xECB4B0, 0xE4C490,
+    0xCCD278, 0xB4DE78, 0xA8E290, 0x98E2B4, 0xA0D6E4, 0xA0A2A0, 0x000000, 0x000000
+};
+static const size_t PIXELS = PPU::WIDTH * PPU::HEIGHT;
+static const size_t AUDIO_RESERVE = 2048;
+
+static uint8_t clamp_byte(double value)
+{
+    return value < 0.0 ? 0 : value > 255.0 ? 255 : (uint8_t) (value + 0.5);
+}
+
+Capture::Packet *Capture::acquire()
+{
+    size_t h = head.load(memory_order_relaxed);
+    while (h - tail.load(memory_order_acquire) > mask) {
+        if (policy == POLICY_DROP)
+            return nullptr;
+        this_thread::yield();
+    }
+    return &ring[h & mask];
+}
+
+void Capture::publish()
+{
+    head.store(head.load(memory_order_relaxed) + 1, memory_order_release);
+    lock_guard<mutex> lock(wake_mutex);
+    wake.notify_one();
+}
+
+void Capture::drain()
+{
+    size_t t = tail.load(memory_order_relaxed);
+    for (;;) {
+        bool stopping;
+        size_t h;
+        {
+            unique_lock<mutex> lock(wake_mutex);
+            wake.wait(lock, [&] {
+                return head.load(memory_order_acquire) != t || !running.load(memory_order_relaxed);
+            });
+            stopping = !running.load(memory_order_relaxed);
+            h = head.load(memory_order_acquire);
+        }
+        for (; t != h; ++t) {
+            const Packet &packet = ring[t & mask];
+            if (packet.kind == KIND_FRAME)
+                write_video(packet);
+            else
+                write_audio(packet);
+            tail.store(t + 1, memory_order_release);
+        }
+        update_errors();
+        if (stopping)
+            break;
+    }
+}
+
+void Capture::update_errors()
+{
+    write_errors.store(video_errors + (audio ? audio->get_errors() : 0), memory_order_relaxed);
+}
+
+void Capture::write_video(const Packet &packet)
+{
+    if (have_frame)
+        repeat_frame(packet.gap);
+    const uint8_t *pixels = packet.pixels.data();
+    for (unsigned plane = 0; plane < 3; ++plane) {
+        uint8_t *out = planes.data() + plane * PIXELS;
+        const uint8_t *table = yuv[plane];
+        for (size_t i = 0; i < PIXELS; ++i)
+            out[i] = table[pixels[i] & 0x3F];
+    }
+    repeat_frame(have_frame ? 1 : packet.gap + 1);
+    have_frame = true;
+}
+
+void Capture::write_audio(const Packet &packet)
+{
+    write_silence(packet.gap);
+    audio->write(packet.samples.data(), packet.count);
+}
+
+void Capture::repeat_frame(uint64_t count)
+{
+    for (uint64_t i = 0; i < count; ++i) {
+        if (fputs("FRAME\n", video) == EOF || fwrite(planes.data(), 1, planes.size(), video) != planes.size())
+            ++video_errors;
+    }
+}
+
+void Capture::write_silence(uint64_t count)
+{
+    static const int16_t zeros[512] = {};
+    while (count) {
+        size_t chunk = count < 512 ? count : 512;
+        audio->write(zeros, chunk);
+        count -= chunk;
+    }
+}
+
+Capture::Capture(const string &video_file, const string &audio_file, Policy policy, size_t capacity) :
+    policy(policy), video(nullptr), frame_gap(0), sample_gap(0), have_frame(false),
+    video_errors(0), head(0), tail(0), running(true), write_errors(0)
+{
+    if (capacity == 0 || (capacity & (capacity - 1)))
+        throw runtime_error("capture queue capacity must be a power of two");
+    if (!audio_file.empty())
+        audio.reset(new WavAudioSink(audio_file, APU::SAMPLE_RATE));
+    if (!video_file.empty()) {
+        video = fopen(video_file.c_str(), "wb");
+        if (!video)
+            throw runtime_error("unable to open video file");
+        if (fprintf(video, "YUV4MPEG2 W%u H%u F39375000:655171 Ip A8:7 C444\n", PPU::WIDTH, PPU::HEIGHT) < 0)
+            ++video_errors;
+    }
+    for (unsigned i = 0; i < 64; ++i) {
+        double r = NES_PALETTE[i] >> 16, g = (NES_PALETTE[i] >> 8) & 0xFF, b = NES_PALETTE[i] & 0xFF;
+        yuv[0][i] = clamp_byte(16.0 + (65.481 * r + 128.553 * g + 24.966 * b) / 255.0);
+        yuv[1][i] = clamp_byte(128.0 + (-37.797 * r - 74.203 * g + 112.0 * b) / 255.0);
+        yuv[2][i] = clamp_byte(128.0 + (112.0 * r - 93.786 * g - 18.214 * b) / 255.0);
+    }
+    planes.resize(PIXELS * 3);
+    ring.resize(capacity);
+    for (Packet &packet : ring) {
+        packet.pixels.resize(PIXELS);
+        packet.samples.resize(AUDIO_RESERVE);
+    }
+    mask = capacity - 1;
+    memset(&stats, 0, sizeof(stats));
+    worker = thread(&Capture::drain, this);
+}
+
+Capture::~Capture()
+{
+    finish();
+}
+
+void Capture::finish()
+{
+    if (!worker.joinable())
+        return;
+    {
+        lock_guard<mutex> lock(wake_mutex);
+        running.store(false, memory_order_relaxed);
+    }
+    wake.notify_one();
+    worker.join();
+    if (video) {
+        if (have_frame)
+            repeat_frame(frame_gap);
+        if (fclose(video))
+            ++video_errors;
+        video = nullptr;
+    }
+    if (audio) {
+        write_silence(sample_gap);
+        audio->close();
+    }
+    update_errors();
+}
+
+void Capture::write(const VideoFrame &frame)
+{
+    if (!video || !running.load(memory_order_relaxed))
+        return;
+    Packet *packet = acquire();
+    if (!packet) {
+        ++stats.dropped_frames;
+        ++frame_gap;
+        return;
+    }
+    packet->kind = KIND_FRAME;
+    packet->gap = frame_gap;
+    packet->count = PIXELS;
+    memcpy(packet->pixels.data(), frame.pixels, PIXELS);
+    frame_gap = 0;
+    ++stats.frames;
+    publish();
+}
+
+void Capture::write(const int16_t *samples, size_t count)
+{
+    if (!audio || !running.load(memory_order_relaxed))
+        return;
+    Packet *packet = acquire();
+    if (!packet) {
+        stats.dropped_samples += count;
+        sample_gap += count;
+        return;
+    }
+    packet->kind = KIND_AUDIO;
+    packet->gap = sample_gap;
+    packet->count = count;
+    if (packet->samples.size() < count)
+        packet->samples.resize(count);
+    memcpy(packet->samples.data(), samples, count * sizeof(int16_t));
+    sample_gap = 0;
+    stats.samples += count;
+    publish();
+}
+
+Capture::Stats Capture::get_stats()
+{
+    Stats result = stats;
+    result.write_errors = write_errors.load(memory_order_relaxed);
+    return result;
+}
+
+Capture::Policy Capture::policy_by_name(const string &name)
+{
+    if (name == "block")
+        return POLICY_BLOCK;
+    if (name == "drop")
+        return POLICY_DROP;
+    throw runtime_error("unknown capture policy: " + name);
+}
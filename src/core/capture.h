@@ -0,0 +1,86 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "audio.h"
+#include "video.h"
+
+class Capture : public FrameSink, public AudioSink {
+public:
+    enum Policy {
+        POLICY_BLOCK,
+        POLICY_DROP
+    };
+    struct Stats {
+        uint64_t frames;
+        uint64_t dropped_frames;
+        uint64_t samples;
+        uint64_t dropped_samples;
+        uint64_t write_errors;
+    };
+private:
+    enum Kind {
+        KIND_FRAME,
+        KIND_AUDIO
+    };
+    struct Packet {
+        Kind kind;
+        uint64_t gap;
+        size_t count;
+        std::vector<uint8_t> pixels;
+        std::vector<int16_t> samples;
+    };
+    Policy policy;
+    FILE *video;
+    std::unique_ptr<WavAudioSink> audio;
+    std::vector<Packet> ring;
+    size_t mask;
+    Stats stats;
+    uint64_t frame_gap;
+    uint64_t sample_gap;
+    uint8_t yuv[3][64];
+    std::vector<uint8_t> planes;
+    bool have_frame;
+    uint64_t video_errors;
+    uint8_t pad0[64];
+    std::atomic<size_t> head;
+    uint8_t pad1[64];
+    std::atomic<size_t> tail;
+    uint8_t pad2[64];
+    std::atomic<bool> running;
+    std::atomic<uint64_t> write_errors;
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    std::thread worker;
+    Packet *acquire();
+    void publish();
+    void drain();
+    void update_errors();
+    void write_video(const Packet &packet);
+    void write_audio(const Packet &packet);
+    void repeat_frame(uint64_t count);
+    void write_silence(uint64_t count);
+public:
+    Capture(const std::string &video_file, const std::string &audio_file, Policy policy = POLICY_BLOCK,
+            size_t capacity = 64);
+    ~Capture();
+    Capture(const Capture &) = delete;
+    Capture &operator=(const Capture &) = delete;
+    void write(const VideoFrame &frame) override;
+    void write(const int16_t *samples, size_t count) override;
+    void finish();
+    Stats get_stats();
+    static Policy policy_by_name(const std::string &name);
+};
+
+#endif // CAPTURE_H
@@ -0,0 +1,61 @@
+#include "controller.h"
+
+#include <cstring>
+
+using namespace std;
+
+Controller::Controller() : strobe(0)
+{
+    buttons[0] = buttons[1] = 0;
+    shift[0] = shift[1] = 0;
+}
+
+void Controller::set_buttons(unsigned port, uint8_t buttons)
+{
+    this->buttons[port & 1] = buttons;
+    if (strobe)
+        shift[port & 1] = buttons;
+}
+
+uint8_t Controller::get_buttons(unsigned port)
+{
+    return buttons[port & 1];
+}
+
+uint8_t Controller::read(unsigned port)
+{
+    port &= 1;
+    if (strobe)
+        return buttons[port] & 0x01;
+    uint8_t bit = shift[port] & 0x01;
+    shift[port] = (shift[port] >> 1) | 0x80;
+    return bit;
+}
+
+void Controller::write(uint8_t data)
+{
+    strobe = data & 0x01;
+    if (strobe) {
+        shift[0] = buttons[0];
+        shift[1] = buttons[1];
+    }
+}
+
+size_t Controller::state_size()
+{
+    return sizeof(buttons) + sizeof(shift) + sizeof(strobe);
+}
+
+void Controller::save_state(uint8_t *buffer)
+{
+    memcpy(buffer, buttons, sizeof(buttons));
+    memcpy(buffer + sizeof(buttons), shift, sizeof(shift));
+    buffer[sizeof(buttons) + sizeof(shift)] = strobe;
+}
+
+void Controller::load_state(const uint8_t *buffer)
+{
+    memcpy(buttons, buffer, sizeof(buttons));
+    memcpy(shift, buffer + sizeof(buttons), sizeof(shift));
+    strobe = buffer[sizeof(buttons) + sizeof(shift)];
+}
@@ -0,0 +1,33 @@
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#include <cstddef>
+#include <cstdint>
+
+class Controller {
+private:
+    uint8_t buttons[2];
+    uint8_t shift[2];
+    uint8_t strobe;
+public:
+    enum Button {
+        BUTTON_A = 0x01,
+        BUTTON_B = 0x02,
+        BUTTON_SELECT = 0x04,
+        BUTTON_START = 0x08,
+        BUTTON_UP = 0x10,
+        BUTTON_DOWN = 0x20,
+        BUTTON_LEFT = 0x40,
+        BUTTON_RIGHT = 0x80
+    };
+    Controller();
+    void set_buttons(unsigned port, uint8_t buttons);
+    uint8_t get_buttons(unsigned port);
+    uint8_t read(unsigned port);
+    void write(uint8_t data);
+    size_t state_size();
+    void save_state(uint8_t *buffer);
+    void load_state(const uint8_t *buffer);
+};
+
+#endif // CONTROLLER_H
@@ -1,47 +1,140 @@
 #include "cpu.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <stdexcept>
 
+#ifdef USE_JIT
+#include "jit.h"
+#endif // USE_JIT
+#ifdef USE_PERF
+#include "perf.h"
+#endif // USE_PERF
+
+#ifndef CPU_ENGINE
+#define CPU_ENGINE ENGINE_SWITCH
+#endif // CPU_ENGINE
+
 using namespace std;
 
+const uint8_t CPU::cycle_table[0x100] = {
+    7, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 0, 4, 6, 0,
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+    6, 6, 0, 0, 3, 3, 5, 0, 4, 2, 2, 0, 4, 4, 6, 0,
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+    6, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 3, 4, 6, 0,
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+    6, 6, 0, 0, 0, 3, 5, 0, 4, 2, 2, 0, 5, 4, 6, 0,
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+    0, 6, 0, 0, 3, 3, 3, 0, 2, 0, 2, 0, 4, 4, 4, 0,
+    2, 6, 0, 0, 4, 4, 4, 0, 2, 5, 2, 0, 0, 5, 0, 0,
+    2, 6, 2, 0, 3, 3, 3, 0, 2, 2, 2, 0, 4, 4, 4, 0,
+    2, 5, 0, 0, 4, 4, 4, 0, 2, 4, 2, 0, 4, 4, 4, 0,
+    2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0,
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0,
+    2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0,
+    2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0
+};
+
+const uint8_t CPU::page_cross_table[0x100] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 1, 1, 1, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 1, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0, 1, 0, 0
+};
+
 void CPU::set_flag(Flag flag)
 {
-    reg[REG_P] |= 1 << flag;
+    set_flag(flag, true);
 }
 
 void CPU::clr_flag(Flag flag)
 {
-    reg[REG_P] &= ~(1 << flag);
+    set_flag(flag, false);
 }
 
 uint8_t CPU::get_flag(Flag flag)
 {
-    return (reg[REG_P] >> flag) & 1;
+    switch (flag) {
+    case FLAG_C:
+        return flag_c;
+    case FLAG_Z:
+        return (flag_nz & 0xFF) == 0;
+    case FLAG_V:
+        return flag_v;
+    case FLAG_N:
+        return (((flag_nz >> 8) | flag_nz) & 0x80) != 0;
+    default:
+        return (reg[REG_P] >> flag) & 1;
+    }
 }
 
 void CPU::set_flag(Flag flag, bool on)
 {
-    if (on)
-        set_flag(flag);
-    else
-        clr_flag(flag);
+    switch (flag) {
+    case FLAG_C:
+        flag_c = on;
+        break;
+    case FLAG_Z:
+        flag_nz = (get_flag(FLAG_N) << 15) | !on;
+        break;
+    case FLAG_V:
+        flag_v = on;
+        break;
+    case FLAG_N:
+        flag_nz = (on << 15) | !get_flag(FLAG_Z);
+        break;
+    default:
+        if (on)
+            reg[REG_P] |= 1 << flag;
+        else
+            reg[REG_P] &= ~(1 << flag);
+        break;
+    }
 }
 
-void CPU::N_flag(uint8_t data)
+void CPU::NZ_flag(uint8_t data)
 {
-    set_flag(FLAG_N, (data & 0x80) != 0);
+    flag_nz = data;
 }
 
-void CPU::Z_flag(uint8_t data)
+uint8_t CPU::get_p()
 {
-    set_flag(FLAG_Z, data == 0);
+    return (reg[REG_P] & 0x3C) | get_flag(FLAG_C) | (get_flag(FLAG_Z) << FLAG_Z) |
+        (get_flag(FLAG_V) << FLAG_V) | (get_flag(FLAG_N) << FLAG_N);
 }
 
-void CPU::NZ_flag(uint8_t data)
+void CPU::set_p(uint8_t data)
+{
+    reg[REG_P] = data;
+    flag_c = data & 0x01;
+    flag_v = (data >> FLAG_V) & 0x01;
+    flag_nz = ((data & 0x80) << 8) | !(data & 0x02);
+}
+
+void CPU::page_cross(uint16_t base, uint16_t addr)
 {
-    N_flag(data);
-    Z_flag(data);
+    if ((base ^ addr) & 0xFF00)
+        cycles += page_penalty;
+}
+
+void CPU::branch(uint16_t target)
+{
+    cycles += ((pc ^ target) & 0xFF00) ? 2 : 1;
+    pc = target;
 }
 
 void CPU::stack_push(uint8_t data)
@@ -84,7 +177,9 @@ uint16_t CPU::addr_absX()
 #ifdef PRINT_TRACE
     puts("Addressing Mode: absX");
 #endif // PRINT_TRACE
-    uint16_t ret = dma.read_dword(pc) + reg[REG_X];
+    uint16_t base = dma.read_dword(pc);
+    uint16_t ret = base + reg[REG_X];
+    page_cross(base, ret);
     pc += 2;
     return ret;
 }
@@ -94,7 +189,9 @@ uint16_t CPU::addr_absY()
 #ifdef PRINT_TRACE
     puts("Addressing Mode: absY");
 #endif // PRINT_TRACE
-    uint16_t ret = dma.read_dword(pc) + reg[REG_Y];
+    uint16_t base = dma.read_dword(pc);
+    uint16_t ret = base + reg[REG_Y];
+    page_cross(base, ret);
     pc += 2;
     return ret;
 }
@@ -130,7 +227,10 @@ uint16_t CPU::addr_indY()
 #ifdef PRINT_TRACE
     puts("Addressing Mode: indY");
 #endif // PRINT_TRACE
-    return dma.read_dword(dma.read(pc++)) + reg[REG_Y];
+    uint16_t base = dma.read_dword(dma.read(pc++));
+    uint16_t ret = base + reg[REG_Y];
+    page_cross(base, ret);
+    return ret;
 }
 
 uint16_t CPU::addr_rel()
@@ -217,7 +317,7 @@ void CPU::exec_BCC(uint16_t operand)
     printf("Operand: 0x%04X\n", operand);
 #endif // PRINT_TRACE
     if (!get_flag(FLAG_C))
-        pc = operand;
+        branch(operand);
 }
 
 void CPU::exec_BCS(uint16_t operand)
@@ -227,7 +327,7 @@ void CPU::exec_BCS(uint16_t operand)
     printf("Operand: 0x%04X\n", operand);
 #endif // PRINT_TRACE
     if (get_flag(FLAG_C))
-        pc = operand;
+        branch(operand);
 }
 
 void CPU::exec_BEQ(uint16_t operand)
@@ -237,7 +337,7 @@ void CPU::exec_BEQ(uint16_t operand)
     printf("Operand: 0x%04X\n", operand);
 #endif // PRINT_TRACE
     if (get_flag(FLAG_Z))
-        pc = operand;
+        branch(operand);
 }
 
 void CPU::exec_BIT(uint8_t operand)
@@ -246,9 +346,8 @@ void CPU::exec_BIT(uint8_t operand)
     puts("Instruction: BIT");
     printf("Operand: 0x%02X\n", operand);
 #endif // PRINT_TRACE
-    set_flag(FLAG_N, (operand & 0x80) != 0);
+    flag_nz = ((operand & 0x80) << 8) | (reg[REG_A] & operand);
     set_flag(FLAG_V, (operand & 0x40) != 0);
-    Z_flag(reg[REG_A] & operand);
 }
 
 void CPU::exec_BMI(uint16_t operand)
@@ -258,7 +357,7 @@ void CPU::exec_BMI(uint16_t operand)
     printf("Operand: 0x%04X\n", operand);
 #endif // PRINT_TRACE
     if (get_flag(FLAG_N))
-        pc = operand;
+        branch(operand);
 }
 
 void CPU::exec_BNE(uint16_t operand)
@@ -268,7 +367,7 @@ void CPU::exec_BNE(uint16_t operand)
     printf("Operand: 0x%04X\n", operand);
 #endif // PRINT_TRACE
     if (!get_flag(FLAG_Z))
-        pc = operand;
+        branch(operand);
 }
 
 void CPU::exec_BPL(uint16_t operand)
@@ -278,7 +377,7 @@ void CPU::exec_BPL(uint16_t operand)
     printf("Operand: 0x%04X\n", operand);
 #endif // PRINT_TRACE
     if (!get_flag(FLAG_N))
-        pc = operand;
+        branch(operand);
 }
 
 void CPU::exec_BRK()
@@ -290,7 +389,7 @@ void CPU::exec_BRK()
     stack_push(pc & 0xFF);
     set_flag(FLAG_B1);
     set_flag(FLAG_B2);
-    stack_push(reg[REG_P]);
+    stack_push(get_p());
     pc = dma.read_dword(0xFFFE);
 }
 
@@ -301,7 +400,7 @@ void CPU::exec_BVC(uint16_t operand)
     printf("Operand: 0x%04X\n", operand);
 #endif // PRINT_TRACE
     if (!get_flag(FLAG_V))
-        pc = operand;
+        branch(operand);
 }
 
 void CPU::exec_BVS(uint16_t operand)
@@ -311,7 +410,7 @@ void CPU::exec_BVS(uint16_t operand)
     printf("Operand: 0x%04X\n", operand);
 #endif // PRINT_TRACE
     if (get_flag(FLAG_V))
-        pc = operand;
+        branch(operand);
 }
 
 void CPU::exec_CLC()
@@ -336,6 +435,7 @@ void CPU::exec_CLI()
     puts("Instruction: CLI");
 #endif // PRINT_TRACE
     clr_flag(FLAG_I);
+    check_irq();
 }
 
 void CPU::exec_CLV()
@@ -540,7 +640,7 @@ void CPU::exec_PHP()
 #ifdef PRINT_TRACE
     puts("Instruction: PHP");
 #endif // PRINT_TRACE
-    stack_push(reg[REG_P]);
+    stack_push(get_p());
 }
 
 void CPU::exec_PLA()
@@ -556,7 +656,8 @@ void CPU::exec_PLP()
 #ifdef PRINT_TRACE
     puts("Instruction: PLP");
 #endif // PRINT_TRACE
-    reg[REG_P] = stack_pop();
+    set_p(stack_pop());
+    check_irq();
 }
 
 void CPU::exec_ROL_A(uint8_t operand)
@@ -612,9 +713,10 @@ void CPU::exec_RTI()
 #ifdef PRINT_TRACE
     puts("Instruction: RTI");
 #endif // PRINT_TRACE
-    reg[REG_P] = stack_pop();
+    set_p(stack_pop());
     pc = stack_pop();
     pc |= stack_pop() << 8;
+    check_irq();
 }
 
 void CPU::exec_RTS()
@@ -739,18 +841,57 @@ void CPU::exec_TYA()
     NZ_flag(reg[REG_A] = reg[REG_Y]);
 }
 
-CPU::CPU(DMA &dma) : dma(dma)
+CPU::CPU(DMA &dma) : pc(0), cycles(0), cycle_limit(0), page_penalty(0),
+    engine(CPU_ENGINE), cur_op(nullptr), block_dirty(false), irq_line(false), tracer(nullptr),
+    profiler(nullptr),
+#ifdef USE_PERF
+    perf(nullptr),
+#endif // USE_PERF
+    dma(dma)
 {
-    reg[REG_P] = 0x34;
+    dma.set_code_write_hook([this](uint8_t page) { invalidate_page(page); });
+    dma.set_clock(&cycles);
+    dma.get_scheduler().set_limit(&cycle_limit);
+    set_p(0x34);
     reg[REG_A] = reg[REG_X] = reg[REG_Y] = 0x00;
     reg[REG_S] = 0xFD;
 }
 
+CPU::~CPU() {}
+
+void CPU::interrupt(uint16_t vector)
+{
+    stack_push(pc >> 8);
+    stack_push(pc & 0xFF);
+    stack_push((get_p() & ~(1 << FLAG_B1)) | (1 << FLAG_B2));
+    set_flag(FLAG_I);
+    pc = dma.read_dword(vector);
+    cycles += 7;
+    if (profiler)
+        profiler->interrupt(vector, pc, reg[REG_S], cycles);
+}
+
+void CPU::poll_interrupts()
+{
+    irq_line = dma.irq_line();
+    if (dma.take_nmi())
+        interrupt(0xFFFA);
+    else if (irq_line && !get_flag(FLAG_I))
+        interrupt(0xFFFE);
+}
+
+void CPU::check_irq()
+{
+    if (irq_line && !get_flag(FLAG_I))
+        cycle_limit = cycles;
+}
+
 void CPU::reset()
 {
     reg[REG_S] -= 0x03;
     set_flag(FLAG_I);
     pc = dma.read_dword(0xFFFC);
+    cycles += 7;
 }
 
 void CPU::exec_one()
@@ -758,7 +899,11 @@ void CPU::exec_one()
 #ifdef PRINT_TRACE
     print_state();
 #endif // PRINT_TRACE
+    if (tracer)
+        trace();
     uint8_t opcode = dma.read(pc++);
+    cycles += cycle_table[opcode];
+    page_penalty = page_cross_table[opcode];
     switch (opcode) {
     case 0x00: exec_BRK(); break;
     case 0x01: exec_ORA(dma.read(addr_Xind())); break;
@@ -920,10 +1065,194 @@ void CPU::exec_one()
 #endif // PRINT_TRACE
 }
 
-void CPU::start()
+bool CPU::step()
 {
-    for (;;)
+    dma.run_events(cycles);
+    uint64_t start = cycles;
+    poll_interrupts();
+    if (cycles != start)
+        return false;
+    if (profiler)
+        profile_one();
+    else
         exec_one();
+    return true;
+}
+
+uint64_t CPU::run_cycles(uint64_t n)
+{
+    uint64_t start = cycles;
+    return run_until(cycles + n) - start;
+}
+
+void CPU::run_engine()
+{
+    bool instrumented = tracer || profiler;
+#ifdef USE_PERF
+    instrumented = instrumented || perf;
+#endif // USE_PERF
+    switch (instrumented ? ENGINE_SWITCH : engine) {
+    case ENGINE_TABLE: run_table(); break;
+    case ENGINE_THREADED: run_threaded(); break;
+    case ENGINE_BLOCK: run_blocks(); break;
+    case ENGINE_JIT:
+#ifdef USE_JIT
+        if (!jit)
+            jit.reset(new JIT(*this, dma));
+        jit->run();
+#else
+        run_blocks();
+#endif // USE_JIT
+        break;
+    default:
+#ifdef USE_PERF
+        if (perf) {
+            run_counted();
+            break;
+        }
+#endif // USE_PERF
+        if (profiler) {
+            while (cycles < cycle_limit)
+                profile_one();
+            break;
+        }
+        while (cycles < cycle_limit)
+            exec_one();
+        break;
+    }
+}
+
+uint64_t CPU::run_until(uint64_t cycle)
+{
+    Scheduler &scheduler = dma.get_scheduler();
+    for (;;) {
+        dma.run_events(cycles);
+        poll_interrupts();
+        if (cycles >= cycle)
+            break;
+        cycle_limit = min(cycle, scheduler.next_cycle());
+        run_engine();
+    }
+    return cycles;
+}
+
+uint64_t CPU::get_cycles()
+{
+    return cycles;
+}
+
+CPU::State CPU::get_state()
+{
+    State state;
+    state.pc = pc;
+    state.a = reg[REG_A];
+    state.x = reg[REG_X];
+    state.y = reg[REG_Y];
+    state.s = reg[REG_S];
+    state.p = get_p();
+    state.cycles = cycles;
+    return state;
+}
+
+size_t CPU::state_size()
+{
+    return sizeof(pc) + sizeof(reg) + sizeof(flag_nz) + sizeof(flag_c) + sizeof(flag_v) + sizeof(cycles);
+}
+
+void CPU::save_state(uint8_t *buffer)
+{
+    memcpy(buffer, &pc, sizeof(pc));
+    buffer += sizeof(pc);
+    memcpy(buffer, reg, sizeof(reg));
+    buffer += sizeof(reg);
+    memcpy(buffer, &flag_nz, sizeof(flag_nz));
+    buffer += sizeof(flag_nz);
+    memcpy(buffer, &flag_c, sizeof(flag_c));
+    buffer += sizeof(flag_c);
+    memcpy(buffer, &flag_v, sizeof(flag_v));
+    buffer += sizeof(flag_v);
+    memcpy(buffer, &cycles, sizeof(cycles));
+}
+
+void CPU::load_state(const uint8_t *buffer)
+{
+    memcpy(&pc, buffer, sizeof(pc));
+    buffer += sizeof(pc);
+    memcpy(reg, buffer, sizeof(reg));
+    buffer += sizeof(reg);
+    memcpy(&flag_nz, buffer, sizeof(flag_nz));
+    buffer += sizeof(flag_nz);
+    memcpy(&flag_c, buffer, sizeof(flag_c));
+    buffer += sizeof(flag_c);
+    memcpy(&flag_v, buffer, sizeof(flag_v));
+    buffer += sizeof(flag_v);
+    memcpy(&cycles, buffer, sizeof(cycles));
+}
+
+void CPU::set_engine(Engine engine)
+{
+    this->engine = engine;
+}
+
+CPU::Engine CPU::engine_by_name(const string &name)
+{
+    if (name == "switch")
+        return ENGINE_SWITCH;
+    if (name == "table")
+        return ENGINE_TABLE;
+    if (name == "threaded")
+        return ENGINE_THREADED;
+    if (name == "block")
+        return ENGINE_BLOCK;
+    if (name == "jit")
+        return ENGINE_JIT;
+    throw runtime_error("unknown cpu engine: " + name);
+}
+
+void CPU::set_tracer(Tracer *tracer)
+{
+    this->tracer = tracer;
+}
+
+void CPU::trace()
+{
+    uint8_t bytes[3] = { dma.peek(pc), dma.peek(pc + 1), dma.peek(pc + 2) };
+    tracer->record(pc, bytes, reg, get_p(), cycles);
+}
+
+void CPU::set_profiler(Profiler *profiler)
+{
+    this->profiler = profiler;
+}
+
+void CPU::profile_one()
+{
+    uint16_t at = pc;
+    uint8_t opcode = dma.peek(at);
+    uint64_t start = cycles;
+    exec_one();
+    profiler->retire(at, opcode, cycles - start, pc, reg[REG_S], cycles);
+}
+
+#ifdef USE_PERF
+void CPU::set_perf(PerfCounters *perf)
+{
+    this->perf = perf;
+}
+
+void CPU::run_counted()
+{
+    while (cycles < cycle_limit) {
+        perf->begin(dma.peek(pc));
+        exec_one();
+    }
+    perf->flush();
+}
+#endif // USE_PERF
+
+void CPU::start()
+{
+    run_until(UINT64_MAX);
 }
 
 void CPU::print_state()
@@ -939,5 +1268,6 @@ void CPU::print_state()
     printf("Flag D: %u\n", get_flag(FLAG_D));
     printf("Flag V: %u\n", get_flag(FLAG_V));
     printf("Flag N: %u\n", get_flag(FLAG_N));
+    printf("Cycles: %llu\n", (unsigned long long) cycles);
     puts("");
 }
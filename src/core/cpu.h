@@ -1,10 +1,44 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "dma.h"
+#include "profiler.h"
+#include "tracer.h"
+
+#ifdef USE_JIT
+class JIT;
+#endif // USE_JIT
+#ifdef USE_PERF
+class PerfCounters;
+#endif // USE_PERF
 
 class CPU {
+public:
+    enum Engine {
+        ENGINE_SWITCH = 0,
+        ENGINE_TABLE = 1,
+        ENGINE_THREADED = 2,
+        ENGINE_BLOCK = 3,
+        ENGINE_JIT = 4
+    };
+    struct State {
+        uint16_t pc;
+        uint8_t a;
+        uint8_t x;
+        uint8_t y;
+        uint8_t s;
+        uint8_t p;
+        uint64_t cycles;
+    };
 private:
+    friend class SimdCPU;
+#ifdef USE_JIT
+    friend class JIT;
+#endif // USE_JIT
     enum Register {
         REG_A = 0,
         REG_X = 1,
@@ -22,18 +56,56 @@ private:
         FLAG_V = 6,
         FLAG_N = 7
     };
+    typedef void (*Handler)(CPU &cpu);
+    struct DecodedOp {
+        Handler handler;
+        uint16_t operand;
+        uint16_t next_pc;
+        uint8_t cycles;
+        uint8_t page_penalty;
+        uint8_t opcode;
+    };
+    typedef std::vector<DecodedOp> Block;
+    static const uint8_t cycle_table[0x100];
+    static const uint8_t page_cross_table[0x100];
+    static const Handler handler_table[0x100];
+    static const Handler block_handler_table[0x100];
     uint16_t pc;
     uint8_t reg[5];
+    uint16_t flag_nz;
+    uint8_t flag_c;
+    uint8_t flag_v;
+    uint64_t cycles;
+    uint64_t cycle_limit;
+    uint8_t page_penalty;
+    Engine engine;
+    std::vector<Block> blocks[0x100];
+    const DecodedOp *cur_op;
+    bool block_dirty;
+    bool irq_line;
+#ifdef USE_JIT
+    std::unique_ptr<JIT> jit;
+#endif // USE_JIT
+    Tracer *tracer;
+    Profiler *profiler;
+#ifdef USE_PERF
+    PerfCounters *perf;
+#endif // USE_PERF
     DMA &dma;
     void set_flag(Flag flag);
     void clr_flag(Flag flag);
     uint8_t get_flag(Flag flag);
     void set_flag(Flag flag, bool on);
-    void N_flag(uint8_t data);
-    void Z_flag(uint8_t data);
     void NZ_flag(uint8_t data);
+    uint8_t get_p();
+    void set_p(uint8_t data);
+    void page_cross(uint16_t base, uint16_t addr);
+    void branch(uint16_t target);
     void stack_push(uint8_t data);
     uint8_t stack_pop();
+    void interrupt(uint16_t vector);
+    void poll_interrupts();
+    void check_irq();
     uint8_t addr_A();
     uint16_t addr_abs();
     uint16_t addr_absX();
@@ -46,6 +118,18 @@ private:
     uint16_t addr_zpg();
     uint16_t addr_zpgX();
     uint16_t addr_zpgY();
+    uint8_t dec_A();
+    uint16_t dec_abs();
+    uint16_t dec_absX();
+    uint16_t dec_absY();
+    uint8_t dec_imm();
+    uint16_t dec_ind();
+    uint16_t dec_Xind();
+    uint16_t dec_indY();
+    uint16_t dec_rel();
+    uint16_t dec_zpg();
+    uint16_t dec_zpgX();
+    uint16_t dec_zpgY();
     void exec_ADC(uint8_t operand);
     void exec_AND(uint8_t operand);
     void exec_ASL_A(uint8_t operand);
@@ -106,12 +190,58 @@ private:
     void exec_TXA();
     void exec_TXS();
     void exec_TYA();
+    template <void (CPU::*Op)()>
+    static void op_impl(CPU &cpu);
+    template <uint16_t (CPU::*Mode)(), void (CPU::*Op)(uint8_t)>
+    static void op_read(CPU &cpu);
+    template <uint8_t (CPU::*Mode)(), void (CPU::*Op)(uint8_t)>
+    static void op_val(CPU &cpu);
+    template <uint16_t (CPU::*Mode)(), void (CPU::*Op)(uint16_t)>
+    static void op_addr(CPU &cpu);
+    static void op_invalid(CPU &cpu);
+    void dispatch_one();
+    void run_table();
+    void run_threaded();
+    Block *find_block(uint16_t addr);
+    void decode_block(Block &block, uint16_t addr);
+    void invalidate_page(uint8_t page);
+    void run_blocks();
+    void run_engine();
+    void trace();
+    void profile_one();
+#ifdef USE_PERF
+    void run_counted();
+#endif // USE_PERF
 public:
     CPU(DMA &dma);
+    ~CPU();
     void reset();
     void exec_one();
+    bool step();
+    uint64_t run_cycles(uint64_t n);
+    uint64_t run_until(uint64_t cycle);
+    uint64_t get_cycles();
+    State get_state();
+    void set_engine(Engine engine);
+    static Engine engine_by_name(const std::string &name);
+    void set_tracer(Tracer *tracer);
+    void set_profiler(Profiler *profiler);
+#ifdef USE_PERF
+    void set_perf(PerfCounters *perf);
+#endif // USE_PERF
+    size_t state_size();
+    void save_state(uint8_t *buffer);
+    void load_state(const uint8_t *buffer);
     void start();
     void print_state();
 };
 
+inline void CPU::dispatch_one()
+{
+    uint8_t opcode = dma.read(pc++);
+    cycles += cycle_table[opcode];
+    page_penalty = page_cross_table[opcode];
+    handler_table[opcode](*this);
+}
+
 #endif // CPU_H
@@ -0,0 +1,267 @@
+#include "cpu.h"
+#include "cpu_ops.h"
+
+#ifdef USE_JIT
+#include "jit.h"
+#endif // USE_JIT
+
+#include <stdexcept>
+
+using namespace std;
+
+#define CPU_HANDLER_none(mode, op) &CPU::op_invalid
+#define CPU_HANDLER_impl(mode, op) &CPU::op_impl<&CPU::exec_##op>
+#define CPU_HANDLER_read(mode, op) &CPU::op_read<&CPU::addr_##mode, &CPU::exec_##op>
+#define CPU_HANDLER_val(mode, op) &CPU::op_val<&CPU::addr_##mode, &CPU::exec_##op>
+#define CPU_HANDLER_addr(mode, op) &CPU::op_addr<&CPU::addr_##mode, &CPU::exec_##op>
+#define CPU_HANDLER(code, kind, mode, op) CPU_HANDLER_##kind(mode, op),
+
+#define CPU_BLOCK_HANDLER_none(mode, op) &CPU::op_invalid
+#define CPU_BLOCK_HANDLER_impl(mode, op) &CPU::op_impl<&CPU::exec_##op>
+#define CPU_BLOCK_HANDLER_read(mode, op) &CPU::op_read<&CPU::dec_##mode, &CPU::exec_##op>
+#define CPU_BLOCK_HANDLER_val(mode, op) &CPU::op_val<&CPU::dec_##mode, &CPU::exec_##op>
+#define CPU_BLOCK_HANDLER_addr(mode, op) &CPU::op_addr<&CPU::dec_##mode, &CPU::exec_##op>
+#define CPU_BLOCK_HANDLER(code, kind, mode, op) CPU_BLOCK_HANDLER_##kind(mode, op),
+
+#define CPU_CALL_none(mode, op) op_invalid(*this)
+#define CPU_CALL_impl(mode, op) op_impl<&CPU::exec_##op>(*this)
+#define CPU_CALL_read(mode, op) op_read<&CPU::addr_##mode, &CPU::exec_##op>(*this)
+#define CPU_CALL_val(mode, op) op_val<&CPU::addr_##mode, &CPU::exec_##op>(*this)
+#define CPU_CALL_addr(mode, op) op_addr<&CPU::addr_##mode, &CPU::exec_##op>(*this)
+
+template <void (CPU::*Op)()>
+void CPU::op_impl(CPU &cpu)
+{
+    (cpu.*Op)();
+}
+
+template <uint16_t (CPU::*Mode)(), void (CPU::*Op)(uint8_t)>
+void CPU::op_read(CPU &cpu)
+{
+    (cpu.*Op)(cpu.dma.read((cpu.*Mode)()));
+}
+
+template <uint8_t (CPU::*Mode)(), void (CPU::*Op)(uint8_t)>
+void CPU::op_val(CPU &cpu)
+{
+    (cpu.*Op)((cpu.*Mode)());
+}
+
+template <uint16_t (CPU::*Mode)(), void (CPU::*Op)(uint16_t)>
+void CPU::op_addr(CPU &cpu)
+{
+    (cpu.*Op)((cpu.*Mode)());
+}
+
+void CPU::op_invalid(CPU &cpu)
+{
+    throw runtime_error("invalid opcode: " + to_string(cpu.dma.read(cpu.pc - 1)));
+}
+
+const CPU::Handler CPU::handler_table[0x100] = {
+    CPU_OPCODES(CPU_HANDLER)
+};
+
+const CPU::Handler CPU::block_handler_table[0x100] = {
+    CPU_OPCODES(CPU_BLOCK_HANDLER)
+};
+
+static bool is_branch(uint8_t opcode)
+{
+    return (opcode & 0x1F) == 0x10;
+}
+
+static bool ends_block(uint8_t opcode)
+{
+    switch (opcode) {
+    case 0x00: case 0x20: case 0x40: case 0x4C: case 0x60: case 0x6C:
+        return true;
+    default:
+        return is_branch(opcode) || op_kind_table[opcode] == KIND_none;
+    }
+}
+
+void CPU::run_table()
+{
+    while (cycles < cycle_limit)
+        dispatch_one();
+}
+
+uint8_t CPU::dec_A()
+{
+    return reg[REG_A];
+}
+
+uint16_t CPU::dec_abs()
+{
+    return cur_op->operand;
+}
+
+uint16_t CPU::dec_absX()
+{
+    uint16_t ret = cur_op->operand + reg[REG_X];
+    page_cross(cur_op->operand, ret);
+    return ret;
+}
+
+uint16_t CPU::dec_absY()
+{
+    uint16_t ret = cur_op->operand + reg[REG_Y];
+    page_cross(cur_op->operand, ret);
+    return ret;
+}
+
+uint8_t CPU::dec_imm()
+{
+    return cur_op->operand;
+}
+
+uint16_t CPU::dec_ind()
+{
+    return dma.read_dword(cur_op->operand);
+}
+
+uint16_t CPU::dec_Xind()
+{
+    return dma.read_dword((cur_op->operand + reg[REG_X]) & 0xFF);
+}
+
+uint16_t CPU::dec_indY()
+{
+    uint16_t base = dma.read_dword(cur_op->operand);
+    uint16_t ret = base + reg[REG_Y];
+    page_cross(base, ret);
+    return ret;
+}
+
+uint16_t CPU::dec_rel()
+{
+    return cur_op->operand;
+}
+
+uint16_t CPU::dec_zpg()
+{
+    return cur_op->operand;
+}
+
+uint16_t CPU::dec_zpgX()
+{
+    return (cur_op->operand + reg[REG_X]) & 0xFF;
+}
+
+uint16_t CPU::dec_zpgY()
+{
+    return (cur_op->operand + reg[REG_Y]) & 0xFF;
+}
+
+CPU::Block *CPU::find_block(uint16_t addr)
+{
+    vector<Block> &page = blocks[addr >> 8];
+    if (page.empty())
+        page.resize(0x100);
+    Block &block = page[addr & 0xFF];
+    if (block.empty())
+        decode_block(block, addr);
+    return block.empty() ? nullptr : &block;
+}
+
+void CPU::decode_block(Block &block, uint16_t addr)
+{
+    uint8_t page = addr >> 8;
+    const uint8_t *code = dma.host_page(page);
+    while (code && (addr >> 8) == page) {
+        uint8_t opcode = code[addr & 0xFF];
+        uint16_t next_pc = addr + op_length_table[opcode];
+        const uint8_t *tail = dma.host_page((next_pc - 1) >> 8);
+        if (!tail)
+            break;
+        DecodedOp op;
+        op.handler = block_handler_table[opcode];
+        op.next_pc = next_pc;
+        op.cycles = cycle_table[opcode];
+        op.page_penalty = page_cross_table[opcode];
+        op.opcode = opcode;
+        op.operand = 0;
+        if (op_length_table[opcode] >= 2)
+            op.operand = dma.host_page((addr + 1) >> 8)[(addr + 1) & 0xFF];
+        if (op_length_table[opcode] == 3)
+            op.operand |= tail[(next_pc - 1) & 0xFF] << 8;
+        if (is_branch(opcode))
+            op.operand = (uint16_t) ((int16_t) next_pc + (int8_t) op.operand);
+        block.push_back(op);
+        dma.watch_page(addr >> 8);
+        dma.watch_page((next_pc - 1) >> 8);
+        if (ends_block(opcode))
+            break;
+        addr = next_pc;
+    }
+}
+
+void CPU::invalidate_page(uint8_t page)
+{
+    blocks[page].clear();
+    blocks[(uint8_t) (page - 1)].clear();
+    dma.unwatch_page(page);
+#ifdef USE_JIT
+    if (jit)
+        jit->invalidate_page(page);
+#endif // USE_JIT
+    block_dirty = true;
+}
+
+void CPU::run_blocks()
+{
+    while (cycles < cycle_limit) {
+        Block *block = find_block(pc);
+        if (!block) {
+            dispatch_one();
+            continue;
+        }
+        block_dirty = false;
+        for (const DecodedOp &op : *block) {
+            cur_op = &op;
+            pc = op.next_pc;
+            cycles += op.cycles;
+            page_penalty = op.page_penalty;
+            op.handler(*this);
+            if (cycles >= cycle_limit || block_dirty)
+                break;
+        }
+    }
+}
+
+#if defined(__GNUC__)
+
+#define CPU_LABEL(code, kind, mode, op) &&op_##code,
+#define CPU_THREADED(code, kind, mode, op) \
+    op_##code: \
+    CPU_CALL_##kind(mode, op); \
+    CPU_DISPATCH();
+#define CPU_DISPATCH() \
+    do { \
+        if (cycles >= cycle_limit) \
+            return; \
+        opcode = dma.read(pc++); \
+        cycles += cycle_table[opcode]; \
+        page_penalty = page_cross_table[opcode]; \
+        goto *labels[opcode]; \
+    } while (0)
+
+void CPU::run_threaded()
+{
+    static void *const labels[0x100] = {
+        CPU_OPCODES(CPU_LABEL)
+    };
+    uint8_t opcode;
+    CPU_DISPATCH();
+    CPU_OPCODES(CPU_THREADED)
+}
+
+#else
+
+void CPU::run_threaded()
+{
+    run_table();
+}
+
+#endif // __GNUC__
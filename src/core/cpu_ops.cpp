@@ -0,0 +1,40 @@
+#include "cpu_ops.h"
+
+#define OP_KIND(code, kind, mode, op) KIND_##kind,
+#define OP_MODE(code, kind, mode, op) MODE_##mode,
+#define OP_NAME(code, kind, mode, op) #op,
+
+#define OP_LENGTH_none 1
+#define OP_LENGTH_A 1
+#define OP_LENGTH_imm 2
+#define OP_LENGTH_zpg 2
+#define OP_LENGTH_zpgX 2
+#define OP_LENGTH_zpgY 2
+#define OP_LENGTH_Xind 2
+#define OP_LENGTH_indY 2
+#define OP_LENGTH_rel 2
+#define OP_LENGTH_abs 3
+#define OP_LENGTH_absX 3
+#define OP_LENGTH_absY 3
+#define OP_LENGTH_ind 3
+#define OP_LENGTH(code, kind, mode, op) OP_LENGTH_##mode,
+
+const uint8_t op_kind_table[0x100] = {
+    CPU_OPCODES(OP_KIND)
+};
+
+const uint8_t op_mode_table[0x100] = {
+    CPU_OPCODES(OP_MODE)
+};
+
+const uint8_t op_length_table[0x100] = {
+    CPU_OPCODES(OP_LENGTH)
+};
+
+const char *const op_name_table[0x100] = {
+    CPU_OPCODES(OP_NAME)
+};
+
+const char *const op_mode_names[MODES] = {
+    "none", "A", "imm", "zpg", "zpgX", "zpgY", "abs", "absX", "absY", "ind", "Xind", "indY", "rel"
+};
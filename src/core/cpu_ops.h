@@ -0,0 +1,295 @@
+#ifndef CPU_OPS_H
+#define CPU_OPS_H
+
+#include <cstdint>
+
+enum OpKind {
+    KIND_none,
+    KIND_impl,
+    KIND_read,
+    KIND_val,
+    KIND_addr
+};
+
+enum OpMode {
+    MODE_none,
+    MODE_A,
+    MODE_imm,
+    MODE_zpg,
+    MODE_zpgX,
+    MODE_zpgY,
+    MODE_abs,
+    MODE_absX,
+    MODE_absY,
+    MODE_ind,
+    MODE_Xind,
+    MODE_indY,
+    MODE_rel,
+    MODES
+};
+
+extern const uint8_t op_kind_table[0x100];
+extern const uint8_t op_mode_table[0x100];
+extern const uint8_t op_length_table[0x100];
+extern const char *const op_name_table[0x100];
+extern const char *const op_mode_names[MODES];
+
+#define CPU_OPCODES(OP) \
+    OP(0x00, impl, none, BRK)     \
+    OP(0x01, read, Xind, ORA)     \
+    OP(0x02, none, none, none)    \
+    OP(0x03, none, none, none)    \
+    OP(0x04, none, none, none)    \
+    OP(0x05, read, zpg, ORA)      \
+    OP(0x06, addr, zpg, ASL_dma)  \
+    OP(0x07, none, none, none)    \
+    OP(0x08, impl, none, PHP)     \
+    OP(0x09, val, imm, ORA)       \
+    OP(0x0A, val, A, ASL_A)       \
+    OP(0x0B, none, none, none)    \
+    OP(0x0C, none, none, none)    \
+    OP(0x0D, read, abs, ORA)      \
+    OP(0x0E, addr, abs, ASL_dma)  \
+    OP(0x0F, none, none, none)    \
+    OP(0x10, addr, rel, BPL)      \
+    OP(0x11, read, indY, ORA)     \
+    OP(0x12, none, none, none)    \
+    OP(0x13, none, none, none)    \
+    OP(0x14, none, none, none)    \
+    OP(0x15, read, zpgX, ORA)     \
+    OP(0x16, addr, zpgX, ASL_dma) \
+    OP(0x17, none, none, none)    \
+    OP(0x18, impl, none, CLC)     \
+    OP(0x19, read, absY, ORA)     \
+    OP(0x1A, none, none, none)    \
+    OP(0x1B, none, none, none)    \
+    OP(0x1C, none, none, none)    \
+    OP(0x1D, read, absX, ORA)     \
+    OP(0x1E, addr, absX, ASL_dma) \
+    OP(0x1F, none, none, none)    \
+    OP(0x20, addr, abs, JSR)      \
+    OP(0x21, read, Xind, AND)     \
+    OP(0x22, none, none, none)    \
+    OP(0x23, none, none, none)    \
+    OP(0x24, read, zpg, BIT)      \
+    OP(0x25, read, zpg, AND)      \
+    OP(0x26, addr, zpg, ROL_dma)  \
+    OP(0x27, none, none, none)    \
+    OP(0x28, impl, none, PLP)     \
+    OP(0x29, val, imm, AND)       \
+    OP(0x2A, val, A, ROL_A)       \
+    OP(0x2B, none, none, none)    \
+    OP(0x2C, read, abs, BIT)      \
+    OP(0x2D, read, abs, AND)      \
+    OP(0x2E, addr, abs, ROL_dma)  \
+    OP(0x2F, none, none, none)    \
+    OP(0x30, addr, rel, BMI)      \
+    OP(0x31, read, indY, AND)     \
+    OP(0x32, none, none, none)    \
+    OP(0x33, none, none, none)    \
+    OP(0x34, none, none, none)    \
+    OP(0x35, read, zpgX, AND)     \
+    OP(0x36, addr, zpgX, ROL_dma) \
+    OP(0x37, none, none, none)    \
+    OP(0x38, impl, none, SEC)     \
+    OP(0x39, read, absY, AND)     \
+    OP(0x3A, none, none, none)    \
+    OP(0x3B, none, none, none)    \
+    OP(0x3C, none, none, none)    \
+    OP(0x3D, read, absX, AND)     \
+    OP(0x3E, addr, absX, ROL_dma) \
+    OP(0x3F, none, none, none)    \
+    OP(0x40, impl, none, RTI)     \
+    OP(0x41, read, Xind, EOR)     \
+    OP(0x42, none, none, none)    \
+    OP(0x43, none, none, none)    \
+    OP(0x44, none, none, none)    \
+    OP(0x45, read, zpg, EOR)      \
+    OP(0x46, addr, zpg, LSR_dma)  \
+    OP(0x47, none, none, none)    \
+    OP(0x48, impl, none, PHA)     \
+    OP(0x49, val, imm, EOR)       \
+    OP(0x4A, val, A, LSR_A)       \
+    OP(0x4B, none, none, none)    \
+    OP(0x4C, addr, abs, JMP)      \
+    OP(0x4D, read, abs, EOR)      \
+    OP(0x4E, addr, abs, LSR_dma)  \
+    OP(0x4F, none, none, none)    \
+    OP(0x50, addr, rel, BVC)      \
+    OP(0x51, read, indY, EOR)     \
+    OP(0x52, none, none, none)    \
+    OP(0x53, none, none, none)    \
+    OP(0x54, none, none, none)    \
+    OP(0x55, read, zpgX, EOR)     \
+    OP(0x56, addr, zpgX, LSR_dma) \
+    OP(0x57, none, none, none)    \
+    OP(0x58, impl, none, CLI)     \
+    OP(0x59, read, absY, EOR)     \
+    OP(0x5A, none, none, none)    \
+    OP(0x5B, none, none, none)    \
+    OP(0x5C, none, none, none)    \
+    OP(0x5D, read, absX, EOR)     \
+    OP(0x5E, addr, absX, LSR_dma) \
+    OP(0x5F, none, none, none)    \
+    OP(0x60, impl, none, RTS)     \
+    OP(0x61, read, Xind, ADC)     \
+    OP(0x62, none, none, none)    \
+    OP(0x63, none, none, none)    \
+    OP(0x64, none, none, none)    \
+    OP(0x65, read, zpg, ADC)      \
+    OP(0x66, addr, zpg, ROR_dma)  \
+    OP(0x67, none, none, none)    \
+    OP(0x68, impl, none, PLA)     \
+    OP(0x69, val, imm, ADC)       \
+    OP(0x6A, val, A, ROR_A)       \
+    OP(0x6B, none, none, none)    \
+    OP(0x6C, addr, ind, JMP)      \
+    OP(0x6D, read, abs, ADC)      \
+    OP(0x6E, addr, abs, ROR_dma)  \
+    OP(0x6F, none, none, none)    \
+    OP(0x70, addr, rel, BVS)      \
+    OP(0x71, read, indY, ADC)     \
+    OP(0x72, none, none, none)    \
+    OP(0x73, none, none, none)    \
+    OP(0x74, none, none, none)    \
+    OP(0x75, read, zpgX, ADC)     \
+    OP(0x76, addr, zpgX, ROR_dma) \
+    OP(0x77, none, none, none)    \
+    OP(0x78, impl, none, SEI)     \
+    OP(0x79, read, absY, ADC)     \
+    OP(0x7A, none, none, none)    \
+    OP(0x7B, none, none, none)    \
+    OP(0x7C, none, none, none)    \
+    OP(0x7D, read, absX, ADC)     \
+    OP(0x7E, addr, absX, ROR_dma) \
+    OP(0x7F, none, none, none)    \
+    OP(0x80, none, none, none)    \
+    OP(0x81, addr, Xind, STA)     \
+    OP(0x82, none, none, none)    \
+    OP(0x83, none, none, none)    \
+    OP(0x84, addr, zpg, STY)      \
+    OP(0x85, addr, zpg, STA)      \
+    OP(0x86, addr, zpg, STX)      \
+    OP(0x87, none, none, none)    \
+    OP(0x88, impl, none, DEY)     \
+    OP(0x89, none, none, none)    \
+    OP(0x8A, impl, none, TXA)     \
+    OP(0x8B, none, none, none)    \
+    OP(0x8C, addr, abs, STY)      \
+    OP(0x8D, addr, abs, STA)      \
+    OP(0x8E, addr, abs, STX)      \
+    OP(0x8F, none, none, none)    \
+    OP(0x90, addr, rel, BCC)      \
+    OP(0x91, addr, indY, STA)     \
+    OP(0x92, none, none, none)    \
+    OP(0x93, none, none, none)    \
+    OP(0x94, addr, zpgX, STY)     \
+    OP(0x95, addr, zpgX, STA)     \
+    OP(0x96, addr, zpgY, STX)     \
+    OP(0x97, none, none, none)    \
+    OP(0x98, impl, none, TYA)     \
+    OP(0x99, addr, absY, STA)     \
+    OP(0x9A, impl, none, TXS)     \
+    OP(0x9B, none, none, none)    \
+    OP(0x9C, none, none, none)    \
+    OP(0x9D, addr, absX, STA)     \
+    OP(0x9E, none, none, none)    \
+    OP(0x9F, none, none, none)    \
+    OP(0xA0, val, imm, LDY)       \
+    OP(0xA1, read, Xind, LDA)     \
+    OP(0xA2, val, imm, LDX)       \
+    OP(0xA3, none, none, none)    \
+    OP(0xA4, read, zpg, LDY)      \
+    OP(0xA5, read, zpg, LDA)      \
+    OP(0xA6, read, zpg, LDX)      \
+    OP(0xA7, none, none, none)    \
+    OP(0xA8, impl, none, TAY)     \
+    OP(0xA9, val, imm, LDA)       \
+    OP(0xAA, impl, none, TAX)     \
+    OP(0xAB, none, none, none)    \
+    OP(0xAC, read, abs, LDY)      \
+    OP(0xAD, read, abs, LDA)      \
+    OP(0xAE, read, abs, LDX)      \
+    OP(0xAF, none, none, none)    \
+    OP(0xB0, addr, rel, BCS)      \
+    OP(0xB1, read, indY, LDA)     \
+    OP(0xB2, none, none, none)    \
+    OP(0xB3, none, none, none)    \
+    OP(0xB4, read, zpgX, LDY)     \
+    OP(0xB5, read, zpgX, LDA)     \
+    OP(0xB6, read, zpgY, LDX)     \
+    OP(0xB7, none, none, none)    \
+    OP(0xB8, impl, none, CLV)     \
+    OP(0xB9, read, absY, LDA)     \
+    OP(0xBA, impl, none, TSX)     \
+    OP(0xBB, none, none, none)    \
+    OP(0xBC, read, absX, LDY)     \
+    OP(0xBD, read, absX, LDA)     \
+    OP(0xBE, read, absY, LDX)     \
+    OP(0xBF, none, none, none)    \
+    OP(0xC0, val, imm, CPY)       \
+    OP(0xC1, read, Xind, CMP)     \
+    OP(0xC2, none, none, none)    \
+    OP(0xC3, none, none, none)    \
+    OP(0xC4, read, zpg, CPY)      \
+    OP(0xC5, read, zpg, CMP)      \
+    OP(0xC6, addr, zpg, DEC)      \
+    OP(0xC7, none, none, none)    \
+    OP(0xC8, impl, none, INY)     \
+    OP(0xC9, val, imm, CMP)       \
+    OP(0xCA, impl, none, DEX)     \
+    OP(0xCB, none, none, none)    \
+    OP(0xCC, read, abs, CPY)      \
+    OP(0xCD, read, abs, CMP)      \
+    OP(0xCE, addr, abs, DEC)      \
+    OP(0xCF, none, none, none)    \
+    OP(0xD0, addr, rel, BNE)      \
+    OP(0xD1, read, indY, CMP)     \
+    OP(0xD2, none, none, none)    \
+    OP(0xD3, none, none, none)    \
+    OP(0xD4, none, none, none)    \
+    OP(0xD5, read, zpgX, CMP)     \
+    OP(0xD6, addr, zpgX, DEC)     \
+    OP(0xD7, none, none, none)    \
+    OP(0xD8, impl, none, CLD)     \
+    OP(0xD9, read, absY, CMP)     \
+    OP(0xDA, none, none, none)    \
+    OP(0xDB, none, none, none)    \
+    OP(0xDC, none, none, none)    \
+    OP(0xDD, read, absX, CMP)     \
+    OP(0xDE, addr, absX, DEC)     \
+    OP(0xDF, none, none, none)    \
+    OP(0xE0, val, imm, CPX)       \
+    OP(0xE1, read, Xind, SBC)     \
+    OP(0xE2, none, none, none)    \
+    OP(0xE3, none, none, none)    \
+    OP(0xE4, read, zpg, CPX)      \
+    OP(0xE5, read, zpg, SBC)      \
+    OP(0xE6, addr, zpg, INC)      \
+    OP(0xE7, none, none, none)    \
+    OP(0xE8, impl, none, INX)     \
+    OP(0xE9, val, imm, SBC)       \
+    OP(0xEA, impl, none, NOP)     \
+    OP(0xEB, none, none, none)    \
+    OP(0xEC, read, abs, CPX)      \
+    OP(0xED, read, abs, SBC)      \
+    OP(0xEE, addr, abs, INC)      \
+    OP(0xEF, none, none, none)    \
+    OP(0xF0, addr, rel, BEQ)      \
+    OP(0xF1, read, indY, SBC)     \
+    OP(0xF2, none, none, none)    \
+    OP(0xF3, none, none, none)    \
+    OP(0xF4, none, none, none)    \
+    OP(0xF5, read, zpgX, SBC)     \
+    OP(0xF6, addr, zpgX, INC)     \
+    OP(0xF7, none, none, none)    \
+    OP(0xF8, impl, none, SED)     \
+    OP(0xF9, read, absY, SBC)     \
+    OP(0xFA, none, none, none)    \
+    OP(0xFB, none, none, none)    \
+    OP(0xFC, none, none, none)    \
+    OP(0xFD, read, absX, SBC)     \
+    OP(0xFE, addr, absX, INC)     \
+    OP(0xFF, none, none, none)
+
+#endif // CPU_OPS_H
@@ -0,0 +1,781 @@
+#include "cpu_simd.h"
+#include "cpu_ops.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif // __AVX2__
+
+using namespace std;
+
+enum Op {
+    OP_none, OP_ADC, OP_AND, OP_ASL_A, OP_ASL_dma, OP_BCC, OP_BCS, OP_BEQ, OP_BIT, OP_BMI,
+    OP_BNE, OP_BPL, OP_BRK, OP_BVC, OP_BVS, OP_CLC, OP_CLD, OP_CLI, OP_CLV, OP_CMP, OP_CPX,
+    OP_CPY, OP_DEC, OP_DEX, OP_DEY, OP_EOR, OP_INC, OP_INX, OP_INY, OP_JMP, OP_JSR, OP_LDA,
+    OP_LDX, OP_LDY, OP_LSR_A, OP_LSR_dma, OP_NOP, OP_ORA, OP_PHA, OP_PHP, OP_PLA, OP_PLP,
+    OP_ROL_A, OP_ROL_dma, OP_ROR_A, OP_ROR_dma, OP_RTI, OP_RTS, OP_SBC, OP_SEC, OP_SED,
+    OP_SEI, OP_STA, OP_STX, OP_STY, OP_TAX, OP_TAY, OP_TSX, OP_TXA, OP_TXS, OP_TYA
+};
+
+#define SIMD_OP(code, kind, mode, op) OP_##op,
+
+static const uint8_t op_table[0x100] = {
+    CPU_OPCODES(SIMD_OP)
+};
+
+static const unsigned N = SimdCPU::MAX_LANES;
+
+#ifdef __AVX2__
+typedef __m256i Vec;
+
+static inline Vec vload(const uint8_t *p) { return _mm256_loadu_si256((const __m256i *) p); }
+static inline void vstore(uint8_t *p, Vec v) { _mm256_storeu_si256((__m256i *) p, v); }
+static inline Vec vsplat(uint8_t x) { return _mm256_set1_epi8((char) x); }
+static inline Vec vadd(Vec a, Vec b) { return _mm256_add_epi8(a, b); }
+static inline Vec vsub(Vec a, Vec b) { return _mm256_sub_epi8(a, b); }
+static inline Vec vand(Vec a, Vec b) { return _mm256_and_si256(a, b); }
+static inline Vec vor(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+static inline Vec vxor(Vec a, Vec b) { return _mm256_xor_si256(a, b); }
+static inline Vec veq(Vec a, Vec b) { return _mm256_cmpeq_epi8(a, b); }
+static inline Vec vge(Vec a, Vec b) { return _mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a); }
+static inline Vec vsel(Vec m, Vec t, Vec f) { return _mm256_blendv_epi8(f, t, m); }
+static inline Vec vshr(Vec a) { return _mm256_and_si256(_mm256_srli_epi16(a, 1), vsplat(0x7F)); }
+
+static inline Vec vmask(uint32_t mask)
+{
+    Vec spread = _mm256_shuffle_epi8(_mm256_set1_epi32((int) mask),
+        _mm256_setr_epi64x(0, 0x0101010101010101LL, 0x0202020202020202LL, 0x0303030303030303LL));
+    Vec bits = _mm256_set1_epi64x((long long) 0x8040201008040201ULL);
+    return _mm256_cmpeq_epi8(_mm256_and_si256(spread, bits), bits);
+}
+#else
+struct Vec {
+    uint8_t b[N];
+};
+
+#define SIMD_LANEWISE(expr) \
+    Vec r; \
+    for (unsigned i = 0; i < N; ++i) \
+        r.b[i] = (expr); \
+    return r;
+
+static inline Vec vload(const uint8_t *p) { Vec r; memcpy(r.b, p, N); return r; }
+static inline void vstore(uint8_t *p, Vec v) { memcpy(p, v.b, N); }
+static inline Vec vsplat(uint8_t x) { SIMD_LANEWISE(x) }
+static inline Vec vadd(Vec a, Vec b) { SIMD_LANEWISE(a.b[i] + b.b[i]) }
+static inline Vec vsub(Vec a, Vec b) { SIMD_LANEWISE(a.b[i] - b.b[i]) }
+static inline Vec vand(Vec a, Vec b) { SIMD_LANEWISE(a.b[i] & b.b[i]) }
+static inline Vec vor(Vec a, Vec b) { SIMD_LANEWISE(a.b[i] | b.b[i]) }
+static inline Vec vxor(Vec a, Vec b) { SIMD_LANEWISE(a.b[i] ^ b.b[i]) }
+static inline Vec veq(Vec a, Vec b) { SIMD_LANEWISE(a.b[i] == b.b[i] ? 0xFF : 0x00) }
+static inline Vec vge(Vec a, Vec b) { SIMD_LANEWISE(a.b[i] >= b.b[i] ? 0xFF : 0x00) }
+static inline Vec vsel(Vec m, Vec t, Vec f) { SIMD_LANEWISE((m.b[i] & t.b[i]) | (~m.b[i] & f.b[i])) }
+static inline Vec vshr(Vec a) { SIMD_LANEWISE(a.b[i] >> 1) }
+static inline Vec vmask(uint32_t mask) { SIMD_LANEWISE((mask >> i) & 1 ? 0xFF : 0x00) }
+#endif // __AVX2__
+
+static inline void vput(uint8_t *dst, Vec m, Vec v)
+{
+    vstore(dst, vsel(m, v, vload(dst)));
+}
+
+static inline Vec vbool(Vec m)
+{
+    return vand(m, vsplat(0x01));
+}
+
+uint8_t *SimdCPU::row(uint16_t addr)
+{
+    if (addr < 0x2000)
+        return &ram[(addr & 0x7FF) * N];
+    if (addr >= 0x4020 && addr < 0x8000)
+        return &cartridge_ram[(addr - 0x4020) * N];
+    return nullptr;
+}
+
+void SimdCPU::fault(unsigned lane, const string &what)
+{
+    if (halted[lane])
+        return;
+    halted[lane] = true;
+    unsupported[lane] = true;
+    errors[lane] = "unsupported by simd (only RAM, cartridge RAM, ROM and controllers are modeled): " + what;
+    faulted = true;
+}
+
+static string hex_addr(uint16_t addr)
+{
+    char text[8];
+    snprintf(text, sizeof(text), "$%04X", addr);
+    return text;
+}
+
+uint8_t SimdCPU::lane_peek(unsigned lane, uint16_t addr)
+{
+    if (addr >= 0x8000)
+        return rom[addr - 0x8000];
+    uint8_t *ptr = row(addr);
+    return ptr ? ptr[lane] : 0;
+}
+
+uint8_t SimdCPU::lane_read(unsigned lane, uint16_t addr)
+{
+    uint8_t data;
+    if (addr < 0x2000) {
+        data = ram[(addr & 0x7FF) * N + lane];
+    } else if (addr < 0x4000 || addr == 0x4015) {
+        fault(lane, "read from " + hex_addr(addr));
+        return open_bus[lane];
+    } else if (addr < 0x4020) {
+        if (addr == 0x4016 || addr == 0x4017)
+            data = ((addr >> 8) & 0xE0) | controller_read(lane, addr & 1);
+        else if (addr < 0x4018)
+            data = addr >> 8;
+        else
+            return open_bus[lane];
+    } else if (addr < 0x8000) {
+        data = cartridge_ram[(addr - 0x4020) * N + lane];
+    } else {
+        data = rom[addr - 0x8000];
+    }
+    return open_bus[lane] = data;
+}
+
+uint16_t SimdCPU::lane_read_dword(unsigned lane, uint16_t addr)
+{
+    uint8_t low = lane_read(lane, addr);
+    return low | (lane_read(lane, addr + 1) << 8);
+}
+
+void SimdCPU::lane_write(unsigned lane, uint16_t addr, uint8_t data)
+{
+    open_bus[lane] = data;
+    if (addr < 0x2000) {
+        ram[(addr & 0x7FF) * N + lane] = data;
+    } else if (addr == 0x4016) {
+        controller_write(lane, data);
+    } else if (addr < 0x4018) {
+        fault(lane, "write to " + hex_addr(addr));
+    } else if (addr >= 0x4020 && addr < 0x8000) {
+        cartridge_ram[(addr - 0x4020) * N + lane] = data;
+    }
+}
+
+uint8_t SimdCPU::controller_read(unsigned lane, unsigned port)
+{
+    if (strobe[lane])
+        return buttons[port][lane] & 0x01;
+    uint8_t bit = shift[port][lane] & 0x01;
+    shift[port][lane] = (shift[port][lane] >> 1) | 0x80;
+    return bit;
+}
+
+void SimdCPU::controller_write(unsigned lane, uint8_t data)
+{
+    strobe[lane] = data & 0x01;
+    if (strobe[lane]) {
+        shift[0][lane] = buttons[0][lane];
+        shift[1][lane] = buttons[1][lane];
+    }
+}
+
+void SimdCPU::stack_push(unsigned lane, uint8_t data)
+{
+    lane_write(lane, 0x100 + (s[lane]--), data);
+}
+
+uint8_t SimdCPU::stack_pop(unsigned lane)
+{
+    return lane_read(lane, 0x100 + (++s[lane]));
+}
+
+uint8_t SimdCPU::get_p(unsigned lane)
+{
+    return (p[lane] & 0x3C) | flag_c[lane] | ((z_src[lane] == 0) << 1) |
+        (flag_v[lane] << 6) | (n_src[lane] & 0x80);
+}
+
+void SimdCPU::set_p(unsigned lane, uint8_t data)
+{
+    p[lane] = data;
+    flag_c[lane] = data & 0x01;
+    flag_v[lane] = (data >> 6) & 0x01;
+    z_src[lane] = !(data & 0x02);
+    n_src[lane] = data & 0x80;
+}
+
+bool SimdCPU::condition(unsigned lane, uint8_t opcode)
+{
+    bool flag;
+    switch (opcode >> 6) {
+    case 0: flag = (n_src[lane] & 0x80) != 0; break;
+    case 1: flag = flag_v[lane] != 0; break;
+    case 2: flag = flag_c[lane] != 0; break;
+    default: flag = z_src[lane] == 0; break;
+    }
+    return flag == ((opcode & 0x20) != 0);
+}
+
+uint8_t SimdCPU::modify(unsigned lane, uint8_t op, uint8_t data)
+{
+    uint8_t carry = flag_c[lane];
+    switch (op) {
+    case OP_ASL_dma:
+        flag_c[lane] = data >> 7;
+        data <<= 1;
+        break;
+    case OP_LSR_dma:
+        flag_c[lane] = data & 0x01;
+        data >>= 1;
+        break;
+    case OP_ROL_dma:
+        flag_c[lane] = data >> 7;
+        data = (data << 1) | carry;
+        break;
+    case OP_ROR_dma:
+        flag_c[lane] = data & 0x01;
+        data = (data << 1) | (carry << 7);
+        break;
+    case OP_INC:
+        ++data;
+        break;
+    default:
+        --data;
+        break;
+    }
+    z_src[lane] = n_src[lane] = data;
+    return data;
+}
+
+uint32_t SimdCPU::step(uint32_t group, bool &converged)
+{
+    converged = false;
+    unsigned first = __builtin_ctz(group);
+    uint16_t start = pc[first];
+    uint8_t opcode;
+    uint8_t lo = 0;
+    uint8_t hi = 0;
+    uint8_t length;
+    if (start >= 0x8000 && start <= 0xFFFD) {
+        opcode = rom[start - 0x8000];
+        lo = rom[start - 0x7FFF];
+        hi = rom[start - 0x7FFE];
+        length = op_length_table[opcode];
+    } else if (start >= 0x1FFE && start < 0x4020) {
+        group = 1u << first;
+        opcode = lane_read(first, start);
+        length = op_length_table[opcode];
+        if (length >= 2)
+            lo = lane_read(first, start + 1);
+        if (length == 3)
+            hi = lane_read(first, start + 2);
+    } else {
+        opcode = lane_peek(first, start);
+        length = op_length_table[opcode];
+        if (length >= 2)
+            lo = lane_peek(first, start + 1);
+        if (length == 3)
+            hi = lane_peek(first, start + 2);
+        for (uint32_t rest = group & (group - 1); rest; rest &= rest - 1) {
+            unsigned lane = __builtin_ctz(rest);
+            if (lane_peek(lane, start) != opcode ||
+                (length >= 2 && lane_peek(lane, start + 1) != lo) ||
+                (length == 3 && lane_peek(lane, start + 2) != hi))
+                group &= ~(1u << lane);
+        }
+    }
+    unsigned list[N];
+    unsigned count = 0;
+    for (uint32_t rest = group; rest; rest &= rest - 1)
+        list[count++] = __builtin_ctz(rest);
+    Vec m = vmask(group);
+    uint8_t mask_bytes[N];
+    vstore(mask_bytes, m);
+    uint8_t last = length == 1 ? opcode : length == 2 ? lo : hi;
+    uint16_t next = start + length;
+    uint8_t base_cycles = CPU::cycle_table[opcode];
+    uint8_t penalty = CPU::page_cross_table[opcode];
+    for (unsigned lane = 0; lane < N; ++lane) {
+        cycles[lane] += base_cycles & mask_bytes[lane];
+        pc[lane] = mask_bytes[lane] ? next : pc[lane];
+    }
+    if (!(start >= 0x1FFE && start < 0x4020))
+        vput(open_bus, m, vsplat(last));
+    uint8_t kind = op_kind_table[opcode];
+    uint8_t mode = op_mode_table[opcode];
+    uint8_t op = op_table[opcode];
+    if (kind == KIND_none) {
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned lane = list[i];
+            pc[lane] = start + 1;
+            halted[lane] = true;
+            errors[lane] = "invalid opcode: " + to_string(opcode);
+        }
+        return group;
+    }
+
+    uint16_t word = lo | (hi << 8);
+    uint16_t addr[N];
+    bool uniform = false;
+    uint16_t uniform_addr = 0;
+    switch (mode) {
+    case MODE_zpg:
+        uniform = true;
+        uniform_addr = lo;
+        break;
+    case MODE_abs:
+        uniform = true;
+        uniform_addr = word;
+        break;
+    case MODE_rel:
+        uniform = true;
+        uniform_addr = (uint16_t) ((int16_t) next + (int8_t) lo);
+        break;
+    case MODE_zpgX:
+    case MODE_zpgY:
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned lane = list[i];
+            addr[lane] = (lo + (mode == MODE_zpgX ? x[lane] : y[lane])) & 0xFF;
+        }
+        break;
+    case MODE_absX:
+    case MODE_absY:
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned lane = list[i];
+            addr[lane] = word + (mode == MODE_absX ? x[lane] : y[lane]);
+            if ((word ^ addr[lane]) & 0xFF00)
+                cycles[lane] += penalty;
+        }
+        break;
+    case MODE_ind:
+        for (unsigned i = 0; i < count; ++i)
+            addr[list[i]] = lane_read_dword(list[i], word);
+        break;
+    case MODE_Xind:
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned lane = list[i];
+            addr[lane] = lane_read_dword(lane, (lo + x[lane]) & 0xFF);
+        }
+        break;
+    case MODE_indY:
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned lane = list[i];
+            uint16_t base = lane_read_dword(lane, lo);
+            addr[lane] = base + y[lane];
+            if ((base ^ addr[lane]) & 0xFF00)
+                cycles[lane] += penalty;
+        }
+        break;
+    default:
+        break;
+    }
+    if (uniform)
+        for (unsigned i = 0; i < count; ++i)
+            addr[list[i]] = uniform_addr;
+
+    Vec val = vsplat(0);
+    if (kind == KIND_read) {
+        uint8_t *ptr = uniform ? row(uniform_addr) : nullptr;
+        if (ptr) {
+            val = vload(ptr);
+            vput(open_bus, m, val);
+        } else if (uniform && uniform_addr >= 0x8000) {
+            val = vsplat(rom[uniform_addr - 0x8000]);
+            vput(open_bus, m, val);
+        } else {
+            uint8_t bytes[N] = {};
+            for (unsigned i = 0; i < count; ++i)
+                bytes[list[i]] = lane_read(list[i], addr[list[i]]);
+            val = vload(bytes);
+        }
+    } else if (kind == KIND_val) {
+        val = mode == MODE_A ? vload(a) : vsplat(lo);
+    }
+
+    Vec one = vsplat(0x01);
+    converged = true;
+    switch (op) {
+    case OP_ADC:
+    case OP_SBC: {
+        if (op == OP_SBC)
+            val = vxor(val, vsplat(0xFF));
+        Vec va = vload(a);
+        Vec carry_in = vload(flag_c);
+        Vec partial = vadd(va, val);
+        Vec sum = vadd(partial, carry_in);
+        Vec carry = vor(vxor(vge(partial, va), vsplat(0xFF)), vand(veq(sum, vsplat(0)), veq(carry_in, one)));
+        vput(a, m, sum);
+        vput(z_src, m, sum);
+        vput(n_src, m, sum);
+        vput(flag_c, m, vbool(carry));
+        vput(flag_v, m, vsplat(0));
+        break;
+    }
+    case OP_AND:
+    case OP_EOR:
+    case OP_ORA: {
+        Vec va = vload(a);
+        Vec r = op == OP_AND ? vand(va, val) : op == OP_EOR ? vxor(va, val) : vor(va, val);
+        vput(a, m, r);
+        vput(z_src, m, r);
+        vput(n_src, m, r);
+        break;
+    }
+    case OP_ASL_A:
+    case OP_LSR_A:
+    case OP_ROL_A:
+    case OP_ROR_A: {
+        Vec carry_in = vload(flag_c);
+        Vec r;
+        Vec carry;
+        if (op == OP_ASL_A || op == OP_ROL_A) {
+            carry = vbool(vge(val, vsplat(0x80)));
+            r = vadd(val, val);
+            if (op == OP_ROL_A)
+                r = vor(r, carry_in);
+        } else {
+            carry = vand(val, one);
+            r = vshr(val);
+            if (op == OP_ROR_A)
+                r = vor(r, vand(veq(carry_in, one), vsplat(0x80)));
+        }
+        vput(a, m, r);
+        vput(z_src, m, r);
+        vput(n_src, m, r);
+        vput(flag_c, m, carry);
+        break;
+    }
+    case OP_BIT:
+        vput(n_src, m, val);
+        vput(z_src, m, vand(vload(a), val));
+        vput(flag_v, m, vbool(vxor(veq(vand(val, vsplat(0x40)), vsplat(0)), vsplat(0xFF))));
+        break;
+    case OP_CMP:
+    case OP_CPX:
+    case OP_CPY: {
+        Vec reg = vload(op == OP_CMP ? a : op == OP_CPX ? x : y);
+        Vec r = vsub(reg, val);
+        vput(z_src, m, r);
+        vput(n_src, m, r);
+        vput(flag_c, m, vbool(vge(reg, val)));
+        break;
+    }
+    case OP_LDA:
+    case OP_LDX:
+    case OP_LDY:
+        vput(op == OP_LDA ? a : op == OP_LDX ? x : y, m, val);
+        vput(z_src, m, val);
+        vput(n_src, m, val);
+        break;
+    case OP_TAX:
+    case OP_TAY:
+    case OP_TSX:
+    case OP_TXA:
+    case OP_TYA: {
+        Vec r = vload(op == OP_TSX ? s : op == OP_TXA ? x : op == OP_TYA ? y : a);
+        vput(op == OP_TAX || op == OP_TSX ? x : op == OP_TAY ? y : a, m, r);
+        vput(z_src, m, r);
+        vput(n_src, m, r);
+        break;
+    }
+    case OP_TXS:
+        vput(s, m, vload(x));
+        break;
+    case OP_INX:
+    case OP_INY:
+    case OP_DEX:
+    case OP_DEY: {
+        uint8_t *reg = op == OP_INX || op == OP_DEX ? x : y;
+        Vec r = vadd(vload(reg), vsplat(op == OP_INX || op == OP_INY ? 0x01 : 0xFF));
+        vput(reg, m, r);
+        vput(z_src, m, r);
+        vput(n_src, m, r);
+        break;
+    }
+    case OP_CLC:
+    case OP_SEC:
+        vput(flag_c, m, vsplat(op == OP_SEC));
+        break;
+    case OP_CLV:
+        vput(flag_v, m, vsplat(0));
+        break;
+    case OP_CLI:
+        for (unsigned i = 0; i < count; ++i)
+            fault(list[i], "CLI");
+        break;
+    case OP_CLD:
+        vput(p, m, vand(vload(p), vsplat(~0x08)));
+        break;
+    case OP_SEI:
+    case OP_SED:
+        vput(p, m, vor(vload(p), vsplat(op == OP_SEI ? 0x04 : 0x08)));
+        break;
+    case OP_NOP:
+        break;
+    case OP_STA:
+    case OP_STX:
+    case OP_STY: {
+        uint8_t *reg = op == OP_STA ? a : op == OP_STX ? x : y;
+        uint8_t *ptr = uniform ? row(uniform_addr) : nullptr;
+        if (ptr) {
+            Vec r = vload(reg);
+            vput(ptr, m, r);
+            vput(open_bus, m, r);
+        } else {
+            for (unsigned i = 0; i < count; ++i)
+                lane_write(list[i], addr[list[i]], reg[list[i]]);
+        }
+        break;
+    }
+    case OP_ASL_dma:
+    case OP_LSR_dma:
+    case OP_ROL_dma:
+    case OP_ROR_dma:
+    case OP_INC:
+    case OP_DEC:
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned lane = list[i];
+            uint8_t data = modify(lane, op, lane_read(lane, addr[lane]));
+            lane_write(lane, addr[lane], data);
+        }
+        break;
+    case OP_BCC:
+    case OP_BCS:
+    case OP_BEQ:
+    case OP_BMI:
+    case OP_BNE:
+    case OP_BPL:
+    case OP_BVC:
+    case OP_BVS: {
+        unsigned taken = 0;
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned lane = list[i];
+            if (condition(lane, opcode)) {
+                cycles[lane] += ((next ^ uniform_addr) & 0xFF00) ? 2 : 1;
+                pc[lane] = uniform_addr;
+                ++taken;
+            }
+        }
+        converged = !taken || taken == count;
+        break;
+    }
+    case OP_JMP:
+        for (unsigned i = 0; i < count; ++i)
+            pc[list[i]] = addr[list[i]];
+        converged = mode == MODE_abs;
+        break;
+    case OP_JSR:
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned lane = list[i];
+            uint16_t ret = next - 1;
+            stack_push(lane, ret >> 8);
+            stack_push(lane, ret & 0xFF);
+            pc[lane] = addr[lane];
+        }
+        break;
+    case OP_RTS:
+        converged = false;
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned lane = list[i];
+            uint16_t ret = stack_pop(lane);
+            ret |= stack_pop(lane) << 8;
+            pc[lane] = ret + 1;
+        }
+        break;
+    case OP_RTI:
+        converged = false;
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned lane = list[i];
+            set_p(lane, stack_pop(lane));
+            uint16_t ret = stack_pop(lane);
+            ret |= stack_pop(lane) << 8;
+            pc[lane] = ret;
+            if (!(p[lane] & 0x04))
+                fault(lane, "RTI with IRQs unmasked");
+        }
+        break;
+    case OP_BRK:
+        converged = false;
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned lane = list[i];
+            uint16_t ret = ++pc[lane];
+            stack_push(lane, ret >> 8);
+            stack_push(lane, ret & 0xFF);
+            p[lane] |= 0x30;
+            stack_push(lane, get_p(lane));
+            pc[lane] = lane_read_dword(lane, 0xFFFE);
+        }
+        break;
+    case OP_PHA:
+    case OP_PHP:
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned lane = list[i];
+            stack_push(lane, op == OP_PHA ? a[lane] : get_p(lane));
+        }
+        break;
+    case OP_PLA:
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned lane = list[i];
+            a[lane] = z_src[lane] = n_src[lane] = stack_pop(lane);
+        }
+        break;
+    case OP_PLP:
+        for (unsigned i = 0; i < count; ++i) {
+            unsigned lane = list[i];
+            set_p(lane, stack_pop(lane));
+            if (!(p[lane] & 0x04))
+                fault(lane, "PLP with IRQs unmasked");
+        }
+        break;
+    default:
+        break;
+    }
+    return group;
+}
+
+SimdCPU::SimdCPU(const vector<uint8_t> &cartridge, unsigned lanes) :
+    lanes(lanes), faulted(false), ram(0x800 * N), cartridge_ram((0x8000 - 0x4020) * N), rom(0x8000)
+{
+    if (!lanes || lanes > MAX_LANES)
+        throw runtime_error("simd lane count must be between 1 and " + to_string(MAX_LANES));
+    for (size_t i = 0; i < 0x8000 - 0x4020 && i < cartridge.size(); ++i)
+        memset(&cartridge_ram[i * N], cartridge[i], N);
+    for (size_t i = 0; i < 0x8000 && 0x8000 - 0x4020 + i < cartridge.size(); ++i)
+        rom[i] = cartridge[0x8000 - 0x4020 + i];
+    memset(open_bus, 0, sizeof(open_bus));
+    memset(strobe, 0, sizeof(strobe));
+    memset(buttons, 0, sizeof(buttons));
+    memset(shift, 0, sizeof(shift));
+    memset(cycles, 0, sizeof(cycles));
+    memset(halted, 0, sizeof(halted));
+    memset(unsupported, 0, sizeof(unsupported));
+    stats.groups = 0;
+    stats.instructions = 0;
+    for (unsigned lane = 0; lane < N; ++lane) {
+        pc[lane] = 0;
+        set_p(lane, 0x34);
+        a[lane] = x[lane] = y[lane] = 0x00;
+        s[lane] = 0xFD;
+    }
+}
+
+void SimdCPU::reset()
+{
+    for (unsigned lane = 0; lane < lanes; ++lane) {
+        s[lane] -= 0x03;
+        p[lane] |= 0x04;
+        pc[lane] = lane_read_dword(lane, 0xFFFC);
+        cycles[lane] += 7;
+    }
+}
+
+void SimdCPU::run_until(uint64_t cycle)
+{
+    static const uint64_t MAX_STEP_CYCLES = 8;
+    uint32_t active = 0;
+    uint64_t horizon = 0;
+    for (unsigned lane = 0; lane < lanes; ++lane) {
+        if (!halted[lane] && cycles[lane] < cycle) {
+            active |= 1u << lane;
+            horizon = max(horizon, cycles[lane]);
+        }
+    }
+    uint32_t group = 0;
+    while (active) {
+        if (!group) {
+            uint16_t min_pc = 0xFFFF;
+            for (uint32_t rest = active; rest; rest &= rest - 1) {
+                unsigned lane = __builtin_ctz(rest);
+                if (pc[lane] < min_pc)
+                    min_pc = pc[lane];
+            }
+            for (uint32_t rest = active; rest; rest &= rest - 1) {
+                unsigned lane = __builtin_ctz(rest);
+                if (pc[lane] == min_pc)
+                    group |= 1u << lane;
+            }
+        }
+        bool converged;
+        uint32_t ran = step(group, converged);
+        ++stats.groups;
+        stats.instructions += __builtin_popcount(ran);
+        if (faulted) {
+            faulted = false;
+            converged = false;
+        }
+        bool whole = ran == active;
+        horizon += MAX_STEP_CYCLES;
+        if (!converged || horizon >= cycle) {
+            horizon = 0;
+            for (uint32_t rest = active; rest; rest &= rest - 1) {
+                unsigned lane = __builtin_ctz(rest);
+                if (halted[lane] || cycles[lane] >= cycle)
+                    active &= ~(1u << lane);
+                else
+                    horizon = max(horizon, cycles[lane]);
+            }
+        }
+        group = whole && converged ? active : 0;
+    }
+}
+
+unsigned SimdCPU::lane_count()
+{
+    return lanes;
+}
+
+CPU::State SimdCPU::get_state(unsigned lane)
+{
+    CPU::State state;
+    state.pc = pc[lane];
+    state.a = a[lane];
+    state.x = x[lane];
+    state.y = y[lane];
+    state.s = s[lane];
+    state.p = get_p(lane);
+    state.cycles = cycles[lane];
+    return state;
+}
+
+bool SimdCPU::is_halted(unsigned lane)
+{
+    return halted[lane];
+}
+
+bool SimdCPU::is_unsupported(unsigned lane)
+{
+    return unsupported[lane];
+}
+
+const string &SimdCPU::error(unsigned lane)
+{
+    return errors[lane];
+}
+
+uint8_t SimdCPU::peek(unsigned lane, uint16_t addr)
+{
+    return lane_peek(lane, addr);
+}
+
+void SimdCPU::poke(unsigned lane, uint16_t addr, uint8_t data)
+{
+    uint8_t *ptr = row(addr);
+    if (ptr)
+        ptr[lane] = data;
+}
+
+void SimdCPU::set_buttons(unsigned lane, unsigned port, uint8_t buttons)
+{
+    this->buttons[port & 1][lane] = buttons;
+    if (strobe[lane])
+        shift[port & 1][lane] = buttons;
+}
+
+SimdCPU::Stats SimdCPU::get_stats()
+{
+    return stats;
+}
@@ -0,0 +1,73 @@
+#ifndef CPU_SIMD_H
+#define CPU_SIMD_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+
+class SimdCPU {
+public:
+    static const unsigned MAX_LANES = 32;
+    struct Stats {
+        uint64_t groups;
+        uint64_t instructions;
+    };
+private:
+    typedef uint8_t Lanes[MAX_LANES];
+    unsigned lanes;
+    uint16_t pc[MAX_LANES];
+    Lanes a;
+    Lanes x;
+    Lanes y;
+    Lanes s;
+    Lanes p;
+    Lanes z_src;
+    Lanes n_src;
+    Lanes flag_c;
+    Lanes flag_v;
+    Lanes open_bus;
+    Lanes strobe;
+    Lanes buttons[2];
+    Lanes shift[2];
+    uint64_t cycles[MAX_LANES];
+    bool halted[MAX_LANES];
+    bool unsupported[MAX_LANES];
+    bool faulted;
+    std::string errors[MAX_LANES];
+    std::vector<uint8_t> ram;
+    std::vector<uint8_t> cartridge_ram;
+    std::vector<uint8_t> rom;
+    Stats stats;
+    uint8_t *row(uint16_t addr);
+    void fault(unsigned lane, const std::string &what);
+    uint8_t lane_peek(unsigned lane, uint16_t addr);
+    uint8_t lane_read(unsigned lane, uint16_t addr);
+    uint16_t lane_read_dword(unsigned lane, uint16_t addr);
+    void lane_write(unsigned lane, uint16_t addr, uint8_t data);
+    uint8_t controller_read(unsigned lane, unsigned port);
+    void controller_write(unsigned lane, uint8_t data);
+    void stack_push(unsigned lane, uint8_t data);
+    uint8_t stack_pop(unsigned lane);
+    uint8_t get_p(unsigned lane);
+    void set_p(unsigned lane, uint8_t data);
+    bool condition(unsigned lane, uint8_t opcode);
+    uint8_t modify(unsigned lane, uint8_t op, uint8_t data);
+    uint32_t step(uint32_t group, bool &converged);
+public:
+    SimdCPU(const std::vector<uint8_t> &cartridge, unsigned lanes);
+    void reset();
+    void run_until(uint64_t cycle);
+    unsigned lane_count();
+    CPU::State get_state(unsigned lane);
+    bool is_halted(unsigned lane);
+    bool is_unsupported(unsigned lane);
+    const std::string &error(unsigned lane);
+    uint8_t peek(unsigned lane, uint16_t addr);
+    void poke(unsigned lane, uint16_t addr, uint8_t data);
+    void set_buttons(unsigned lane, unsigned port, uint8_t buttons);
+    Stats get_stats();
+};
+
+#endif // CPU_SIMD_H
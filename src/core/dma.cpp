@@ -1,41 +1,345 @@
 #include "dma.h"
 
+#include <cstring>
 #include <stdexcept>
 
 using namespace std;
 
-Memory &DMA::resolve_addr(uint16_t addr)
+static const uint16_t CARTRIDGE_RAM_START = 0x4020;
+static const uint16_t CARTRIDGE_RAM_LENGTH = 0x8000 - CARTRIDGE_RAM_START;
+static const uint16_t TRAINER_START = 0x7000;
+static uint8_t blank_page[0x100];
+
+void DMA::map_page(uint8_t page, uint8_t *read_ptr, uint8_t *write_ptr, IOSlot slot)
 {
-    for (auto iter = memories.begin(); iter != memories.end(); ++iter)
-        if (iter->addr_in_range(addr))
-            return *iter;
-    throw runtime_error("address not in range: " + to_string(addr));
+    uint8_t prev = page;
+    while (alias_next[prev] != page)
+        prev = alias_next[prev];
+    alias_next[prev] = alias_next[page];
+    alias_next[page] = page;
+    for (unsigned i = 0; write_ptr && i < 0x100; ++i) {
+        if (i != page && mapped_write_pages[i] == write_ptr) {
+            alias_next[page] = alias_next[i];
+            alias_next[i] = page;
+            break;
+        }
+    }
+    read_pages[page] = read_ptr;
+    write_pages[page] = write_ptr;
+    mapped_write_pages[page] = write_ptr;
+    io_slots[page] = slot;
+    watched_pages[page] = false;
+    watched_rom_pages[page] = false;
 }
 
-DMA::DMA()
+uint8_t DMA::read_io(uint16_t addr)
 {
-    memories.emplace_back(0x0000, 0x1FFF, 0x0800); // RAM
-    memories.emplace_back(0x2000, 0x3FFF, 0x0008); // PPU
-    memories.emplace_back(0x4000, 0x4017, 0x0018); // APU & IO
-    memories.emplace_back(0x4020, 0xFFFF, 0xBFE0); // Cartridge
+    switch (io_slots[addr >> 8]) {
+    case IO_PPU:
+        ppu.sync(PPU::SYNC_REGISTER);
+        return open_bus = ppu.read_register(addr);
+    case IO_APU:
+        if (addr == 0x4016 || addr == 0x4017)
+            return open_bus = ((addr >> 8) & 0xE0) | controller.read(addr & 1);
+        if (addr == 0x4015) {
+            apu.sync();
+            return open_bus = apu.read_status();
+        }
+        if (addr < 0x4018)
+            return open_bus = addr >> 8;
+        if (addr >= 0x4020)
+            return open_bus = cartridge.read(addr);
+        return open_bus;
+    default:
+        return open_bus;
+    }
 }
 
-uint8_t DMA::read(uint16_t addr)
+void DMA::write_io(uint16_t addr, uint8_t data)
 {
-    return resolve_addr(addr).read(addr);
+    uint8_t page = addr >> 8;
+    if (watched_pages[page]) {
+        mapped_write_pages[page][addr & 0xFF] = data;
+        uint8_t alias = page;
+        do {
+            code_write_hook(alias);
+            alias = alias_next[alias];
+        } while (alias != page);
+        return;
+    }
+    switch (io_slots[addr >> 8]) {
+    case IO_PPU:
+        ppu.sync(PPU::SYNC_REGISTER);
+        ppu.write_register(addr, data);
+        if ((addr & 0x07) == 0) {
+            reschedule(Scheduler::EVENT_NMI);
+            if (clock && ppu.nmi_pending())
+                scheduler.schedule(Scheduler::EVENT_NMI, *clock);
+        }
+        if ((addr & 0x07) == 1)
+            reschedule(Scheduler::EVENT_MAPPER_IRQ);
+        break;
+    case IO_APU:
+        if (addr == 0x4014) {
+            uint8_t page[0x100];
+            for (unsigned i = 0; i < 0x100; ++i)
+                page[i] = read((data << 8) | i);
+            ppu.sync(PPU::SYNC_OAM_DMA);
+            ppu.oam_dma(page);
+            if (clock)
+                *clock += 513 + (*clock & 1);
+        } else if (addr == 0x4016) {
+            controller.write(data);
+        } else if (addr < 0x4018) {
+            apu.sync();
+            apu.write_register(addr, data);
+            if (addr == 0x4017)
+                reschedule(Scheduler::EVENT_FRAME_IRQ);
+            if (addr == 0x4010 || addr == 0x4015)
+                reschedule(Scheduler::EVENT_DMC_IRQ);
+        } else if (addr >= 0x4020) {
+            cartridge.write(addr, data);
+        }
+        break;
+    case IO_MAPPER:
+        ppu.sync(PPU::SYNC_MAPPER);
+        mapper->write(addr, data);
+        reschedule(Scheduler::EVENT_MAPPER_IRQ);
+        break;
+    default:
+        break;
+    }
 }
 
-uint16_t DMA::read_dword(uint16_t addr)
+DMA::DMA() :
+    ram(0x0000, 0x1FFF, 0x0800),
+    apu(*this),
+    cartridge(CARTRIDGE_RAM_START, 0x7FFF, CARTRIDGE_RAM_LENGTH),
+    open_bus(0),
+    clock(nullptr)
 {
-    return resolve_addr(addr).read_dword(addr);
+    for (unsigned page = 0; page < 0x100; ++page) {
+        mapped_write_pages[page] = nullptr;
+        alias_next[page] = page;
+    }
+    for (unsigned page = 0x00; page < 0x20; ++page) {
+        uint8_t *ptr = ram.host_addr(page << 8);
+        map_page(page, ptr, ptr, IO_NONE);
+    }
+    for (unsigned page = 0x20; page < 0x40; ++page)
+        map_page(page, nullptr, nullptr, IO_PPU);
+    map_page(0x40, nullptr, nullptr, IO_APU);
+    for (unsigned page = 0x41; page < 0x80; ++page) {
+        uint8_t *ptr = cartridge.host_addr(page << 8);
+        map_page(page, ptr, ptr, IO_NONE);
+    }
+    for (unsigned page = 0x80; page < 0x100; ++page)
+        map_page(page, blank_page, nullptr, IO_NONE);
 }
 
-void DMA::write(uint16_t addr, uint8_t data)
+void DMA::load_cartridge(const vector<uint8_t> &data)
 {
-    resolve_addr(addr).write(addr, data);
+    load_image(ROM::cartridge_image(data));
+    cartridge.load(data);
 }
 
-void DMA::load_cartridge(const vector<uint8_t> &data)
+void DMA::load_image(const shared_ptr<const ROMImage> &image)
+{
+    if (!image->prg_rom_size)
+        throw runtime_error("rom image has no PRG ROM");
+    for (unsigned page = 0x80; page < 0x100; ++page)
+        map_page(page, blank_page, nullptr, IO_MAPPER);
+    mapper = Mapper::create(*this, image);
+    ppu.set_mapper(mapper.get());
+    cartridge.load(vector<uint8_t>());
+    if (image->trainer)
+        memcpy(cartridge.host_addr(TRAINER_START), image->trainer, 0x200);
+    reschedule_all();
+}
+
+void DMA::map_rom(uint8_t page, const uint8_t *data)
+{
+    if (read_pages[page] == data)
+        return;
+    read_pages[page] = const_cast<uint8_t *>(data);
+    if (watched_rom_pages[page])
+        code_write_hook(page);
+}
+
+Mapper *DMA::get_mapper()
+{
+    return mapper.get();
+}
+
+PPU &DMA::get_ppu()
+{
+    return ppu;
+}
+
+APU &DMA::get_apu()
+{
+    return apu;
+}
+
+Scheduler &DMA::get_scheduler()
+{
+    return scheduler;
+}
+
+void DMA::set_clock(uint64_t *clock)
+{
+    this->clock = clock;
+    ppu.set_clock(clock);
+    apu.set_clock(clock);
+    reschedule_all();
+}
+
+void DMA::reschedule(Scheduler::Event event)
+{
+    switch (event) {
+    case Scheduler::EVENT_NMI:
+        scheduler.schedule(event, ppu.next_nmi_cycle());
+        break;
+    case Scheduler::EVENT_FRAME_IRQ:
+        scheduler.schedule(event, apu.next_frame_irq_cycle());
+        break;
+    case Scheduler::EVENT_DMC_IRQ:
+        scheduler.schedule(event, apu.next_dmc_irq_cycle());
+        break;
+    default:
+        scheduler.schedule(event, ppu.next_irq_cycle());
+        break;
+    }
+}
+
+void DMA::reschedule_all()
+{
+    for (unsigned event = 0; event < Scheduler::EVENTS; ++event)
+        reschedule((Scheduler::Event) event);
+}
+
+void DMA::run_events(uint64_t cycle)
+{
+    Scheduler::Event event;
+    while (scheduler.pop(cycle, event)) {
+        if (event == Scheduler::EVENT_FRAME_IRQ || event == Scheduler::EVENT_DMC_IRQ)
+            apu.sync();
+        else
+            ppu.sync(PPU::SYNC_EVENT);
+        reschedule(event);
+    }
+}
+
+bool DMA::take_nmi()
+{
+    return ppu.take_nmi();
+}
+
+bool DMA::irq_line()
+{
+    return apu.irq_pending() || (mapper && mapper->irq_pending());
+}
+
+const uint8_t *DMA::host_page(uint8_t page)
+{
+    return read_pages[page];
+}
+
+uint8_t DMA::peek(uint16_t addr)
+{
+    const uint8_t *page = read_pages[addr >> 8];
+    return page ? page[addr & 0xFF] : 0;
+}
+
+void DMA::set_buttons(unsigned port, uint8_t buttons)
+{
+    controller.set_buttons(port, buttons);
+}
+
+uint8_t DMA::get_buttons(unsigned port)
+{
+    return controller.get_buttons(port);
+}
+
+void DMA::watch_page(uint8_t page)
+{
+    uint8_t *ptr = mapped_write_pages[page];
+    if (!ptr && io_slots[page] == IO_MAPPER) {
+        watched_rom_pages[page] = true;
+        return;
+    }
+    if (!ptr || watched_pages[page])
+        return;
+    uint8_t alias = page;
+    do {
+        watched_pages[alias] = true;
+        write_pages[alias] = nullptr;
+        alias = alias_next[alias];
+    } while (alias != page);
+}
+
+void DMA::unwatch_page(uint8_t page)
+{
+    uint8_t *ptr = mapped_write_pages[page];
+    watched_rom_pages[page] = false;
+    if (!watched_pages[page])
+        return;
+    uint8_t alias = page;
+    do {
+        watched_pages[alias] = false;
+        write_pages[alias] = ptr;
+        alias = alias_next[alias];
+    } while (alias != page);
+}
+
+void DMA::set_code_write_hook(const function<void(uint8_t)> &hook)
+{
+    code_write_hook = hook;
+}
+
+size_t DMA::state_size()
+{
+    return ram.length() + apu.state_size() + CARTRIDGE_RAM_LENGTH + controller.state_size() +
+        sizeof(open_bus) + (mapper ? mapper->state_size() : 0) + ppu.state_size();
+}
+
+void DMA::save_state(uint8_t *buffer)
+{
+    memcpy(buffer, ram.host_addr(0x0000), ram.length());
+    buffer += ram.length();
+    apu.save_state(buffer);
+    buffer += apu.state_size();
+    memcpy(buffer, cartridge.host_addr(CARTRIDGE_RAM_START), CARTRIDGE_RAM_LENGTH);
+    buffer += CARTRIDGE_RAM_LENGTH;
+    controller.save_state(buffer);
+    buffer += controller.state_size();
+    *buffer++ = open_bus;
+    if (mapper) {
+        mapper->save_state(buffer);
+        buffer += mapper->state_size();
+    }
+    ppu.save_state(buffer);
+}
+
+void DMA::load_state(const uint8_t *buffer)
 {
-    memories[3].load(data);
+    memcpy(ram.host_addr(0x0000), buffer, ram.length());
+    buffer += ram.length();
+    apu.load_state(buffer);
+    buffer += apu.state_size();
+    memcpy(cartridge.host_addr(CARTRIDGE_RAM_START), buffer, CARTRIDGE_RAM_LENGTH);
+    buffer += CARTRIDGE_RAM_LENGTH;
+    controller.load_state(buffer);
+    buffer += controller.state_size();
+    open_bus = *buffer++;
+    if (mapper) {
+        mapper->load_state(buffer);
+        buffer += mapper->state_size();
+    }
+    ppu.set_mapper(mapper.get());
+    ppu.load_state(buffer);
+    reschedule_all();
+    for (unsigned page = 0; page < 0x100; ++page)
+        if (watched_pages[page])
+            code_write_hook(page);
 }
@@ -1,18 +1,108 @@
 #ifndef DMA_H
 #define DMA_H
 
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+#include "apu.h"
+#include "controller.h"
+#include "mapper.h"
 #include "memory.h"
+#include "ppu.h"
+#include "rom.h"
+#include "scheduler.h"
 
 class DMA {
 private:
-    std::vector<Memory> memories;
-    Memory &resolve_addr(uint16_t addr);
+#ifdef USE_JIT
+    friend class JIT;
+#endif // USE_JIT
+    enum IOSlot {
+        IO_NONE = 0,
+        IO_PPU = 1,
+        IO_APU = 2,
+        IO_MAPPER = 3
+    };
+    Memory ram;
+    PPU ppu;
+    APU apu;
+    Memory cartridge;
+    Controller controller;
+    std::unique_ptr<Mapper> mapper;
+    Scheduler scheduler;
+    uint8_t *read_pages[0x100];
+    uint8_t *write_pages[0x100];
+    uint8_t *mapped_write_pages[0x100];
+    uint8_t alias_next[0x100];
+    uint8_t io_slots[0x100];
+    bool watched_pages[0x100];
+    bool watched_rom_pages[0x100];
+    uint8_t open_bus;
+    uint64_t *clock;
+    std::function<void(uint8_t)> code_write_hook;
+    void map_page(uint8_t page, uint8_t *read_ptr, uint8_t *write_ptr, IOSlot slot);
+    uint8_t read_io(uint16_t addr);
+    void write_io(uint16_t addr, uint8_t data);
+    void reschedule(Scheduler::Event event);
+    void reschedule_all();
 public:
     DMA();
+    DMA(const DMA &) = delete;
+    DMA &operator=(const DMA &) = delete;
     uint8_t read(uint16_t addr);
     uint16_t read_dword(uint16_t addr);
     void write(uint16_t addr, uint8_t data);
     void load_cartridge(const std::vector<uint8_t> &data);
+    void load_image(const std::shared_ptr<const ROMImage> &image);
+    void map_rom(uint8_t page, const uint8_t *data);
+    Mapper *get_mapper();
+    PPU &get_ppu();
+    APU &get_apu();
+    Scheduler &get_scheduler();
+    void set_clock(uint64_t *clock);
+    void run_events(uint64_t cycle);
+    bool take_nmi();
+    bool irq_line();
+    const uint8_t *host_page(uint8_t page);
+    uint8_t peek(uint16_t addr);
+    void set_buttons(unsigned port, uint8_t buttons);
+    uint8_t get_buttons(unsigned port);
+    void watch_page(uint8_t page);
+    void unwatch_page(uint8_t page);
+    void set_code_write_hook(const std::function<void(uint8_t)> &hook);
+    size_t state_size();
+    void save_state(uint8_t *buffer);
+    void load_state(const uint8_t *buffer);
 };
 
+inline uint8_t DMA::read(uint16_t addr)
+{
+    uint8_t *page = read_pages[addr >> 8];
+    if (page)
+        return open_bus = page[addr & 0xFF];
+    return read_io(addr);
+}
+
+inline uint16_t DMA::read_dword(uint16_t addr)
+{
+    uint8_t *page = read_pages[addr >> 8];
+    if (page && (addr & 0xFF) != 0xFF) {
+        open_bus = page[(addr & 0xFF) + 1];
+        return page[addr & 0xFF] | (open_bus << 8);
+    }
+    uint8_t low = read(addr);
+    return low | (read(addr + 1) << 8);
+}
+
+inline void DMA::write(uint16_t addr, uint8_t data)
+{
+    uint8_t *page = write_pages[addr >> 8];
+    open_bus = data;
+    if (page)
+        page[addr & 0xFF] = data;
+    else
+        write_io(addr, data);
+}
+
 #endif // DMA_H
@@ -0,0 +1,163 @@
+#include "frame_ring.h"
+
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ppu.h"
+
+using namespace std;
+
+static_assert(sizeof(FrameRing::Header) == 128, "frame ring header layout");
+static_assert(sizeof(FrameRing::Slot) == 64, "frame ring slot layout");
+
+FrameRing::Slot *FrameRing::slot(uint64_t index)
+{
+    return (Slot *) (base + sizeof(Header) + (index % header->slot_count) * header->slot_size);
+}
+
+uint8_t *FrameRing::pixels(Slot *slot)
+{
+    return (uint8_t *) (slot + 1);
+}
+
+FrameRing::FrameRing(const string &name) : name(name), base(nullptr), size(0), header(nullptr) {}
+
+FrameRing::~FrameRing()
+{
+    if (base)
+        munmap(base, size);
+}
+
+uint32_t FrameRing::slot_count()
+{
+    return header->slot_count;
+}
+
+uint32_t FrameRing::width()
+{
+    return header->width;
+}
+
+uint32_t FrameRing::height()
+{
+    return header->height;
+}
+
+SharedFrameSink::SharedFrameSink(const string &name, uint32_t slot_count) : FrameRing(name), next(0)
+{
+    if (!slot_count)
+        throw runtime_error("frame ring needs at least one slot");
+    uint32_t slot_size = (sizeof(Slot) + PPU::WIDTH * PPU::HEIGHT + 63) & ~63u;
+    size = sizeof(Header) + (size_t) slot_count * slot_size;
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        throw runtime_error("unable to create frame ring");
+    if (ftruncate(fd, size) < 0) {
+        close(fd);
+        shm_unlink(name.c_str());
+        throw runtime_error("unable to size frame ring");
+    }
+    void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        throw runtime_error("unable to map frame ring");
+    }
+    base = (uint8_t *) ptr;
+    header = new (base) Header();
+    header->version = VERSION;
+    header->slot_count = slot_count;
+    header->slot_size = slot_size;
+    header->width = PPU::WIDTH;
+    header->height = PPU::HEIGHT;
+    header->published.store(0, memory_order_relaxed);
+    for (uint32_t i = 0; i < slot_count; ++i)
+        new (slot(i)) Slot();
+    atomic_thread_fence(memory_order_release);
+    header->magic = MAGIC;
+}
+
+SharedFrameSink::~SharedFrameSink()
+{
+    shm_unlink(name.c_str());
+}
+
+void SharedFrameSink::write(const VideoFrame &frame)
+{
+    Slot *target = slot(next);
+    target->sequence.store(next * 2 + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    target->frame = frame.frame;
+    target->cycles = frame.cycles;
+    target->buttons[0] = frame.buttons[0];
+    target->buttons[1] = frame.buttons[1];
+    memcpy(pixels(target), frame.pixels, header->width * header->height);
+    target->sequence.store(next * 2 + 2, memory_order_release);
+    header->published.store(++next, memory_order_release);
+}
+
+SharedFrameReader::SharedFrameReader(const string &name) : FrameRing(name), next(0), dropped(0)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        throw runtime_error("unable to open frame ring");
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (size_t) info.st_size < sizeof(Header)) {
+        close(fd);
+        throw runtime_error("frame ring is not ready");
+    }
+    size = info.st_size;
+    void *ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED)
+        throw runtime_error("unable to map frame ring");
+    base = (uint8_t *) ptr;
+    header = (Header *) base;
+    atomic_thread_fence(memory_order_acquire);
+    if (header->magic != MAGIC || header->version != VERSION || !header->slot_count ||
+        size < sizeof(Header) + (size_t) header->slot_count * header->slot_size)
+        throw runtime_error("frame ring is not ready");
+    uint64_t published = header->published.load(memory_order_acquire);
+    next = published > header->slot_count ? published - header->slot_count : 0;
+}
+
+bool SharedFrameReader::read(VideoFrame &frame, uint8_t *pixels)
+{
+    for (;;) {
+        uint64_t published = header->published.load(memory_order_acquire);
+        if (next >= published)
+            return false;
+        if (published - next > header->slot_count) {
+            dropped += published - header->slot_count - next;
+            next = published - header->slot_count;
+        }
+        Slot *source = slot(next);
+        uint64_t sequence = next * 2 + 2;
+        if (source->sequence.load(memory_order_acquire) == sequence) {
+            frame.frame = source->frame;
+            frame.cycles = source->cycles;
+            frame.buttons[0] = source->buttons[0];
+            frame.buttons[1] = source->buttons[1];
+            memcpy(pixels, FrameRing::pixels(source), header->width * header->height);
+            atomic_thread_fence(memory_order_acquire);
+            if (source->sequence.load(memory_order_relaxed) == sequence) {
+                frame.pixels = pixels;
+                ++next;
+                return true;
+            }
+        }
+        ++dropped;
+        ++next;
+    }
+}
+
+uint64_t SharedFrameReader::get_dropped()
+{
+    return dropped;
+}
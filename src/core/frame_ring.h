@@ -0,0 +1,69 @@
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "video.h"
+
+class FrameRing {
+public:
+    static const uint32_t MAGIC = 0x4D52464C;
+    static const uint32_t VERSION = 1;
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t slot_count;
+        uint32_t slot_size;
+        uint32_t width;
+        uint32_t height;
+        uint8_t pad0[40];
+        std::atomic<uint64_t> published;
+        uint8_t pad1[56];
+    };
+    struct Slot {
+        std::atomic<uint64_t> sequence;
+        uint64_t frame;
+        uint64_t cycles;
+        uint8_t buttons[2];
+        uint8_t pad[38];
+    };
+protected:
+    std::string name;
+    uint8_t *base;
+    size_t size;
+    Header *header;
+    Slot *slot(uint64_t index);
+    uint8_t *pixels(Slot *slot);
+    FrameRing(const std::string &name);
+    ~FrameRing();
+public:
+    FrameRing(const FrameRing &) = delete;
+    FrameRing &operator=(const FrameRing &) = delete;
+    uint32_t slot_count();
+    uint32_t width();
+    uint32_t height();
+};
+
+class SharedFrameSink : public FrameRing, public FrameSink {
+private:
+    uint64_t next;
+public:
+    SharedFrameSink(const std::string &name, uint32_t slot_count = 8);
+    ~SharedFrameSink();
+    void write(const VideoFrame &frame) override;
+};
+
+class SharedFrameReader : public FrameRing {
+private:
+    uint64_t next;
+    uint64_t dropped;
+public:
+    SharedFrameReader(const std::string &name);
+    bool read(VideoFrame &frame, uint8_t *pixels);
+    uint64_t get_dropped();
+};
+
+#endif // FRAME_RING_H
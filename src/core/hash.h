@@ -0,0 +1,19 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstddef>
+#include <cstdint>
+
+static const uint64_t FNV1A_OFFSET = 0xCBF29CE484222325ULL;
+
+inline uint64_t fnv1a(const void *data, size_t length, uint64_t hash = FNV1A_OFFSET)
+{
+    const uint8_t *bytes = (const uint8_t *) data;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+#endif // HASH_H
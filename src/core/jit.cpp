@@ -0,0 +1,587 @@
+#include "jit.h"
+#include "cpu_ops.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/mman.h>
+
+using namespace std;
+
+static const size_t ARENA_SIZE = 4 << 20;
+static const size_t BLOCK_RESERVE = 64 << 10;
+
+static const int REG_PINNED[4] = { 12, 13, 14, 5 };
+
+static bool ends_block(uint8_t opcode)
+{
+    switch (opcode) {
+    case 0x00: case 0x20: case 0x40: case 0x4C: case 0x60: case 0x6C:
+        return true;
+    default:
+        return op_mode_table[opcode] == MODE_rel;
+    }
+}
+
+uint8_t JIT::bus_read(DMA *dma, uint16_t addr)
+{
+    return dma->read(addr);
+}
+
+void JIT::bus_write(DMA *dma, uint16_t addr, uint8_t data)
+{
+    dma->write(addr, data);
+}
+
+void JIT::call_op(CPU *cpu, const CPU::DecodedOp *op)
+{
+    cpu->cur_op = op;
+    cpu->pc = op->next_pc;
+    cpu->page_penalty = op->page_penalty;
+    op->handler(*cpu);
+}
+
+int32_t JIT::offset_of(const void *field)
+{
+    return (const uint8_t *) field - (const uint8_t *) &cpu;
+}
+
+void JIT::emit(uint8_t data)
+{
+    arena[arena_used++] = data;
+}
+
+void JIT::emit16(uint16_t data)
+{
+    memcpy(arena + arena_used, &data, 2);
+    arena_used += 2;
+}
+
+void JIT::emit32(uint32_t data)
+{
+    memcpy(arena + arena_used, &data, 4);
+    arena_used += 4;
+}
+
+void JIT::emit64(uint64_t data)
+{
+    memcpy(arena + arena_used, &data, 8);
+    arena_used += 8;
+}
+
+void JIT::emit_rex(bool wide, int reg, int index, int base, bool force)
+{
+    uint8_t rex = 0x40 | (wide << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+    if (rex != 0x40 || force)
+        emit(rex);
+}
+
+void JIT::emit_rr(bool wide, initializer_list<uint8_t> opcode, int reg, int rm, bool byte)
+{
+    emit_rex(wide, reg, 0, rm, byte && (reg >= 4 || rm >= 4));
+    for (uint8_t data : opcode)
+        emit(data);
+    emit(0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+void JIT::emit_rm(bool wide, initializer_list<uint8_t> opcode, int reg, int base, int32_t disp, bool byte)
+{
+    emit_rex(wide, reg, 0, base, byte && reg >= 4);
+    for (uint8_t data : opcode)
+        emit(data);
+    emit(0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+        emit(0x24);
+    emit32(disp);
+}
+
+void JIT::emit_sib(bool wide, initializer_list<uint8_t> opcode, int reg, int base, int index, int scale, bool byte)
+{
+    emit_rex(wide, reg, index, base, byte && reg >= 4);
+    for (uint8_t data : opcode)
+        emit(data);
+    emit(0x04 | ((reg & 7) << 3));
+    emit((scale << 6) | ((index & 7) << 3) | (base & 7));
+}
+
+void JIT::mov_ri(int reg, uint32_t imm)
+{
+    emit_rex(false, 0, 0, reg, false);
+    emit(0xB8 | (reg & 7));
+    emit32(imm);
+}
+
+void JIT::mov_ri64(int reg, uint64_t imm)
+{
+    emit_rex(true, 0, 0, reg, false);
+    emit(0xB8 | (reg & 7));
+    emit64(imm);
+}
+
+void JIT::mov_rr(int dst, int src)
+{
+    emit_rr(false, {0x89}, src, dst, false);
+}
+
+void JIT::alu_rr(uint8_t opcode, int dst, int src)
+{
+    emit_rr(false, {opcode}, src, dst, false);
+}
+
+void JIT::alu_ri(int ext, int dst, uint32_t imm)
+{
+    emit_rr(false, {0x81}, ext, dst, false);
+    emit32(imm);
+}
+
+void JIT::shift_ri(int ext, int dst, uint8_t count)
+{
+    emit_rr(false, {0xC1}, ext, dst, false);
+    emit(count);
+}
+
+void JIT::movzx_rr8(int dst, int src)
+{
+    emit_rr(false, {0x0F, 0xB6}, dst, src, true);
+}
+
+void JIT::setcc(Cond cond, int dst)
+{
+    emit_rr(false, {0x0F, (uint8_t) (0x90 | cond)}, 0, dst, true);
+}
+
+void JIT::call_abs(const void *func)
+{
+    mov_ri64(RAX, (uint64_t) func);
+    emit_rr(false, {0xFF}, 2, RAX, false);
+}
+
+size_t JIT::jcc(Cond cond)
+{
+    emit(0x0F);
+    emit(0x80 | cond);
+    emit32(0);
+    return arena_used;
+}
+
+size_t JIT::jmp()
+{
+    emit(0xE9);
+    emit32(0);
+    return arena_used;
+}
+
+void JIT::patch(size_t at)
+{
+    patch(at, arena_used);
+}
+
+void JIT::patch(size_t at, size_t target)
+{
+    int32_t rel = target - at;
+    memcpy(arena + at - 4, &rel, 4);
+}
+
+void JIT::emit_spill()
+{
+    for (int i = 0; i < 4; ++i)
+        emit_rm(false, {0x88}, REG_PINNED[i], RBX, offset_of(&cpu.reg[i]), true);
+    emit(0x66);
+    emit_rm(false, {0x89}, R15, RBX, offset_of(&cpu.flag_nz), false);
+}
+
+void JIT::emit_reload()
+{
+    for (int i = 0; i < 4; ++i)
+        emit_rm(false, {0x0F, 0xB6}, REG_PINNED[i], RBX, offset_of(&cpu.reg[i]), false);
+    emit_rm(false, {0x0F, 0xB7}, R15, RBX, offset_of(&cpu.flag_nz), false);
+}
+
+void JIT::store_mi8(const void *field, uint8_t imm)
+{
+    emit_rm(false, {0xC6}, 0, RBX, offset_of(field), false);
+    emit(imm);
+}
+
+void JIT::store_mr8(const void *field, int src)
+{
+    emit_rm(false, {0x88}, src, RBX, offset_of(field), true);
+}
+
+void JIT::emit_entry()
+{
+    static const int saved[6] = { RBX, RBP, R12, R13, R14, R15 };
+    for (int reg : saved) {
+        emit_rex(false, 0, 0, reg, false);
+        emit(0x50 | (reg & 7));
+    }
+    emit_rr(true, {0x83}, 5, RSP, false);
+    emit(0x08);
+    emit_rr(true, {0x89}, RDI, RBX, false);
+    emit_reload();
+    emit_rr(false, {0xFF}, 4, RSI, false);
+}
+
+void JIT::emit_exit()
+{
+    static const int saved[6] = { R15, R14, R13, R12, RBP, RBX };
+    emit_spill();
+    emit_rr(true, {0x83}, 0, RSP, false);
+    emit(0x08);
+    for (int reg : saved) {
+        emit_rex(false, 0, 0, reg, false);
+        emit(0x58 | (reg & 7));
+    }
+    emit(0xC3);
+}
+
+void JIT::emit_exit_at(uint16_t pc)
+{
+    emit(0x66);
+    emit_rm(false, {0xC7}, 0, RBX, offset_of(&cpu.pc), false);
+    emit16(pc);
+    patch(jmp(), exit_code);
+}
+
+void JIT::emit_nz(int reg)
+{
+    mov_rr(R15, reg);
+}
+
+void JIT::emit_addr(const CPU::DecodedOp &op, uint8_t mode)
+{
+    switch (mode) {
+    case MODE_zpgX:
+    case MODE_zpgY:
+        mov_rr(RAX, mode == MODE_zpgX ? R13 : R14);
+        alu_ri(0, RAX, op.operand);
+        alu_ri(4, RAX, 0xFF);
+        break;
+    case MODE_absX:
+    case MODE_absY:
+        mov_rr(RAX, mode == MODE_absX ? R13 : R14);
+        alu_ri(0, RAX, op.operand);
+        alu_ri(4, RAX, 0xFFFF);
+        if (op.page_penalty) {
+            mov_rr(RDX, RAX);
+            alu_ri(6, RDX, op.operand);
+            emit_rr(false, {0xF7}, 0, RDX, false);
+            emit32(0xFF00);
+            size_t same_page = jcc(CC_E);
+            emit_rm(true, {0x83}, 0, RBX, offset_of(&cpu.cycles), false);
+            emit(op.page_penalty);
+            patch(same_page);
+        }
+        break;
+    default:
+        mov_ri(RAX, op.operand);
+        break;
+    }
+}
+
+void JIT::emit_read(const CPU::DecodedOp &op, uint8_t mode)
+{
+    if (mode == MODE_imm) {
+        mov_ri(RCX, op.operand);
+        return;
+    }
+    if ((mode == MODE_zpg || mode == MODE_abs) && op.operand < 0x2000) {
+        mov_ri64(R11, (uint64_t) (dma.host_page(op.operand >> 8) + (op.operand & 0xFF)));
+        emit_rm(false, {0x0F, 0xB6}, RCX, R11, 0, false);
+        mov_ri64(R11, (uint64_t) &dma.open_bus);
+        emit_rm(false, {0x88}, RCX, R11, 0, true);
+        return;
+    }
+    emit_addr(op, mode);
+    mov_rr(RCX, RAX);
+    shift_ri(5, RCX, 8);
+    mov_ri64(R11, (uint64_t) dma.read_pages);
+    emit_sib(true, {0x8B}, RDX, R11, RCX, 3, false);
+    emit_rr(true, {0x85}, RDX, RDX, false);
+    size_t slow = jcc(CC_E);
+    movzx_rr8(RAX, RAX);
+    emit_sib(false, {0x0F, 0xB6}, RCX, RDX, RAX, 0, false);
+    mov_ri64(R11, (uint64_t) &dma.open_bus);
+    emit_rm(false, {0x88}, RCX, R11, 0, true);
+    size_t done = jmp();
+    patch(slow);
+    mov_rr(RSI, RAX);
+    mov_ri64(RDI, (uint64_t) &dma);
+    call_abs((const void *) &bus_read);
+    movzx_rr8(RCX, RAX);
+    patch(done);
+}
+
+void JIT::emit_write(const CPU::DecodedOp &op, uint8_t mode, int src)
+{
+    emit_addr(op, mode);
+    mov_rr(RCX, src);
+    mov_ri64(R11, (uint64_t) &dma.open_bus);
+    emit_rm(false, {0x88}, RCX, R11, 0, true);
+    mov_rr(RDX, RAX);
+    shift_ri(5, RDX, 8);
+    mov_ri64(R11, (uint64_t) dma.write_pages);
+    emit_sib(true, {0x8B}, RDX, R11, RDX, 3, false);
+    emit_rr(true, {0x85}, RDX, RDX, false);
+    size_t slow = jcc(CC_E);
+    movzx_rr8(RAX, RAX);
+    emit_sib(false, {0x88}, RCX, RDX, RAX, 0, true);
+    size_t done = jmp();
+    patch(slow);
+    mov_rr(RSI, RAX);
+    mov_rr(RDX, RCX);
+    mov_ri64(RDI, (uint64_t) &dma);
+    call_abs((const void *) &bus_write);
+    emit_rm(false, {0x80}, 7, RBX, offset_of(&cpu.block_dirty), false);
+    emit(0x00);
+    exits.push_back({jcc(CC_NE), op.next_pc});
+    patch(done);
+}
+
+void JIT::emit_adc()
+{
+    emit_rm(false, {0x0F, 0xB6}, RAX, RBX, offset_of(&cpu.flag_c), false);
+    alu_rr(0x01, RAX, R12);
+    alu_rr(0x01, RAX, RCX);
+    movzx_rr8(R12, RAX);
+    mov_rr(RDX, RAX);
+    alu_rr(0x31, RDX, R12);
+    mov_rr(RSI, RAX);
+    alu_rr(0x31, RSI, RCX);
+    alu_rr(0x21, RDX, RSI);
+    alu_ri(4, RDX, 0x80);
+    shift_ri(5, RDX, 7);
+    store_mr8(&cpu.flag_v, RDX);
+    shift_ri(5, RAX, 8);
+    store_mr8(&cpu.flag_c, RAX);
+    emit_nz(R12);
+}
+
+void JIT::emit_compare(int reg)
+{
+    alu_rr(0x39, reg, RCX);
+    setcc(CC_AE, RAX);
+    store_mr8(&cpu.flag_c, RAX);
+    mov_rr(RDX, reg);
+    alu_rr(0x29, RDX, RCX);
+    movzx_rr8(RDX, RDX);
+    emit_nz(RDX);
+}
+
+void JIT::emit_flag(uint8_t mask, bool on)
+{
+    emit_rm(false, {0x80}, on ? 1 : 4, RBX, offset_of(&cpu.reg[CPU::REG_P]), false);
+    emit(on ? mask : (uint8_t) ~mask);
+}
+
+void JIT::emit_branch(const CPU::DecodedOp &op, CPU::Flag flag, bool on)
+{
+    switch (flag) {
+    case CPU::FLAG_N:
+        emit_rr(false, {0xF7}, 0, R15, false);
+        emit32(0x8080);
+        break;
+    case CPU::FLAG_Z:
+        emit_rr(false, {0xF7}, 0, R15, false);
+        emit32(0x00FF);
+        on = !on;
+        break;
+    default:
+        emit_rm(false, {0x80}, 7, RBX, offset_of(flag == CPU::FLAG_C ? &cpu.flag_c : &cpu.flag_v), false);
+        emit(0x00);
+        break;
+    }
+    size_t not_taken = jcc(on ? CC_E : CC_NE);
+    emit_rm(true, {0x83}, 0, RBX, offset_of(&cpu.cycles), false);
+    emit(((op.next_pc ^ op.operand) & 0xFF00) ? 2 : 1);
+    emit_exit_at(op.operand);
+    patch(not_taken);
+    emit_exit_at(op.next_pc);
+}
+
+void JIT::emit_call(const CPU::DecodedOp &op)
+{
+    emit_spill();
+    emit_rr(true, {0x89}, RBX, RDI, false);
+    mov_ri64(RSI, (uint64_t) &op);
+    call_abs((const void *) &call_op);
+    emit_reload();
+    if (ends_block(op.opcode)) {
+        patch(jmp(), exit_code);
+        return;
+    }
+    emit_rm(false, {0x80}, 7, RBX, offset_of(&cpu.block_dirty), false);
+    emit(0x00);
+    exits.push_back({jcc(CC_NE), op.next_pc});
+}
+
+bool JIT::emit_op(const CPU::DecodedOp &op)
+{
+    uint8_t mode = op_mode_table[op.opcode];
+    switch (op.opcode) {
+    case 0xA9: case 0xA5: case 0xB5: case 0xAD: case 0xBD: case 0xB9:
+    case 0xA2: case 0xA6: case 0xB6: case 0xAE: case 0xBE:
+    case 0xA0: case 0xA4: case 0xB4: case 0xAC: case 0xBC: {
+        int reg = (op.opcode & 0x03) == 0x01 ? R12 : (op.opcode & 0x03) == 0x02 ? R13 : R14;
+        emit_read(op, mode);
+        mov_rr(reg, RCX);
+        emit_nz(reg);
+        return true;
+    }
+    case 0x85: case 0x95: case 0x8D: case 0x9D: case 0x99:
+        emit_write(op, mode, R12);
+        return true;
+    case 0x86: case 0x96: case 0x8E:
+        emit_write(op, mode, R13);
+        return true;
+    case 0x84: case 0x94: case 0x8C:
+        emit_write(op, mode, R14);
+        return true;
+    case 0x29: case 0x25: case 0x35: case 0x2D: case 0x3D: case 0x39:
+    case 0x09: case 0x05: case 0x15: case 0x0D: case 0x1D: case 0x19:
+    case 0x49: case 0x45: case 0x55: case 0x4D: case 0x5D: case 0x59:
+        emit_read(op, mode);
+        alu_rr(op.opcode < 0x20 ? 0x09 : op.opcode < 0x40 ? 0x21 : 0x31, R12, RCX);
+        emit_nz(R12);
+        return true;
+    case 0x69: case 0x65: case 0x75: case 0x6D: case 0x7D: case 0x79:
+    case 0xE9: case 0xE5: case 0xF5: case 0xED: case 0xFD: case 0xF9:
+        emit_read(op, mode);
+        if (op.opcode >= 0xE0)
+            alu_ri(6, RCX, 0xFF);
+        emit_adc();
+        return true;
+    case 0xC9: case 0xC5: case 0xD5: case 0xCD: case 0xDD: case 0xD9:
+        emit_read(op, mode);
+        emit_compare(R12);
+        return true;
+    case 0xE0: case 0xE4: case 0xEC:
+        emit_read(op, mode);
+        emit_compare(R13);
+        return true;
+    case 0xC0: case 0xC4: case 0xCC:
+        emit_read(op, mode);
+        emit_compare(R14);
+        return true;
+    case 0xAA: mov_rr(R13, R12); emit_nz(R13); return true;
+    case 0xA8: mov_rr(R14, R12); emit_nz(R14); return true;
+    case 0x8A: mov_rr(R12, R13); emit_nz(R12); return true;
+    case 0x98: mov_rr(R12, R14); emit_nz(R12); return true;
+    case 0xBA: mov_rr(R13, RBP); emit_nz(R13); return true;
+    case 0x9A: mov_rr(RBP, R13); return true;
+    case 0xE8: case 0xC8: case 0xCA: case 0x88: {
+        int reg = (op.opcode == 0xE8 || op.opcode == 0xCA) ? R13 : R14;
+        alu_ri((op.opcode == 0xE8 || op.opcode == 0xC8) ? 0 : 5, reg, 1);
+        alu_ri(4, reg, 0xFF);
+        emit_nz(reg);
+        return true;
+    }
+    case 0x18: store_mi8(&cpu.flag_c, 0); return true;
+    case 0x38: store_mi8(&cpu.flag_c, 1); return true;
+    case 0x78: emit_flag(0x04, true); return true;
+    case 0xD8: emit_flag(0x08, false); return true;
+    case 0xF8: emit_flag(0x08, true); return true;
+    case 0xB8: store_mi8(&cpu.flag_v, 0); return true;
+    case 0xEA: return true;
+    case 0x10: emit_branch(op, CPU::FLAG_N, false); return true;
+    case 0x30: emit_branch(op, CPU::FLAG_N, true); return true;
+    case 0x50: emit_branch(op, CPU::FLAG_V, false); return true;
+    case 0x70: emit_branch(op, CPU::FLAG_V, true); return true;
+    case 0x90: emit_branch(op, CPU::FLAG_C, false); return true;
+    case 0xB0: emit_branch(op, CPU::FLAG_C, true); return true;
+    case 0xD0: emit_branch(op, CPU::FLAG_Z, false); return true;
+    case 0xF0: emit_branch(op, CPU::FLAG_Z, true); return true;
+    case 0x4C: emit_exit_at(op.operand); return true;
+    default:
+        return false;
+    }
+}
+
+void JIT::flush()
+{
+    for (unsigned page = 0; page < 0x100; ++page)
+        entries[page].clear();
+    ops.clear();
+    arena_used = code_start;
+}
+
+const uint8_t *JIT::compile(uint16_t addr)
+{
+    if (ARENA_SIZE - arena_used < BLOCK_RESERVE)
+        flush();
+    CPU::Block block;
+    cpu.decode_block(block, addr);
+    while (!block.empty() && block.back().handler == &CPU::op_invalid)
+        block.pop_back();
+    if (block.empty())
+        return nullptr;
+    const uint8_t *code = arena + arena_used;
+    exits.clear();
+    uint16_t pc = addr;
+    for (size_t i = 0; i < block.size(); ++i) {
+        if (i > 0) {
+            emit_rm(true, {0x8B}, RAX, RBX, offset_of(&cpu.cycles), false);
+            emit_rm(true, {0x3B}, RAX, RBX, offset_of(&cpu.cycle_limit), false);
+            exits.push_back({jcc(CC_AE), pc});
+        }
+        emit_rm(true, {0x83}, 0, RBX, offset_of(&cpu.cycles), false);
+        emit(block[i].cycles);
+        ops.push_back(block[i]);
+        if (!emit_op(ops.back()))
+            emit_call(ops.back());
+        pc = block[i].next_pc;
+    }
+    if (!ends_block(block.back().opcode))
+        emit_exit_at(pc);
+    for (const Exit &exit : exits) {
+        patch(exit.patch);
+        emit_exit_at(exit.pc);
+    }
+    return code;
+}
+
+JIT::JIT(CPU &cpu, DMA &dma) : cpu(cpu), dma(dma), arena_used(0)
+{
+    void *ptr = mmap(nullptr, ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        throw runtime_error("unable to allocate jit arena");
+    arena = (uint8_t *) ptr;
+    entry = (Entry) arena;
+    emit_entry();
+    exit_code = arena_used;
+    emit_exit();
+    code_start = arena_used;
+}
+
+JIT::~JIT()
+{
+    munmap(arena, ARENA_SIZE);
+}
+
+void JIT::run()
+{
+    while (cpu.cycles < cpu.cycle_limit) {
+        uint16_t pc = cpu.pc;
+        vector<const uint8_t *> *page = &entries[pc >> 8];
+        const uint8_t *code = page->empty() ? nullptr : (*page)[pc & 0xFF];
+        if (!code) {
+            code = compile(pc);
+            if (!code) {
+                cpu.dispatch_one();
+                continue;
+            }
+            if (page->empty())
+                page->resize(0x100, nullptr);
+            (*page)[pc & 0xFF] = code;
+        }
+        cpu.block_dirty = false;
+        entry(&cpu, code);
+    }
+}
+
+void JIT::invalidate_page(uint8_t page)
+{
+    entries[page].clear();
+    entries[(uint8_t) (page - 1)].clear();
+}
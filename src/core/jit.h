@@ -0,0 +1,100 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <cstddef>
+#include <deque>
+#include <initializer_list>
+#include <vector>
+
+#include "cpu.h"
+
+class JIT {
+private:
+    enum HostReg {
+        RAX = 0,
+        RCX = 1,
+        RDX = 2,
+        RBX = 3,
+        RSP = 4,
+        RBP = 5,
+        RSI = 6,
+        RDI = 7,
+        R11 = 11,
+        R12 = 12,
+        R13 = 13,
+        R14 = 14,
+        R15 = 15
+    };
+    enum Cond {
+        CC_B = 0x2,
+        CC_AE = 0x3,
+        CC_E = 0x4,
+        CC_NE = 0x5
+    };
+    typedef void (*Entry)(CPU *cpu, const uint8_t *code);
+    struct Exit {
+        size_t patch;
+        uint16_t pc;
+    };
+    CPU &cpu;
+    DMA &dma;
+    uint8_t *arena;
+    size_t arena_used;
+    size_t code_start;
+    Entry entry;
+    size_t exit_code;
+    std::vector<const uint8_t *> entries[0x100];
+    std::deque<CPU::DecodedOp> ops;
+    std::vector<Exit> exits;
+    static uint8_t bus_read(DMA *dma, uint16_t addr);
+    static void bus_write(DMA *dma, uint16_t addr, uint8_t data);
+    static void call_op(CPU *cpu, const CPU::DecodedOp *op);
+    int32_t offset_of(const void *field);
+    void emit(uint8_t data);
+    void emit16(uint16_t data);
+    void emit32(uint32_t data);
+    void emit64(uint64_t data);
+    void emit_rex(bool wide, int reg, int index, int base, bool force);
+    void emit_rr(bool wide, std::initializer_list<uint8_t> opcode, int reg, int rm, bool byte);
+    void emit_rm(bool wide, std::initializer_list<uint8_t> opcode, int reg, int base, int32_t disp, bool byte);
+    void emit_sib(bool wide, std::initializer_list<uint8_t> opcode, int reg, int base, int index, int scale, bool byte);
+    void mov_ri(int reg, uint32_t imm);
+    void mov_ri64(int reg, uint64_t imm);
+    void mov_rr(int dst, int src);
+    void alu_rr(uint8_t opcode, int dst, int src);
+    void alu_ri(int ext, int dst, uint32_t imm);
+    void shift_ri(int ext, int dst, uint8_t count);
+    void movzx_rr8(int dst, int src);
+    void setcc(Cond cond, int dst);
+    void call_abs(const void *func);
+    size_t jcc(Cond cond);
+    size_t jmp();
+    void patch(size_t at);
+    void patch(size_t at, size_t target);
+    void emit_entry();
+    void emit_exit();
+    void emit_spill();
+    void emit_reload();
+    void store_mi8(const void *field, uint8_t imm);
+    void store_mr8(const void *field, int src);
+    void emit_exit_at(uint16_t pc);
+    void emit_nz(int reg);
+    void emit_addr(const CPU::DecodedOp &op, uint8_t mode);
+    void emit_read(const CPU::DecodedOp &op, uint8_t mode);
+    void emit_write(const CPU::DecodedOp &op, uint8_t mode, int src);
+    void emit_adc();
+    void emit_compare(int reg);
+    void emit_flag(uint8_t mask, bool on);
+    void emit_branch(const CPU::DecodedOp &op, CPU::Flag flag, bool on);
+    void emit_call(const CPU::DecodedOp &op);
+    bool emit_op(const CPU::DecodedOp &op);
+    void flush();
+    const uint8_t *compile(uint16_t addr);
+public:
+    JIT(CPU &cpu, DMA &dma);
+    ~JIT();
+    void run();
+    void invalidate_page(uint8_t page);
+};
+
+#endif // JIT_H
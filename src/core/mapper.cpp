@@ -0,0 +1,309 @@
+#include "mapper.h"
+#include "dma.h"
+
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+class NROM : public Mapper {
+protected:
+    void update() override
+    {
+        map_prg(0x8000, 0x8000, 0);
+        map_chr(0x0000, 0x2000, 0);
+    }
+public:
+    using Mapper::Mapper;
+};
+
+class UxROM : public Mapper {
+private:
+    enum { REG_PRG };
+protected:
+    void update() override
+    {
+        map_prg(0x8000, 0x4000, registers[REG_PRG]);
+        map_prg(0xC000, 0x4000, -1);
+        map_chr(0x0000, 0x2000, 0);
+    }
+public:
+    using Mapper::Mapper;
+    void write(uint16_t, uint8_t data) override
+    {
+        registers[REG_PRG] = data;
+        update();
+    }
+};
+
+class CNROM : public Mapper {
+private:
+    enum { REG_CHR };
+protected:
+    void update() override
+    {
+        map_prg(0x8000, 0x8000, 0);
+        map_chr(0x0000, 0x2000, registers[REG_CHR]);
+    }
+public:
+    using Mapper::Mapper;
+    void write(uint16_t, uint8_t data) override
+    {
+        registers[REG_CHR] = data;
+        update();
+    }
+};
+
+class MMC1 : public Mapper {
+private:
+    enum { REG_SHIFT, REG_COUNT, REG_CONTROL, REG_CHR0, REG_CHR1, REG_PRG };
+protected:
+    void update() override
+    {
+        static const Mirroring mirrorings[4] = {
+            MIRROR_SINGLE_LOW, MIRROR_SINGLE_HIGH, MIRROR_VERTICAL, MIRROR_HORIZONTAL
+        };
+        uint8_t control = registers[REG_CONTROL];
+        uint8_t prg = registers[REG_PRG] & 0x0F;
+        mirroring = mirrorings[control & 0x03];
+        switch ((control >> 2) & 0x03) {
+        case 0:
+        case 1:
+            map_prg(0x8000, 0x8000, prg >> 1);
+            break;
+        case 2:
+            map_prg(0x8000, 0x4000, 0);
+            map_prg(0xC000, 0x4000, prg);
+            break;
+        default:
+            map_prg(0x8000, 0x4000, prg);
+            map_prg(0xC000, 0x4000, -1);
+            break;
+        }
+        if (control & 0x10) {
+            map_chr(0x0000, 0x1000, registers[REG_CHR0]);
+            map_chr(0x1000, 0x1000, registers[REG_CHR1]);
+        } else {
+            map_chr(0x0000, 0x2000, registers[REG_CHR0] >> 1);
+        }
+    }
+public:
+    MMC1(DMA &dma, const shared_ptr<const ROMImage> &image) : Mapper(dma, image)
+    {
+        registers[REG_CONTROL] = 0x0C;
+    }
+    void write(uint16_t addr, uint8_t data) override
+    {
+        if (data & 0x80) {
+            registers[REG_SHIFT] = 0;
+            registers[REG_COUNT] = 0;
+            registers[REG_CONTROL] |= 0x0C;
+            update();
+            return;
+        }
+        registers[REG_SHIFT] |= (data & 0x01) << registers[REG_COUNT];
+        if (++registers[REG_COUNT] < 5)
+            return;
+        registers[REG_CONTROL + ((addr >> 13) & 0x03)] = registers[REG_SHIFT];
+        registers[REG_SHIFT] = 0;
+        registers[REG_COUNT] = 0;
+        update();
+    }
+};
+
+class MMC3 : public Mapper {
+private:
+    enum {
+        REG_BANK_SELECT, REG_R0, REG_R7 = REG_R0 + 7, REG_MIRRORING, REG_PRG_RAM,
+        REG_IRQ_LATCH, REG_IRQ_COUNTER, REG_IRQ_RELOAD, REG_IRQ_ENABLED, REG_IRQ_FLAG
+    };
+protected:
+    void update() override
+    {
+        uint8_t select = registers[REG_BANK_SELECT];
+        const uint8_t *r = &registers[REG_R0];
+        mirroring = registers[REG_MIRRORING] & 0x01 ? MIRROR_HORIZONTAL : MIRROR_VERTICAL;
+        map_prg(select & 0x40 ? 0xC000 : 0x8000, 0x2000, r[6]);
+        map_prg(0xA000, 0x2000, r[7]);
+        map_prg(select & 0x40 ? 0x8000 : 0xC000, 0x2000, -2);
+        map_prg(0xE000, 0x2000, -1);
+        uint16_t invert = select & 0x80 ? 0x1000 : 0x0000;
+        map_chr(0x0000 ^ invert, 0x0800, r[0] >> 1);
+        map_chr(0x0800 ^ invert, 0x0800, r[1] >> 1);
+        for (unsigned i = 0; i < 4; ++i)
+            map_chr((0x1000 + i * 0x0400) ^ invert, 0x0400, r[2 + i]);
+    }
+public:
+    MMC3(DMA &dma, const shared_ptr<const ROMImage> &image) : Mapper(dma, image)
+    {
+        registers[REG_MIRRORING] = image->vertical_mirroring ? 0x00 : 0x01;
+    }
+    void write(uint16_t addr, uint8_t data) override
+    {
+        bool odd = addr & 0x01;
+        switch (addr & 0xE000) {
+        case 0x8000:
+            if (odd)
+                registers[REG_R0 + (registers[REG_BANK_SELECT] & 0x07)] = data;
+            else
+                registers[REG_BANK_SELECT] = data;
+            update();
+            break;
+        case 0xA000:
+            registers[odd ? REG_PRG_RAM : REG_MIRRORING] = data;
+            update();
+            break;
+        case 0xC000:
+            if (odd) {
+                registers[REG_IRQ_COUNTER] = 0;
+                registers[REG_IRQ_RELOAD] = 1;
+            } else {
+                registers[REG_IRQ_LATCH] = data;
+            }
+            break;
+        default:
+            registers[REG_IRQ_ENABLED] = odd;
+            if (!odd)
+                registers[REG_IRQ_FLAG] = 0;
+            break;
+        }
+    }
+    void clock_scanline() override
+    {
+        if (!registers[REG_IRQ_COUNTER] || registers[REG_IRQ_RELOAD]) {
+            registers[REG_IRQ_COUNTER] = registers[REG_IRQ_LATCH];
+            registers[REG_IRQ_RELOAD] = 0;
+        } else {
+            --registers[REG_IRQ_COUNTER];
+        }
+        if (!registers[REG_IRQ_COUNTER] && registers[REG_IRQ_ENABLED])
+            registers[REG_IRQ_FLAG] = 1;
+    }
+    bool irq_pending() override
+    {
+        return registers[REG_IRQ_FLAG];
+    }
+    unsigned irq_scanlines() override
+    {
+        if (!registers[REG_IRQ_ENABLED])
+            return 0;
+        if (!registers[REG_IRQ_COUNTER] || registers[REG_IRQ_RELOAD])
+            return registers[REG_IRQ_LATCH] + 1;
+        return registers[REG_IRQ_COUNTER];
+    }
+};
+
+void Mapper::map_prg(uint16_t addr, size_t size, int bank)
+{
+    int count = image->prg_rom_size / size;
+    if (!count)
+        count = 1;
+    bank = ((bank % count) + count) % count;
+    size_t offset = (size_t) bank * size;
+    for (size_t i = 0; i < size; i += 0x100)
+        dma.map_rom(((addr + i) >> 8) & 0xFF, image->prg_rom + (offset + i) % image->prg_rom_size);
+}
+
+void Mapper::map_chr(uint16_t addr, size_t size, int bank)
+{
+    uint8_t *chr = chr_ram.empty() ? const_cast<uint8_t *>(image->chr_rom) : chr_ram.data();
+    size_t chr_size = chr_ram.empty() ? image->chr_rom_size : chr_ram.size();
+    int count = chr_size / size;
+    if (!count)
+        count = 1;
+    bank = ((bank % count) + count) % count;
+    size_t offset = (size_t) bank * size;
+    for (size_t i = 0; i < size; i += 0x400)
+        chr_pages[((addr + i) >> 10) & 0x07] = chr + (offset + i) % chr_size;
+}
+
+unique_ptr<Mapper> Mapper::create(DMA &dma, const shared_ptr<const ROMImage> &image)
+{
+    unique_ptr<Mapper> mapper;
+    switch (image->mapper) {
+    case 0:
+        mapper.reset(new NROM(dma, image));
+        break;
+    case 1:
+        mapper.reset(new MMC1(dma, image));
+        break;
+    case 2:
+        mapper.reset(new UxROM(dma, image));
+        break;
+    case 3:
+        mapper.reset(new CNROM(dma, image));
+        break;
+    case 4:
+        mapper.reset(new MMC3(dma, image));
+        break;
+    default:
+        throw runtime_error("unsupported mapper: " + to_string(image->mapper));
+    }
+    mapper->update();
+    return mapper;
+}
+
+Mapper::Mapper(DMA &dma, const shared_ptr<const ROMImage> &image) :
+    dma(dma), image(image), chr_ram(image->chr_rom_size ? 0 : 0x2000),
+    mirroring(image->vertical_mirroring ? MIRROR_VERTICAL : MIRROR_HORIZONTAL)
+{
+    memset(chr_pages, 0, sizeof(chr_pages));
+    memset(registers, 0, sizeof(registers));
+}
+
+Mapper::~Mapper() {}
+
+void Mapper::write(uint16_t, uint8_t) {}
+
+void Mapper::clock_scanline() {}
+
+bool Mapper::irq_pending()
+{
+    return false;
+}
+
+unsigned Mapper::irq_scanlines()
+{
+    return 0;
+}
+
+uint8_t Mapper::chr_read(uint16_t addr)
+{
+    return chr_pages[(addr >> 10) & 0x07][addr & 0x3FF];
+}
+
+void Mapper::chr_write(uint16_t addr, uint8_t data)
+{
+    if (!chr_ram.empty())
+        chr_pages[(addr >> 10) & 0x07][addr & 0x3FF] = data;
+}
+
+const uint8_t *Mapper::chr_page(unsigned index)
+{
+    return chr_pages[index & 0x07];
+}
+
+Mapper::Mirroring Mapper::get_mirroring()
+{
+    return mirroring;
+}
+
+size_t Mapper::state_size()
+{
+    return sizeof(registers) + chr_ram.size();
+}
+
+void Mapper::save_state(uint8_t *buffer)
+{
+    memcpy(buffer, registers, sizeof(registers));
+    if (!chr_ram.empty())
+        memcpy(buffer + sizeof(registers), chr_ram.data(), chr_ram.size());
+}
+
+void Mapper::load_state(const uint8_t *buffer)
+{
+    memcpy(registers, buffer, sizeof(registers));
+    if (!chr_ram.empty())
+        memcpy(chr_ram.data(), buffer + sizeof(registers), chr_ram.size());
+    update();
+}
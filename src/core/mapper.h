@@ -0,0 +1,51 @@
+#ifndef MAPPER_H
+#define MAPPER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "rom.h"
+
+class DMA;
+
+class Mapper {
+public:
+    enum Mirroring {
+        MIRROR_HORIZONTAL,
+        MIRROR_VERTICAL,
+        MIRROR_SINGLE_LOW,
+        MIRROR_SINGLE_HIGH
+    };
+protected:
+    static const unsigned REGISTER_COUNT = 16;
+    DMA &dma;
+    std::shared_ptr<const ROMImage> image;
+    std::vector<uint8_t> chr_ram;
+    uint8_t *chr_pages[8];
+    uint8_t registers[REGISTER_COUNT];
+    Mirroring mirroring;
+    void map_prg(uint16_t addr, size_t size, int bank);
+    void map_chr(uint16_t addr, size_t size, int bank);
+    virtual void update() = 0;
+public:
+    static std::unique_ptr<Mapper> create(DMA &dma, const std::shared_ptr<const ROMImage> &image);
+    Mapper(DMA &dma, const std::shared_ptr<const ROMImage> &image);
+    Mapper(const Mapper &) = delete;
+    Mapper &operator=(const Mapper &) = delete;
+    virtual ~Mapper();
+    virtual void write(uint16_t addr, uint8_t data);
+    virtual void clock_scanline();
+    virtual bool irq_pending();
+    virtual unsigned irq_scanlines();
+    uint8_t chr_read(uint16_t addr);
+    void chr_write(uint16_t addr, uint8_t data);
+    const uint8_t *chr_page(unsigned index);
+    Mirroring get_mirroring();
+    size_t state_size();
+    void save_state(uint8_t *buffer);
+    void load_state(const uint8_t *buffer);
+};
+
+#endif // MAPPER_H
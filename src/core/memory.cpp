@@ -1,5 +1,6 @@
 #include "memory.h"
 
+#include <algorithm>
 #include <stdexcept>
 
 using namespace std;
@@ -8,11 +9,19 @@ uint16_t Memory::resolve_addr(uint16_t addr)
 {
     if (!addr_in_range(addr))
         throw runtime_error("address not in range: " + to_string(addr));
-    return (addr - start_addr) % data.size();
+    return (addr - start_addr) & mask;
 }
 
 Memory::Memory(uint16_t start_addr, uint16_t end_addr, uint16_t length) :
-    start_addr(start_addr), end_addr(end_addr), data(length, 0) {}
+    start_addr(start_addr), end_addr(end_addr), data(length, 0)
+{
+    if ((length & (length - 1)) == 0)
+        mask = length - 1;
+    else if (end_addr - start_addr + 1 <= length)
+        mask = 0xFFFF;
+    else
+        throw runtime_error("mirrored memory length must be a power of two");
+}
 
 uint16_t Memory::length()
 {
@@ -24,6 +33,11 @@ bool Memory::addr_in_range(uint16_t addr)
     return start_addr <= addr && addr <= end_addr;
 }
 
+uint8_t *Memory::host_addr(uint16_t addr)
+{
+    return &data[resolve_addr(addr)];
+}
+
 uint8_t Memory::read(uint16_t addr)
 {
     return data[resolve_addr(addr)];
@@ -33,8 +47,7 @@ uint16_t Memory::read_dword(uint16_t addr)
 {
     if (!addr_in_range(addr + 1))
         throw runtime_error("address not in range: " + to_string(addr + 1));
-    uint16_t index = resolve_addr(addr);
-    return data[index] | (data[index + 1] << 8);
+    return data[resolve_addr(addr)] | (data[resolve_addr(addr + 1)] << 8);
 }
 
 void Memory::write(uint16_t addr, uint8_t data)
@@ -45,8 +58,8 @@ void Memory::write(uint16_t addr, uint8_t data)
 void Memory::load(const vector<uint8_t> &data)
 {
     uint16_t length = this->data.size();
-    this->data = data;
-    this->data.resize(length, 0);
+    copy(data.begin(), data.begin() + min(data.size(), (size_t) length), this->data.begin());
+    fill(this->data.begin() + min(data.size(), (size_t) length), this->data.end(), 0);
 }
 
 const vector<uint8_t> &Memory::dump()
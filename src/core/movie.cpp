@@ -0,0 +1,226 @@
+#include "movie.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+static const char BINARY_MAGIC[4] = {'L', 'W', 'M', 'V'};
+static const uint8_t BINARY_VERSION = 1;
+static const uint8_t RECORD_FRAME = 'F';
+static const uint8_t RECORD_REPEAT = 'R';
+static const uint8_t RECORD_CHECKPOINT = 'H';
+
+static bool read_line(FILE *file, string &line)
+{
+    line.clear();
+    char buffer[256];
+    while (fgets(buffer, sizeof(buffer), file)) {
+        line += buffer;
+        if (line.back() == '\n')
+            break;
+    }
+    while (!line.empty() && (line.back() == '\n' || line.back() == '\r'))
+        line.pop_back();
+    return !line.empty() || !feof(file);
+}
+
+static uint8_t parse_buttons(const string &field)
+{
+    if (field.empty())
+        return 0;
+    if (field.size() != 8)
+        throw runtime_error("invalid movie input field");
+    uint8_t buttons = 0;
+    for (int i = 0; i < 8; ++i)
+        if (field[i] != '.' && field[i] != ' ')
+            buttons |= 0x80 >> i;
+    return buttons;
+}
+
+Movie::Movie(const string &filename) : binary(false), frame(0), line(0), last{0, 0}, repeat(0)
+{
+    file = fopen(filename.c_str(), "rb");
+    if (!file)
+        throw runtime_error("unable to open movie file");
+    char magic[5];
+    if (fread(magic, 1, sizeof(magic), file) == sizeof(magic) && !memcmp(magic, BINARY_MAGIC, sizeof(BINARY_MAGIC))) {
+        if ((uint8_t) magic[4] != BINARY_VERSION) {
+            fclose(file);
+            throw runtime_error("unsupported movie version");
+        }
+        binary = true;
+    } else {
+        rewind(file);
+    }
+}
+
+Movie::~Movie()
+{
+    fclose(file);
+}
+
+bool Movie::parse_input(const string &text, Event &event)
+{
+    size_t fields[4];
+    size_t count = 0;
+    for (size_t i = 1; i < text.size() && count < 4; ++i)
+        if (text[i] == '|')
+            fields[count++] = i;
+    if (count < 3)
+        throw runtime_error("invalid movie input at line " + to_string(line));
+    unsigned commands = strtoul(text.substr(1, fields[0] - 1).c_str(), nullptr, 10);
+    if ((commands & 0x01) || ((commands & 0x02) && frame))
+        throw runtime_error("unsupported reset in movie at frame " + to_string(frame + 1));
+    event.type = EVENT_FRAME;
+    event.buttons[0] = parse_buttons(text.substr(fields[0] + 1, fields[1] - fields[0] - 1));
+    event.buttons[1] = parse_buttons(text.substr(fields[1] + 1, fields[2] - fields[1] - 1));
+    return true;
+}
+
+bool Movie::next_text(Event &event)
+{
+    string text;
+    while (read_line(file, text)) {
+        ++line;
+        if (text.empty())
+            continue;
+        if (text[0] == '|')
+            return parse_input(text, event);
+        size_t space = text.find(' ');
+        string key = text.substr(0, space);
+        string value = space == string::npos ? string() : text.substr(space + 1);
+        if (key == "checkpoint") {
+            event.type = EVENT_CHECKPOINT;
+            event.hash = strtoull(value.c_str(), nullptr, 16);
+            return true;
+        }
+        if ((key == "port0" || key == "port1") && atoi(value.c_str()) > 1)
+            throw runtime_error("unsupported movie input device");
+    }
+    return false;
+}
+
+bool Movie::next_binary(Event &event)
+{
+    if (repeat) {
+        --repeat;
+        event.type = EVENT_FRAME;
+        event.buttons[0] = last[0];
+        event.buttons[1] = last[1];
+        return true;
+    }
+    int record = fgetc(file);
+    if (record == EOF)
+        return false;
+    uint8_t data[8];
+    switch (record) {
+    case RECORD_FRAME:
+        if (fread(data, 1, 2, file) != 2)
+            break;
+        last[0] = data[0];
+        last[1] = data[1];
+        event.type = EVENT_FRAME;
+        event.buttons[0] = last[0];
+        event.buttons[1] = last[1];
+        return true;
+    case RECORD_REPEAT:
+        if (fread(data, 1, 2, file) != 2 || !frame)
+            break;
+        repeat = data[0] | (data[1] << 8);
+        return next_binary(event);
+    case RECORD_CHECKPOINT:
+        if (fread(data, 1, 8, file) != 8)
+            break;
+        event.type = EVENT_CHECKPOINT;
+        event.hash = 0;
+        for (int i = 7; i >= 0; --i)
+            event.hash = (event.hash << 8) | data[i];
+        return true;
+    }
+    throw runtime_error("invalid movie record after frame " + to_string(frame));
+}
+
+bool Movie::next(Event &event)
+{
+    if (!(binary ? next_binary(event) : next_text(event)))
+        return false;
+    if (event.type == EVENT_FRAME)
+        ++frame;
+    return true;
+}
+
+uint64_t Movie::get_frame()
+{
+    return frame;
+}
+
+MovieWriter::MovieWriter(const string &filename) : last{0, 0}, repeat(0), started(false), errors(0)
+{
+    file = fopen(filename.c_str(), "wb");
+    if (!file)
+        throw runtime_error("unable to open movie file");
+    put((const uint8_t *) BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    put(&BINARY_VERSION, 1);
+}
+
+MovieWriter::~MovieWriter()
+{
+    close();
+}
+
+void MovieWriter::put(const uint8_t *data, size_t size)
+{
+    if (fwrite(data, 1, size, file) != size)
+        ++errors;
+}
+
+void MovieWriter::flush_repeat()
+{
+    if (!repeat)
+        return;
+    uint8_t record[3] = {RECORD_REPEAT, (uint8_t) repeat, (uint8_t) (repeat >> 8)};
+    put(record, sizeof(record));
+    repeat = 0;
+}
+
+void MovieWriter::frame(const uint8_t *buttons)
+{
+    if (started && buttons[0] == last[0] && buttons[1] == last[1]) {
+        if (++repeat == 0xFFFF)
+            flush_repeat();
+        return;
+    }
+    flush_repeat();
+    last[0] = buttons[0];
+    last[1] = buttons[1];
+    started = true;
+    uint8_t record[3] = {RECORD_FRAME, buttons[0], buttons[1]};
+    put(record, sizeof(record));
+}
+
+void MovieWriter::checkpoint(uint64_t hash)
+{
+    flush_repeat();
+    uint8_t record[9];
+    record[0] = RECORD_CHECKPOINT;
+    for (int i = 0; i < 8; ++i)
+        record[i + 1] = (uint8_t) (hash >> (8 * i));
+    put(record, sizeof(record));
+}
+
+void MovieWriter::close()
+{
+    if (!file)
+        return;
+    flush_repeat();
+    if (fclose(file))
+        ++errors;
+    file = nullptr;
+}
+
+uint64_t MovieWriter::get_errors()
+{
+    return errors;
+}
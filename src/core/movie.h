@@ -0,0 +1,58 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+class Movie {
+public:
+    enum EventType {
+        EVENT_FRAME,
+        EVENT_CHECKPOINT
+    };
+    struct Event {
+        EventType type;
+        uint8_t buttons[2];
+        uint64_t hash;
+    };
+private:
+    FILE *file;
+    bool binary;
+    uint64_t frame;
+    uint64_t line;
+    uint8_t last[2];
+    uint32_t repeat;
+    bool next_text(Event &event);
+    bool next_binary(Event &event);
+    bool parse_input(const std::string &text, Event &event);
+public:
+    Movie(const std::string &filename);
+    ~Movie();
+    Movie(const Movie &) = delete;
+    Movie &operator=(const Movie &) = delete;
+    bool next(Event &event);
+    uint64_t get_frame();
+};
+
+class MovieWriter {
+private:
+    FILE *file;
+    uint8_t last[2];
+    uint32_t repeat;
+    bool started;
+    uint64_t errors;
+    void put(const uint8_t *data, size_t size);
+    void flush_repeat();
+public:
+    MovieWriter(const std::string &filename);
+    ~MovieWriter();
+    MovieWriter(const MovieWriter &) = delete;
+    MovieWriter &operator=(const MovieWriter &) = delete;
+    void frame(const uint8_t *buttons);
+    void checkpoint(uint64_t hash);
+    void close();
+    uint64_t get_errors();
+};
+
+#endif // MOVIE_H
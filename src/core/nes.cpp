@@ -1,17 +1,218 @@
 #include "nes.h"
 
+#include <stdexcept>
+
+#include "hash.h"
+
 using namespace std;
 
-NES::NES() : cpu(dma) {}
+NES::NES() : cpu(dma), rewind_budget(0), frame_sink(nullptr) {}
 
 void NES::load_rom(const string &filename)
 {
     rom.load_file(filename);
-    dma.load_cartridge(rom.to_cartridge());
+    dma.load_image(rom.get_image());
+    cpu.reset();
+    reset_rewind();
+}
+
+void NES::load_image(const shared_ptr<const ROMImage> &image)
+{
+    dma.load_image(image);
     cpu.reset();
+    reset_rewind();
+}
+
+void NES::load_cartridge(const vector<uint8_t> &data)
+{
+    dma.load_cartridge(data);
+    cpu.reset();
+    reset_rewind();
+}
+
+void NES::set_buttons(unsigned port, uint8_t buttons)
+{
+    dma.set_buttons(port, buttons);
+}
+
+uint8_t NES::get_buttons(unsigned port)
+{
+    return dma.get_buttons(port);
+}
+
+uint8_t NES::peek(uint16_t addr)
+{
+    return dma.peek(addr);
+}
+
+const uint8_t *NES::host_page(uint8_t page)
+{
+    return dma.host_page(page);
+}
+
+void NES::set_audio_sink(AudioSink *sink)
+{
+    dma.get_apu().set_sink(sink);
+}
+
+void NES::set_frame_sink(FrameSink *sink)
+{
+    frame_sink = sink;
+}
+
+void NES::set_trace(const string &filename)
+{
+    cpu.set_tracer(nullptr);
+    tracer.reset(filename.empty() ? nullptr : new Tracer(filename));
+    cpu.set_tracer(tracer.get());
+}
+
+void NES::set_profiler(Profiler *profiler)
+{
+    cpu.set_profiler(profiler);
+}
+
+#ifdef USE_PERF
+void NES::set_perf(PerfCounters *perf)
+{
+    cpu.set_perf(perf);
+}
+#endif // USE_PERF
+
+void NES::set_engine(CPU::Engine engine)
+{
+    cpu.set_engine(engine);
 }
 
 void NES::start()
 {
     cpu.start();
 }
+
+size_t NES::state_size()
+{
+    return cpu.state_size() + dma.state_size();
+}
+
+void NES::save_state(uint8_t *buffer)
+{
+    cpu.save_state(buffer);
+    dma.save_state(buffer + cpu.state_size());
+}
+
+void NES::load_state(const uint8_t *buffer, size_t size)
+{
+    if (size != state_size())
+        throw runtime_error("state size does not match the loaded cartridge");
+    cpu.load_state(buffer);
+    dma.load_state(buffer + cpu.state_size());
+}
+
+uint64_t NES::run_cycles(uint64_t n)
+{
+    return cpu.run_cycles(n);
+}
+
+void NES::run_frame()
+{
+    cpu.run_until(frame_end_cycle());
+    finish_frame();
+}
+
+bool NES::step()
+{
+    return cpu.step();
+}
+
+uint64_t NES::get_cycles()
+{
+    return cpu.get_cycles();
+}
+
+uint64_t NES::frame_end_cycle()
+{
+    return dma.get_ppu().next_frame_cycle();
+}
+
+void NES::finish_frame()
+{
+    PPU &ppu = dma.get_ppu();
+    ppu.sync(PPU::SYNC_FRAME);
+    dma.get_apu().flush();
+    if (frame_sink) {
+        VideoFrame frame;
+        frame.frame = ppu.get_frame();
+        frame.cycles = cpu.get_cycles();
+        frame.buttons[0] = dma.get_buttons(0);
+        frame.buttons[1] = dma.get_buttons(1);
+        frame.pixels = ppu.get_framebuffer();
+        frame_sink->write(frame);
+    }
+    if (rewinder) {
+        save_state(snapshot.data());
+        rewinder->push(snapshot.data());
+    }
+}
+
+CPU::State NES::get_cpu_state()
+{
+    return cpu.get_state();
+}
+
+uint64_t NES::state_hash()
+{
+    CPU::State state = cpu.get_state();
+    uint8_t regs[7] = { (uint8_t) state.pc, (uint8_t) (state.pc >> 8), state.a, state.x, state.y, state.s, state.p };
+    uint64_t hash = fnv1a(regs, sizeof(regs));
+    hash = fnv1a(&state.cycles, sizeof(state.cycles), hash);
+    for (unsigned page = 0x00; page < 0x08; ++page)
+        hash = fnv1a(dma.host_page(page), 0x100, hash);
+    return fnv1a(get_framebuffer(), PPU::WIDTH * PPU::HEIGHT, hash);
+}
+
+const uint8_t *NES::get_framebuffer()
+{
+    return dma.get_ppu().get_framebuffer();
+}
+
+void NES::enable_rewind(size_t budget)
+{
+    rewind_budget = budget;
+    reset_rewind();
+}
+
+void NES::reset_rewind()
+{
+    if (!rewind_budget) {
+        rewinder.reset();
+        snapshot.clear();
+        return;
+    }
+    snapshot.resize(state_size());
+    rewinder.reset(new Rewind(snapshot.size(), rewind_budget));
+    save_state(snapshot.data());
+    rewinder->push(snapshot.data());
+}
+
+bool NES::rewind(size_t frames)
+{
+    if (!rewinder)
+        return false;
+    const uint8_t *state = rewinder->seek_back(frames);
+    if (!state)
+        return false;
+    load_state(state, snapshot.size());
+    return true;
+}
+
+PPU::Stats NES::ppu_stats()
+{
+    return dma.get_ppu().get_stats();
+}
+
+Rewind::Stats NES::rewind_stats()
+{
+    if (!rewinder)
+        throw runtime_error("rewind is not enabled");
+    return rewinder->get_stats();
+}
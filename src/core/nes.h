@@ -1,18 +1,60 @@
 #ifndef NES_H
 #define NES_H
 
+#include <memory>
+
 #include "cpu.h"
 #include "dma.h"
+#include "rewind.h"
 #include "rom.h"
+#include "tracer.h"
+#include "video.h"
 
 class NES {
 private:
     DMA dma;
     ROM rom;
     CPU cpu;
+    std::unique_ptr<Tracer> tracer;
+    std::unique_ptr<Rewind> rewinder;
+    std::vector<uint8_t> snapshot;
+    size_t rewind_budget;
+    FrameSink *frame_sink;
+    void reset_rewind();
 public:
+    static const uint64_t CYCLES_PER_FRAME = 29781;
     NES();
     void load_rom(const std::string &filename);
+    void load_image(const std::shared_ptr<const ROMImage> &image);
+    void load_cartridge(const std::vector<uint8_t> &data);
+    void set_buttons(unsigned port, uint8_t buttons);
+    uint8_t get_buttons(unsigned port);
+    uint8_t peek(uint16_t addr);
+    const uint8_t *host_page(uint8_t page);
+    void set_audio_sink(AudioSink *sink);
+    void set_frame_sink(FrameSink *sink);
+    void set_trace(const std::string &filename);
+    void set_profiler(Profiler *profiler);
+#ifdef USE_PERF
+    void set_perf(PerfCounters *perf);
+#endif // USE_PERF
+    void set_engine(CPU::Engine engine);
+    size_t state_size();
+    void save_state(uint8_t *buffer);
+    void load_state(const uint8_t *buffer, size_t size);
+    uint64_t run_cycles(uint64_t n);
+    void run_frame();
+    bool step();
+    uint64_t get_cycles();
+    uint64_t frame_end_cycle();
+    void finish_frame();
+    CPU::State get_cpu_state();
+    uint64_t state_hash();
+    const uint8_t *get_framebuffer();
+    void enable_rewind(size_t budget);
+    bool rewind(size_t frames);
+    Rewind::Stats rewind_stats();
+    PPU::Stats ppu_stats();
     void start();
 };
 
@@ -0,0 +1,191 @@
+#include "perf.h"
+#include "cpu_ops.h"
+
+#include <algorithm>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <stdexcept>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+static const uint64_t hardware_events[PerfCounters::COUNTER_COUNT] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_MISSES
+};
+
+static int open_event(uint32_t type, uint64_t config, int group)
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = group < 0;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+PerfCounters::PerfCounters() :
+    count(0), hardware(true), last_enabled(0), last_running(0), enabled(0), running(0), sampling(false), current(0),
+    pending(0), countdown(SAMPLE_INTERVAL), seed(0x9E3779B9)
+{
+    memset(rows, 0, sizeof(rows));
+    memset(last, 0, sizeof(last));
+    open_group(true);
+    if (!count) {
+        hardware = false;
+        open_group(false);
+    }
+    if (!count)
+        throw runtime_error("unable to open perf counters");
+    ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    calibrate();
+}
+
+PerfCounters::~PerfCounters()
+{
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        if (fds[i] >= 0)
+            close(fds[i]);
+}
+
+void PerfCounters::open_group(bool hardware)
+{
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        fds[i] = -1;
+    if (!hardware) {
+        fds[COUNTER_CYCLES] = open_event(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1);
+        count = fds[COUNTER_CYCLES] >= 0;
+        return;
+    }
+    fds[COUNTER_CYCLES] = open_event(PERF_TYPE_HARDWARE, hardware_events[COUNTER_CYCLES], -1);
+    if (fds[COUNTER_CYCLES] < 0)
+        return;
+    count = 1;
+    for (int i = 1; i < COUNTER_COUNT; ++i) {
+        fds[i] = open_event(PERF_TYPE_HARDWARE, hardware_events[i], fds[COUNTER_CYCLES]);
+        if (fds[i] >= 0)
+            ++count;
+    }
+}
+
+void PerfCounters::read(uint64_t *values, uint64_t &enabled, uint64_t &running)
+{
+    uint64_t buffer[3 + COUNTER_COUNT];
+    if (::read(fds[0], buffer, sizeof(uint64_t) * (3 + count)) <= 0)
+        throw runtime_error("unable to read perf counters");
+    enabled = buffer[1];
+    running = buffer[2];
+    for (int i = 0, j = 3; i < COUNTER_COUNT; ++i)
+        values[i] = fds[i] >= 0 ? buffer[j++] : 0;
+}
+
+void PerfCounters::calibrate()
+{
+    static const int ROUNDS = 256;
+    uint64_t a[COUNTER_COUNT], b[COUNTER_COUNT];
+    uint64_t time_enabled, time_running;
+    double sum[COUNTER_COUNT] = {};
+    read(a, time_enabled, time_running);
+    for (int n = 0; n < ROUNDS; ++n) {
+        read(a, time_enabled, time_running);
+        read(b, time_enabled, time_running);
+        for (int i = 0; i < COUNTER_COUNT; ++i)
+            sum[i] += b[i] - a[i];
+    }
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        overhead[i] = sum[i] / ROUNDS;
+}
+
+void PerfCounters::start(uint8_t opcode)
+{
+    sampling = true;
+    current = opcode;
+    pending = 1;
+    read(last, last_enabled, last_running);
+}
+
+void PerfCounters::stop()
+{
+    uint64_t now[COUNTER_COUNT];
+    uint64_t now_enabled, now_running;
+    read(now, now_enabled, now_running);
+    sampling = false;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    countdown = SAMPLE_INTERVAL / 2 + seed % SAMPLE_INTERVAL;
+    uint64_t delta_enabled = now_enabled - last_enabled;
+    uint64_t delta_running = now_running - last_running;
+    enabled += delta_enabled;
+    running += delta_running;
+    if (!delta_running)
+        return;
+    double scale = (double) delta_enabled / delta_running;
+    Row &row = rows[current];
+    ++row.samples;
+    row.measured += pending;
+    for (int i = 0; i < COUNTER_COUNT; ++i)
+        row.values[i] += ((double) (now[i] - last[i]) - overhead[i]) * scale;
+}
+
+void PerfCounters::flush()
+{
+    if (sampling)
+        stop();
+}
+
+void PerfCounters::print(FILE *file)
+{
+    vector<int> opcodes;
+    double cost[0x100];
+    double total = 0;
+    uint64_t samples = 0;
+    for (int opcode = 0; opcode < 0x100; ++opcode) {
+        const Row &row = rows[opcode];
+        cost[opcode] = row.measured ? max(row.values[COUNTER_CYCLES], 0.0) / row.measured * row.executed : 0.0;
+        total += cost[opcode];
+        samples += row.samples;
+        if (row.executed)
+            opcodes.push_back(opcode);
+    }
+    sort(opcodes.begin(), opcodes.end(), [&cost](int a, int b) {
+        return cost[a] > cost[b];
+    });
+    fprintf(file, "op  %-3s %-4s %12s %10s %10s %7s %10s %10s %10s\n", "ins", "mode", "executed", "sampled",
+            hardware ? "cycles/op" : "ns/op", "share", "ins/op", "brmiss/op", "cmiss/op");
+    for (int opcode : opcodes) {
+        const Row &row = rows[opcode];
+        fprintf(file, "%02X  %.3s %-4s %12llu %10llu", opcode, op_name_table[opcode], op_mode_names[op_mode_table[opcode]],
+                (unsigned long long) row.executed, (unsigned long long) row.measured);
+        if (!row.measured) {
+            fprintf(file, " %10s %7s %10s %10s %10s\n", "-", "-", "-", "-", "-");
+            continue;
+        }
+        fprintf(file, " %10.1f %6.2f%%", max(row.values[COUNTER_CYCLES], 0.0) / row.measured,
+                total ? 100.0 * cost[opcode] / total : 0.0);
+        for (int i = COUNTER_INSTRUCTIONS; i < COUNTER_COUNT; ++i) {
+            if (fds[i] >= 0)
+                fprintf(file, " %10.2f", max(row.values[i], 0.0) / row.measured);
+            else
+                fprintf(file, " %10s", "-");
+        }
+        fprintf(file, "\n");
+    }
+    fprintf(file, "%llu sampled runs of one opcode, about one per %u instructions\n", (unsigned long long) samples,
+            SAMPLE_INTERVAL);
+    if (!hardware)
+        fprintf(file, "hardware counters unavailable, using task clock\n");
+    if (running < enabled)
+        fprintf(file, "counters multiplexed: running %.1f%% of enabled time, values scaled\n",
+                enabled ? 100.0 * running / enabled : 0.0);
+}
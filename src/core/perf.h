@@ -0,0 +1,68 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <cstdint>
+#include <cstdio>
+
+class PerfCounters {
+public:
+    enum Counter {
+        COUNTER_CYCLES = 0,
+        COUNTER_INSTRUCTIONS = 1,
+        COUNTER_BRANCH_MISSES = 2,
+        COUNTER_CACHE_MISSES = 3,
+        COUNTER_COUNT = 4
+    };
+    static const unsigned SAMPLE_INTERVAL = 64;
+private:
+    struct Row {
+        uint64_t executed;
+        uint64_t samples;
+        uint64_t measured;
+        double values[COUNTER_COUNT];
+    };
+    int fds[COUNTER_COUNT];
+    int count;
+    bool hardware;
+    uint64_t last[COUNTER_COUNT];
+    uint64_t last_enabled;
+    uint64_t last_running;
+    uint64_t enabled;
+    uint64_t running;
+    double overhead[COUNTER_COUNT];
+    Row rows[0x100];
+    bool sampling;
+    uint8_t current;
+    uint32_t pending;
+    uint32_t countdown;
+    uint32_t seed;
+    void open_group(bool hardware);
+    void read(uint64_t *values, uint64_t &enabled, uint64_t &running);
+    void calibrate();
+    void start(uint8_t opcode);
+    void stop();
+public:
+    PerfCounters();
+    ~PerfCounters();
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters &operator=(const PerfCounters &) = delete;
+    void begin(uint8_t opcode);
+    void flush();
+    void print(FILE *file);
+};
+
+inline void PerfCounters::begin(uint8_t opcode)
+{
+    ++rows[opcode].executed;
+    if (sampling) {
+        if (opcode == current) {
+            ++pending;
+            return;
+        }
+        stop();
+    }
+    if (!--countdown)
+        start(opcode);
+}
+
+#endif // PERF_H
@@ -0,0 +1,589 @@
+#include "ppu.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif // __SSE2__
+
+using namespace std;
+
+const unsigned PPU::WIDTH;
+const unsigned PPU::HEIGHT;
+
+static const uint64_t BYTE_LSB = 0x0101010101010101ULL;
+
+static inline uint64_t opaque_mask(uint64_t row)
+{
+    return ((row | (row >> 1)) & BYTE_LSB) * 0xFF;
+}
+
+static inline uint16_t advance_coarse_x(uint16_t v, unsigned tiles)
+{
+    unsigned coarse_x = (v & 0x1F) + tiles;
+    return (v & ~0x041F) | (coarse_x & 0x1F) | ((v ^ ((coarse_x & 0x20) << 5)) & 0x0400);
+}
+
+bool PPU::rendering()
+{
+    return regs.mask & 0x18;
+}
+
+uint64_t PPU::dots_until(unsigned scanline, unsigned dot)
+{
+    uint64_t now = regs.scanline * DOTS_PER_LINE + regs.dot;
+    uint64_t then = scanline * DOTS_PER_LINE + dot;
+    return then > now ? then - now : then + DOTS_PER_FRAME - now;
+}
+
+uint16_t PPU::nametable_index(uint16_t addr)
+{
+    unsigned table = (addr >> 10) & 0x03;
+    switch (mapper ? mapper->get_mirroring() : Mapper::MIRROR_VERTICAL) {
+    case Mapper::MIRROR_HORIZONTAL:
+        table >>= 1;
+        break;
+    case Mapper::MIRROR_VERTICAL:
+        table &= 1;
+        break;
+    case Mapper::MIRROR_SINGLE_LOW:
+        table = 0;
+        break;
+    default:
+        table = 1;
+        break;
+    }
+    return (table << 10) | (addr & 0x3FF);
+}
+
+uint8_t PPU::palette_index(uint16_t addr)
+{
+    uint8_t index = addr & 0x1F;
+    if ((index & 0x13) == 0x10)
+        index &= 0x0F;
+    return index;
+}
+
+uint8_t PPU::mem_read(uint16_t addr)
+{
+    addr &= 0x3FFF;
+    if (addr < 0x2000)
+        return mapper ? mapper->chr_read(addr) : 0;
+    if (addr < 0x3F00)
+        return vram[nametable_index(addr)];
+    return palette[palette_index(addr)];
+}
+
+void PPU::mem_write(uint16_t addr, uint8_t data)
+{
+    addr &= 0x3FFF;
+    if (addr < 0x2000) {
+        if (!mapper)
+            return;
+        mapper->chr_write(addr, data);
+        const uint8_t *page = mapper->chr_page(addr >> 10);
+        for (unsigned slot = 0; slot < TILE_SLOTS; ++slot)
+            if (tile_sources[slot] == page)
+                tile_sources[slot] = nullptr;
+    } else if (addr < 0x3F00) {
+        vram[nametable_index(addr)] = data;
+    } else {
+        palette[palette_index(addr)] = data & 0x3F;
+    }
+}
+
+void PPU::refresh_tiles()
+{
+    if (!mapper)
+        return;
+    for (unsigned slot = 0; slot < TILE_SLOTS; ++slot) {
+        const uint8_t *source = mapper->chr_page(slot);
+        if (source == tile_sources[slot])
+            continue;
+        uint8_t *out = tiles[slot];
+        for (unsigned tile = 0; tile < 0x40; ++tile) {
+            for (unsigned row = 0; row < 8; ++row) {
+                uint8_t low = source[tile * 16 + row];
+                uint8_t high = source[tile * 16 + row + 8];
+                for (unsigned x = 0; x < 8; ++x)
+                    *out++ = ((low >> (7 - x)) & 0x01) | (((high >> (7 - x)) & 0x01) << 1);
+            }
+        }
+        tile_sources[slot] = source;
+    }
+}
+
+uint64_t PPU::tile_row(uint16_t pattern, unsigned row)
+{
+    uint64_t pixels;
+    memcpy(&pixels, &tiles[(pattern >> 10) & 0x07][((pattern & 0x3F0) << 2) | (row << 3)], 8);
+    return pixels;
+}
+
+bool PPU::mid_line()
+{
+    return regs.scanline < HEIGHT && regs.line_x > 0 && regs.line_x < WIDTH;
+}
+
+void PPU::restart_scroll()
+{
+    if (!mid_line())
+        return;
+    regs.bg_origin = regs.line_x;
+    regs.bg_phase = (regs.line_x + regs.fine_x) & 0x07;
+}
+
+void PPU::increment_y()
+{
+    if ((regs.v & 0x7000) != 0x7000) {
+        regs.v += 0x1000;
+        return;
+    }
+    regs.v &= ~0x7000;
+    unsigned coarse_y = (regs.v >> 5) & 0x1F;
+    if (coarse_y == 29) {
+        coarse_y = 0;
+        regs.v ^= 0x0800;
+    } else if (coarse_y == 31) {
+        coarse_y = 0;
+    } else {
+        ++coarse_y;
+    }
+    regs.v = (regs.v & ~0x03E0) | (coarse_y << 5);
+}
+
+void PPU::evaluate_sprites()
+{
+    memset(sprite_line, 0, sizeof(sprite_line));
+    memset(sprite_behind, 0, sizeof(sprite_behind));
+    memset(sprite_zero, 0, sizeof(sprite_zero));
+    refresh_tiles();
+    unsigned height = regs.ctrl & 0x20 ? 16 : 8;
+    unsigned found[8];
+    unsigned count = 0;
+    sprite0_line = false;
+    for (unsigned i = 0; i < 64; ++i) {
+        unsigned row = regs.scanline - oam[i * 4] - 1;
+        if (row >= height)
+            continue;
+        if (count == 8) {
+            regs.status |= 0x20;
+            break;
+        }
+        found[count++] = i;
+        sprite0_line |= i == 0;
+    }
+    while (count--) {
+        unsigned i = found[count];
+        const uint8_t *sprite = &oam[i * 4];
+        unsigned row = regs.scanline - sprite[0] - 1;
+        if (sprite[2] & 0x80)
+            row = height - 1 - row;
+        uint16_t pattern;
+        if (height == 16)
+            pattern = ((sprite[1] & 0x01) << 12) | ((sprite[1] & 0xFE) << 4) | ((row & 0x08) << 1);
+        else
+            pattern = ((regs.ctrl & 0x08) << 9) | (sprite[1] << 4);
+        uint64_t pixels = tile_row(pattern, row & 0x07);
+        if (sprite[2] & 0x40)
+            pixels = __builtin_bswap64(pixels);
+        uint64_t opaque = opaque_mask(pixels);
+        if (!opaque)
+            continue;
+        pixels |= opaque & ((0x10 | ((sprite[2] & 0x03) << 2)) * BYTE_LSB);
+        uint64_t line, behind, zero;
+        memcpy(&line, sprite_line + sprite[3], 8);
+        memcpy(&behind, sprite_behind + sprite[3], 8);
+        memcpy(&zero, sprite_zero + sprite[3], 8);
+        line = (line & ~opaque) | pixels;
+        behind = (behind & ~opaque) | (sprite[2] & 0x20 ? opaque : 0);
+        zero = (zero & ~opaque) | (i == 0 ? opaque : 0);
+        memcpy(sprite_line + sprite[3], &line, 8);
+        memcpy(sprite_behind + sprite[3], &behind, 8);
+        memcpy(sprite_zero + sprite[3], &zero, 8);
+    }
+}
+
+void PPU::render_background(unsigned x0, unsigned x1)
+{
+    uint16_t pattern = (regs.ctrl & 0x10) << 8;
+    unsigned fine_y = (regs.v >> 12) & 0x07;
+    unsigned first = (x0 - regs.bg_origin + regs.bg_phase) >> 3;
+    unsigned last = (x1 - 1 - regs.bg_origin + regs.bg_phase) >> 3;
+    for (unsigned tile = first; tile <= last; ++tile) {
+        uint16_t addr = advance_coarse_x(regs.v, tile);
+        uint8_t index = vram[nametable_index(0x2000 | (addr & 0x0FFF))];
+        uint8_t attribute = vram[nametable_index(0x23C0 | (addr & 0x0C00) | ((addr >> 4) & 0x38) | ((addr >> 2) & 0x07))];
+        uint8_t bits = ((attribute >> (((addr >> 4) & 0x04) | (addr & 0x02))) & 0x03) << 2;
+        uint64_t pixels = tile_row(pattern | (index << 4), fine_y);
+        pixels |= opaque_mask(pixels) & (bits * BYTE_LSB);
+        memcpy(bg_line + 8 + regs.bg_origin + tile * 8 - regs.bg_phase, &pixels, 8);
+    }
+}
+
+void PPU::render_span(unsigned x0, unsigned x1)
+{
+    uint8_t *out = framebuffer + regs.scanline * WIDTH;
+    uint8_t grey = regs.mask & 0x01 ? 0x30 : 0x3F;
+    if (!rendering()) {
+        uint8_t index = (regs.v & 0x3F00) == 0x3F00 ? palette_index(regs.v) : 0;
+        memset(out + x0, palette[index] & grey, x1 - x0);
+        return;
+    }
+    if (regs.mask & 0x08) {
+        refresh_tiles();
+        render_background(x0, x1);
+    } else {
+        memset(bg_line + 8 + x0, 0, x1 - x0);
+    }
+    uint8_t composed[WIDTH];
+    unsigned hit = WIDTH;
+    bool show_sprites = regs.mask & 0x10;
+    bool clip_bg = !(regs.mask & 0x02);
+    bool clip_sprites = !(regs.mask & 0x04) || !show_sprites;
+    for (unsigned x = x0 & ~15u; x < x1; x += 16) {
+#ifdef __SSE2__
+        __m128i zero = _mm_setzero_si128();
+        __m128i three = _mm_set1_epi8(0x03);
+        __m128i bg = _mm_loadu_si128((const __m128i *) (bg_line + 8 + x));
+        __m128i sprite = _mm_loadu_si128((const __m128i *) (sprite_line + x));
+        __m128i behind = _mm_loadu_si128((const __m128i *) (sprite_behind + x));
+        __m128i sprite0 = _mm_loadu_si128((const __m128i *) (sprite_zero + x));
+        if (!show_sprites)
+            sprite = zero;
+        if (x == 0) {
+            __m128i left = _mm_set_epi64x(-1, 0);
+            if (clip_bg)
+                bg = _mm_and_si128(bg, left);
+            if (clip_sprites)
+                sprite = _mm_and_si128(sprite, left);
+        }
+        __m128i bg_clear = _mm_cmpeq_epi8(_mm_and_si128(bg, three), zero);
+        __m128i sprite_clear = _mm_cmpeq_epi8(_mm_and_si128(sprite, three), zero);
+        __m128i use_sprite = _mm_andnot_si128(_mm_or_si128(sprite_clear, _mm_andnot_si128(bg_clear, behind)), _mm_set1_epi8(-1));
+        __m128i color = _mm_or_si128(_mm_and_si128(use_sprite, sprite),
+                                     _mm_andnot_si128(use_sprite, _mm_andnot_si128(bg_clear, bg)));
+        _mm_storeu_si128((__m128i *) (composed + (x & (WIDTH - 16))), color);
+        if (hit == WIDTH && !(regs.status & 0x40)) {
+            __m128i both = _mm_andnot_si128(_mm_or_si128(bg_clear, sprite_clear), sprite0);
+            unsigned bits = _mm_movemask_epi8(both);
+            if (bits)
+                hit = x + __builtin_ctz(bits);
+        }
+#else
+        for (unsigned i = x; i < x + 16; ++i) {
+            uint8_t bg = (i < 8 && clip_bg) ? 0 : bg_line[8 + i];
+            uint8_t sprite = (!show_sprites || (i < 8 && clip_sprites)) ? 0 : sprite_line[i];
+            bool bg_opaque = bg & 0x03;
+            bool sprite_opaque = sprite & 0x03;
+            composed[i] = sprite_opaque && (!sprite_behind[i] || !bg_opaque) ? sprite : bg_opaque ? bg : 0;
+            if (hit == WIDTH && bg_opaque && sprite_opaque && sprite_zero[i])
+                hit = i;
+        }
+#endif // __SSE2__
+    }
+    for (unsigned x = x0; x < x1; ++x)
+        out[x] = palette[composed[x]] & grey;
+    if (hit >= x0 && hit < x1 && hit != WIDTH - 1)
+        regs.status |= 0x40;
+}
+
+void PPU::flush_line()
+{
+    if (regs.scanline >= HEIGHT || regs.line_end <= regs.line_x)
+        return;
+    render_span(regs.line_x, regs.line_end);
+    regs.line_x = regs.line_end;
+}
+
+void PPU::run_line(unsigned from, unsigned to)
+{
+    unsigned line = regs.scanline;
+    bool on = rendering();
+    if (line < HEIGHT) {
+        if (from == 0) {
+            regs.line_x = 0;
+            regs.line_end = 0;
+            regs.bg_origin = 0;
+            regs.bg_phase = regs.fine_x;
+            if (on) {
+                evaluate_sprites();
+            } else {
+                memset(sprite_line, 0, sizeof(sprite_line));
+                memset(sprite_zero, 0, sizeof(sprite_zero));
+                sprite0_line = false;
+            }
+        }
+        regs.line_end = min(max(to, 1u) - 1, WIDTH);
+        if (regs.line_end == WIDTH)
+            flush_line();
+    }
+    if (on && (line < HEIGHT || line == LINES_PER_FRAME - 1)) {
+        if (from <= 256 && to > 256)
+            increment_y();
+        if (from <= 257 && to > 257)
+            regs.v = (regs.v & ~0x041F) | (regs.t & 0x041F);
+        if (from <= 260 && to > 260 && mapper)
+            mapper->clock_scanline();
+        if (line == LINES_PER_FRAME - 1 && from <= 304 && to > 280)
+            regs.v = (regs.v & ~0x7BE0) | (regs.t & 0x7BE0);
+    }
+    if (line == HEIGHT + 1 && from <= 1 && to > 1) {
+        regs.status |= 0x80;
+        if (regs.ctrl & 0x80)
+            regs.nmi_pending = 1;
+    }
+    if (line == LINES_PER_FRAME - 1 && from <= 1 && to > 1)
+        regs.status &= ~0xE0;
+}
+
+PPU::PPU() : mapper(nullptr), clock(nullptr), sprite0_line(false)
+{
+    memset(framebuffer, 0, sizeof(framebuffer));
+    memset(tiles, 0, sizeof(tiles));
+    reset();
+    reset_stats();
+}
+
+void PPU::set_mapper(Mapper *mapper)
+{
+    this->mapper = mapper;
+    for (unsigned slot = 0; slot < TILE_SLOTS; ++slot)
+        tile_sources[slot] = nullptr;
+}
+
+void PPU::set_clock(const uint64_t *clock)
+{
+    this->clock = clock;
+}
+
+void PPU::reset()
+{
+    memset(&regs, 0, sizeof(regs));
+    sprite0_line = false;
+    memset(vram, 0, sizeof(vram));
+    memset(palette, 0, sizeof(palette));
+    memset(oam, 0, sizeof(oam));
+    memset(bg_line, 0, sizeof(bg_line));
+    memset(sprite_line, 0, sizeof(sprite_line));
+    memset(sprite_behind, 0, sizeof(sprite_behind));
+    memset(sprite_zero, 0, sizeof(sprite_zero));
+    for (unsigned slot = 0; slot < TILE_SLOTS; ++slot)
+        tile_sources[slot] = nullptr;
+}
+
+void PPU::run_until(uint64_t dot)
+{
+    while (regs.dot_clock < dot) {
+        unsigned to = regs.dot + (unsigned) min<uint64_t>(DOTS_PER_LINE - regs.dot, dot - regs.dot_clock);
+        run_line(regs.dot, to);
+        regs.dot_clock += to - regs.dot;
+        regs.dot = to;
+        if (regs.dot == DOTS_PER_LINE) {
+            regs.dot = 0;
+            if (++regs.scanline == LINES_PER_FRAME) {
+                regs.scanline = 0;
+                ++regs.frame;
+            }
+        }
+    }
+}
+
+void PPU::sync(SyncReason reason)
+{
+    ++stats.syncs[reason];
+    if (clock)
+        run_until(*clock * 3);
+    if (reason == SYNC_MAPPER)
+        flush_line();
+}
+
+uint8_t PPU::read_register(uint16_t addr)
+{
+    uint8_t data;
+    switch (addr & 0x07) {
+    case 2:
+        if (sprite0_line && !(regs.status & 0x40) && rendering())
+            flush_line();
+        data = (regs.status & 0xE0) | (regs.io_latch & 0x1F);
+        regs.status &= ~0x80;
+        regs.w = 0;
+        break;
+    case 4:
+        data = oam[regs.oam_addr];
+        break;
+    case 7: {
+        flush_line();
+        uint16_t vaddr = regs.v & 0x3FFF;
+        if (vaddr >= 0x3F00) {
+            data = palette[palette_index(vaddr)] | (regs.io_latch & 0xC0);
+            regs.read_buffer = mem_read(vaddr - 0x1000);
+        } else {
+            data = regs.read_buffer;
+            regs.read_buffer = mem_read(vaddr);
+        }
+        regs.v += regs.ctrl & 0x04 ? 32 : 1;
+        break;
+    }
+    default:
+        data = regs.io_latch;
+        break;
+    }
+    regs.io_latch = data;
+    return data;
+}
+
+void PPU::write_register(uint16_t addr, uint8_t data)
+{
+    flush_line();
+    regs.io_latch = data;
+    switch (addr & 0x07) {
+    case 0:
+        if ((regs.status & 0x80) && !(regs.ctrl & 0x80) && (data & 0x80))
+            regs.nmi_pending = 1;
+        regs.ctrl = data;
+        regs.t = (regs.t & 0xF3FF) | ((data & 0x03) << 10);
+        break;
+    case 1:
+        regs.mask = data;
+        break;
+    case 3:
+        regs.oam_addr = data;
+        break;
+    case 4:
+        oam[regs.oam_addr++] = data;
+        break;
+    case 5:
+        if (!regs.w) {
+            if (mid_line()) {
+                int offset = regs.line_x - regs.bg_origin + regs.bg_phase + (data & 0x07) - regs.fine_x;
+                regs.v = advance_coarse_x(regs.v, max(offset, 0) >> 3);
+            }
+            regs.t = (regs.t & ~0x001F) | (data >> 3);
+            regs.fine_x = data & 0x07;
+            restart_scroll();
+        } else {
+            regs.t = (regs.t & 0x8C1F) | ((data & 0x07) << 12) | ((data & 0xF8) << 2);
+        }
+        regs.w ^= 1;
+        break;
+    case 6:
+        if (!regs.w) {
+            regs.t = (regs.t & 0x00FF) | ((data & 0x3F) << 8);
+        } else {
+            regs.t = (regs.t & 0xFF00) | data;
+            regs.v = regs.t;
+            restart_scroll();
+        }
+        regs.w ^= 1;
+        break;
+    case 7:
+        mem_write(regs.v, data);
+        regs.v += regs.ctrl & 0x04 ? 32 : 1;
+        break;
+    default:
+        break;
+    }
+}
+
+void PPU::oam_dma(const uint8_t *data)
+{
+    for (unsigned i = 0; i < 0x100; ++i)
+        oam[(uint8_t) (regs.oam_addr + i)] = data[i];
+}
+
+bool PPU::nmi_pending()
+{
+    return regs.nmi_pending;
+}
+
+bool PPU::take_nmi()
+{
+    bool pending = regs.nmi_pending;
+    regs.nmi_pending = 0;
+    return pending;
+}
+
+uint64_t PPU::get_frame()
+{
+    return regs.frame;
+}
+
+uint64_t PPU::next_frame_cycle()
+{
+    uint64_t next = regs.dot_clock - (regs.scanline * DOTS_PER_LINE + regs.dot) + DOTS_PER_FRAME;
+    return (next + 2) / 3;
+}
+
+uint64_t PPU::next_nmi_cycle()
+{
+    if (!(regs.ctrl & 0x80))
+        return UINT64_MAX;
+    return (regs.dot_clock + dots_until(HEIGHT + 1, 2) + 2) / 3;
+}
+
+uint64_t PPU::next_irq_cycle()
+{
+    unsigned count = mapper ? mapper->irq_scanlines() : 0;
+    if (!count || !rendering())
+        return UINT64_MAX;
+    uint64_t dots = 0;
+    unsigned line = regs.scanline;
+    unsigned dot = regs.dot;
+    for (;;) {
+        if ((line < HEIGHT || line == LINES_PER_FRAME - 1) && dot <= 260 && !--count)
+            return (regs.dot_clock + dots + 261 - dot + 2) / 3;
+        dots += DOTS_PER_LINE - dot;
+        dot = 0;
+        line = line == LINES_PER_FRAME - 1 ? 0 : line + 1;
+    }
+}
+
+const uint8_t *PPU::get_framebuffer()
+{
+    return framebuffer;
+}
+
+PPU::Stats PPU::get_stats()
+{
+    Stats ret = stats;
+    ret.frames = regs.frame - stats_frame;
+    return ret;
+}
+
+void PPU::reset_stats()
+{
+    memset(&stats, 0, sizeof(stats));
+    stats_frame = regs.frame;
+}
+
+size_t PPU::state_size()
+{
+    return sizeof(regs) + sizeof(vram) + sizeof(palette) + sizeof(oam);
+}
+
+void PPU::save_state(uint8_t *buffer)
+{
+    memcpy(buffer, &regs, sizeof(regs));
+    buffer += sizeof(regs);
+    memcpy(buffer, vram, sizeof(vram));
+    buffer += sizeof(vram);
+    memcpy(buffer, palette, sizeof(palette));
+    buffer += sizeof(palette);
+    memcpy(buffer, oam, sizeof(oam));
+}
+
+void PPU::load_state(const uint8_t *buffer)
+{
+    memcpy(&regs, buffer, sizeof(regs));
+    buffer += sizeof(regs);
+    memcpy(vram, buffer, sizeof(vram));
+    buffer += sizeof(vram);
+    memcpy(palette, buffer, sizeof(palette));
+    buffer += sizeof(palette);
+    memcpy(oam, buffer, sizeof(oam));
+    sprite0_line = false;
+    if (regs.scanline < HEIGHT && regs.dot > 0 && rendering())
+        evaluate_sprites();
+}
@@ -0,0 +1,109 @@
+#ifndef PPU_H
+#define PPU_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mapper.h"
+
+class PPU {
+public:
+    static const unsigned WIDTH = 256;
+    static const unsigned HEIGHT = 240;
+    static const unsigned DOTS_PER_LINE = 341;
+    static const unsigned LINES_PER_FRAME = 262;
+    static const uint64_t DOTS_PER_FRAME = DOTS_PER_LINE * LINES_PER_FRAME;
+    enum SyncReason {
+        SYNC_REGISTER,
+        SYNC_MAPPER,
+        SYNC_OAM_DMA,
+        SYNC_EVENT,
+        SYNC_FRAME,
+        SYNC_REASONS
+    };
+    struct Stats {
+        uint64_t frames;
+        uint64_t syncs[SYNC_REASONS];
+    };
+private:
+    static const unsigned TILE_SLOTS = 8;
+    struct Registers {
+        uint64_t dot_clock;
+        uint64_t frame;
+        uint16_t v;
+        uint16_t t;
+        uint16_t scanline;
+        uint16_t dot;
+        uint16_t line_x;
+        uint16_t line_end;
+        uint16_t bg_origin;
+        uint16_t bg_phase;
+        uint8_t ctrl;
+        uint8_t mask;
+        uint8_t status;
+        uint8_t oam_addr;
+        uint8_t fine_x;
+        uint8_t w;
+        uint8_t read_buffer;
+        uint8_t io_latch;
+        uint8_t nmi_pending;
+    };
+    Mapper *mapper;
+    const uint64_t *clock;
+    Registers regs;
+    Stats stats;
+    bool sprite0_line;
+    uint64_t stats_frame;
+    uint8_t vram[0x800];
+    uint8_t palette[0x20];
+    uint8_t oam[0x100];
+    uint8_t bg_line[WIDTH + 32];
+    uint8_t sprite_line[WIDTH + 16];
+    uint8_t sprite_behind[WIDTH + 16];
+    uint8_t sprite_zero[WIDTH + 16];
+    uint8_t framebuffer[WIDTH * HEIGHT];
+    const uint8_t *tile_sources[TILE_SLOTS];
+    uint8_t tiles[TILE_SLOTS][0x1000];
+    bool rendering();
+    uint64_t dots_until(unsigned scanline, unsigned dot);
+    uint16_t nametable_index(uint16_t addr);
+    uint8_t palette_index(uint16_t addr);
+    uint8_t mem_read(uint16_t addr);
+    void mem_write(uint16_t addr, uint8_t data);
+    void refresh_tiles();
+    uint64_t tile_row(uint16_t pattern, unsigned row);
+    bool mid_line();
+    void restart_scroll();
+    void increment_y();
+    void evaluate_sprites();
+    void render_background(unsigned x0, unsigned x1);
+    void render_span(unsigned x0, unsigned x1);
+    void flush_line();
+    void run_line(unsigned from, unsigned to);
+public:
+    PPU();
+    PPU(const PPU &) = delete;
+    PPU &operator=(const PPU &) = delete;
+    void set_mapper(Mapper *mapper);
+    void set_clock(const uint64_t *clock);
+    void reset();
+    void run_until(uint64_t dot);
+    void sync(SyncReason reason);
+    uint8_t read_register(uint16_t addr);
+    void write_register(uint16_t addr, uint8_t data);
+    void oam_dma(const uint8_t *data);
+    bool nmi_pending();
+    bool take_nmi();
+    uint64_t get_frame();
+    uint64_t next_frame_cycle();
+    uint64_t next_nmi_cycle();
+    uint64_t next_irq_cycle();
+    const uint8_t *get_framebuffer();
+    Stats get_stats();
+    void reset_stats();
+    size_t state_size();
+    void save_state(uint8_t *buffer);
+    void load_state(const uint8_t *buffer);
+};
+
+#endif // PPU_H
@@ -0,0 +1,107 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+static const char *const kind_names[] = { "reset", "sub", "nmi", "irq", "brk" };
+
+Profiler::Profiler(uint64_t period) : instructions(0x10000), cycles(0x10000), period(period ? period : 1),
+    next_sample(0), last_sample(0), overflows(0) {}
+
+void Profiler::push(Kind kind, uint16_t entry, int s)
+{
+    if (stack.size() >= MAX_DEPTH) {
+        ++overflows;
+        return;
+    }
+    stack.push_back(Frame{entry, (uint8_t) kind, s});
+    key.push_back((char) kind);
+    key.push_back((char) (entry & 0xFF));
+    key.push_back((char) (entry >> 8));
+}
+
+void Profiler::unwind(int s)
+{
+    while (stack.size() > 1 && stack.back().s <= s) {
+        stack.pop_back();
+        key.resize(key.size() - 3);
+    }
+}
+
+void Profiler::sample(uint64_t now)
+{
+    folded[key] += now - last_sample;
+    last_sample = now;
+    next_sample = now + period;
+}
+
+void Profiler::retire(uint16_t pc, uint8_t opcode, uint32_t taken, uint16_t next_pc, uint8_t s, uint64_t now)
+{
+    if (stack.empty()) {
+        push(KIND_RESET, pc, 0x200);
+        last_sample = now - taken;
+        next_sample = last_sample + period;
+    }
+    ++instructions[pc];
+    cycles[pc] += taken;
+    if (now >= next_sample)
+        sample(now);
+    switch (opcode) {
+    case 0x20: push(KIND_CALL, next_pc, s + 2); break;
+    case 0x00: push(KIND_BRK, next_pc, s + 3); break;
+    case 0x40:
+    case 0x60: unwind(s); break;
+    }
+}
+
+void Profiler::interrupt(uint16_t vector, uint16_t entry, uint8_t s, uint64_t now)
+{
+    if (stack.empty())
+        return;
+    cycles[entry] += 7;
+    if (now >= next_sample)
+        sample(now);
+    push(vector == 0xFFFA ? KIND_NMI : KIND_IRQ, entry, s + 3);
+}
+
+void Profiler::write_folded(const string &filename)
+{
+    FILE *file = fopen(filename.c_str(), "w");
+    if (!file)
+        throw runtime_error("unable to open profile file");
+    vector<pair<string, uint64_t>> paths(folded.begin(), folded.end());
+    sort(paths.begin(), paths.end());
+    for (const auto &path : paths) {
+        if (!path.second)
+            continue;
+        const string &frames = path.first;
+        for (size_t i = 0; i < frames.size(); i += 3) {
+            uint16_t entry = (uint8_t) frames[i + 1] | ((uint8_t) frames[i + 2] << 8);
+            fprintf(file, "%s%s_%04X", i ? ";" : "", kind_names[(uint8_t) frames[i]], entry);
+        }
+        fprintf(file, " %llu\n", (unsigned long long) path.second);
+    }
+    fclose(file);
+}
+
+void Profiler::write_flat(FILE *file, size_t limit)
+{
+    vector<uint16_t> pcs;
+    uint64_t total = 0;
+    for (size_t pc = 0; pc < cycles.size(); ++pc) {
+        total += cycles[pc];
+        if (cycles[pc])
+            pcs.push_back(pc);
+    }
+    sort(pcs.begin(), pcs.end(), [this](uint16_t a, uint16_t b) { return cycles[a] > cycles[b]; });
+    if (pcs.size() > limit)
+        pcs.resize(limit);
+    fprintf(file, "%-6s %14s %14s %7s\n", "pc", "instructions", "cycles", "share");
+    for (uint16_t pc : pcs)
+        fprintf(file, "%04X   %14llu %14llu %6.2f%%\n", pc, (unsigned long long) instructions[pc],
+                (unsigned long long) cycles[pc], total ? 100.0 * cycles[pc] / total : 0.0);
+    if (overflows)
+        fprintf(file, "call stack overflows %llu\n", (unsigned long long) overflows);
+}
@@ -0,0 +1,46 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Profiler {
+public:
+    enum Kind {
+        KIND_RESET,
+        KIND_CALL,
+        KIND_NMI,
+        KIND_IRQ,
+        KIND_BRK
+    };
+    static const size_t MAX_DEPTH = 64;
+private:
+    struct Frame {
+        uint16_t entry;
+        uint8_t kind;
+        int s;
+    };
+    std::vector<uint64_t> instructions;
+    std::vector<uint64_t> cycles;
+    std::vector<Frame> stack;
+    std::string key;
+    std::unordered_map<std::string, uint64_t> folded;
+    uint64_t period;
+    uint64_t next_sample;
+    uint64_t last_sample;
+    uint64_t overflows;
+    void push(Kind kind, uint16_t entry, int s);
+    void unwind(int s);
+    void sample(uint64_t now);
+public:
+    Profiler(uint64_t period = 1000);
+    void retire(uint16_t pc, uint8_t opcode, uint32_t taken, uint16_t next_pc, uint8_t s, uint64_t now);
+    void interrupt(uint16_t vector, uint16_t entry, uint8_t s, uint64_t now);
+    void write_folded(const std::string &filename);
+    void write_flat(FILE *file, size_t limit);
+};
+
+#endif // PROFILER_H
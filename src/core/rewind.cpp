@@ -0,0 +1,211 @@
+#include "rewind.h"
+
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+static uint8_t *put_varint(uint8_t *out, size_t value)
+{
+    while (value >= 0x80) {
+        *out++ = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t) value;
+    return out;
+}
+
+static const uint8_t *get_varint(const uint8_t *in, size_t &value)
+{
+    value = 0;
+    unsigned shift = 0;
+    uint8_t byte;
+    do {
+        byte = *in++;
+        value |= (size_t) (byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return in;
+}
+
+static uint64_t elapsed_ns(chrono::steady_clock::time_point start)
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+size_t Rewind::encode(const uint8_t *base, const uint8_t *state)
+{
+    static const size_t MIN_GAP = 4;
+    uint8_t *out = scratch.data();
+    size_t pos = 0;
+    while (pos < state_size) {
+        size_t start = pos;
+        while (start < state_size && (base ? base[start] ^ state[start] : state[start]) == 0)
+            ++start;
+        if (start == state_size)
+            break;
+        size_t end = start;
+        size_t zeros = 0;
+        while (end + zeros < state_size && zeros < MIN_GAP) {
+            if ((base ? base[end + zeros] ^ state[end + zeros] : state[end + zeros]) == 0) {
+                ++zeros;
+            } else {
+                end += zeros + 1;
+                zeros = 0;
+            }
+        }
+        out = put_varint(out, start - pos);
+        out = put_varint(out, end - start);
+        for (size_t i = start; i < end; ++i)
+            *out++ = base ? base[i] ^ state[i] : state[i];
+        pos = end;
+    }
+    out = put_varint(out, 0);
+    out = put_varint(out, 0);
+    return out - scratch.data();
+}
+
+void Rewind::decode(const Entry &entry, uint8_t *state)
+{
+    const uint8_t *in = &data[entry.offset];
+    if (entry.key)
+        memset(state, 0, state_size);
+    size_t pos = 0;
+    for (;;) {
+        size_t skip, length;
+        in = get_varint(in, skip);
+        in = get_varint(in, length);
+        if (!length)
+            break;
+        pos += skip;
+        for (size_t i = 0; i < length; ++i)
+            state[pos + i] ^= in[i];
+        in += length;
+        pos += length;
+    }
+}
+
+Rewind::Entry &Rewind::entry_at(size_t index)
+{
+    return entries[(first + index) % entries.size()];
+}
+
+void Rewind::drop_oldest()
+{
+    used -= entry_at(0).length;
+    first = (first + 1) % entries.size();
+    --count;
+}
+
+size_t Rewind::reserve(size_t length)
+{
+    if (length > data.size())
+        throw runtime_error("rewind budget is smaller than a single frame delta");
+    if (count == entries.size())
+        drop_oldest();
+    if (write_pos + length > data.size()) {
+        while (count && entry_at(0).offset >= write_pos)
+            drop_oldest();
+        write_pos = 0;
+    }
+    while (count && entry_at(0).offset >= write_pos && entry_at(0).offset < write_pos + length)
+        drop_oldest();
+    size_t offset = write_pos;
+    write_pos += length;
+    return offset;
+}
+
+Rewind::Rewind(size_t state_size, size_t budget, size_t max_frames, unsigned keyframe_interval) :
+    state_size(state_size), keyframe_interval(keyframe_interval), head(state_size),
+    scratch(state_size * 3 + 16), data(budget), entries(max_frames)
+{
+    if (!max_frames || !keyframe_interval)
+        throw runtime_error("invalid rewind configuration");
+    clear();
+}
+
+void Rewind::clear()
+{
+    first = 0;
+    count = 0;
+    write_pos = 0;
+    used = 0;
+    has_head = false;
+    pushed = 0;
+    encode_ns = 0;
+    decode_ns = 0;
+    decodes = 0;
+}
+
+void Rewind::push(const uint8_t *state)
+{
+    auto start = chrono::steady_clock::now();
+    if (has_head) {
+        bool key = pushed % keyframe_interval == 0;
+        size_t length = encode(key ? nullptr : state, head.data());
+        Entry entry;
+        entry.offset = reserve(length);
+        entry.length = length;
+        entry.key = key;
+        memcpy(&data[entry.offset], scratch.data(), length);
+        entry_at(count++) = entry;
+        used += length;
+    }
+    memcpy(head.data(), state, state_size);
+    has_head = true;
+    ++pushed;
+    encode_ns += elapsed_ns(start);
+}
+
+const uint8_t *Rewind::step_back()
+{
+    return seek_back(1);
+}
+
+const uint8_t *Rewind::seek_back(size_t frames)
+{
+    if (!count || !frames)
+        return nullptr;
+    auto start = chrono::steady_clock::now();
+    size_t target = frames < count ? count - frames : 0;
+    size_t from = count;
+    for (size_t i = target; i < count; ++i) {
+        if (entry_at(i).key) {
+            from = i + 1;
+            break;
+        }
+    }
+    while (from > target)
+        decode(entry_at(--from), head.data());
+    while (count > target) {
+        Entry &entry = entry_at(count - 1);
+        used -= entry.length;
+        write_pos = entry.offset;
+        --count;
+    }
+    decode_ns += elapsed_ns(start);
+    ++decodes;
+    return head.data();
+}
+
+size_t Rewind::frames()
+{
+    return count + (has_head ? 1 : 0);
+}
+
+Rewind::Stats Rewind::get_stats()
+{
+    Stats stats;
+    stats.budget = data.size();
+    stats.used = used;
+    stats.frames = frames();
+    stats.keyframes = 0;
+    for (size_t i = 0; i < count; ++i)
+        if (entry_at(i).key)
+            ++stats.keyframes;
+    stats.average_delta = count ? used / count : 0;
+    stats.encode_us = pushed ? encode_ns / 1000.0 / pushed : 0;
+    stats.decode_us = decodes ? decode_ns / 1000.0 / decodes : 0;
+    return stats;
+}
@@ -0,0 +1,54 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class Rewind {
+private:
+    struct Entry {
+        size_t offset;
+        size_t length;
+        bool key;
+    };
+    size_t state_size;
+    unsigned keyframe_interval;
+    std::vector<uint8_t> head;
+    std::vector<uint8_t> scratch;
+    std::vector<uint8_t> data;
+    std::vector<Entry> entries;
+    size_t first;
+    size_t count;
+    size_t write_pos;
+    size_t used;
+    bool has_head;
+    uint64_t pushed;
+    uint64_t encode_ns;
+    uint64_t decode_ns;
+    uint64_t decodes;
+    size_t encode(const uint8_t *base, const uint8_t *state);
+    void decode(const Entry &entry, uint8_t *state);
+    Entry &entry_at(size_t index);
+    void drop_oldest();
+    size_t reserve(size_t length);
+public:
+    struct Stats {
+        size_t budget;
+        size_t used;
+        size_t frames;
+        size_t keyframes;
+        size_t average_delta;
+        double encode_us;
+        double decode_us;
+    };
+    Rewind(size_t state_size, size_t budget, size_t max_frames = 0x4000, unsigned keyframe_interval = 64);
+    void clear();
+    void push(const uint8_t *state);
+    const uint8_t *step_back();
+    const uint8_t *seek_back(size_t frames);
+    size_t frames();
+    Stats get_stats();
+};
+
+#endif // REWIND_H
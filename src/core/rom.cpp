@@ -1,53 +1,190 @@
 #include "rom.h"
 
-#include <fstream>
+#include <array>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <map>
+#include <mutex>
 #include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
 
 using namespace std;
 
-void ROM::load_file(const string &filename)
+static const size_t HEADER_SIZE = 16;
+static const size_t TRAINER_SIZE = 512;
+static const size_t CARTRIDGE_PRG_OFFSET = 0x8000 - 0x4020;
+static const size_t CARTRIDGE_PRG_SIZE = 0x8000;
+
+typedef array<uint64_t, 4> FileKey;
+
+static mutex cache_mutex;
+static unordered_map<uint64_t, weak_ptr<const ROMImage>> cache;
+static map<FileKey, weak_ptr<const ROMImage>> file_cache;
+
+static uint64_t content_hash(const uint8_t *data, size_t size)
 {
-    ifstream file(filename, ifstream::binary);
-    if (file) {
-        load(file);
-        file.close();
-    } else {
-        throw runtime_error("unable to open rom file");
+    uint64_t hash = 0xCBF29CE484222325ULL ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x100000001B3ULL;
+        hash ^= hash >> 29;
     }
+    for (; i < size; ++i)
+        hash = (hash ^ data[i]) * 0x100000001B3ULL;
+    return hash;
 }
 
-void ROM::load(istream &stream)
+ROMImage::ROMImage() :
+    mapping(nullptr), mapping_size(0), hash(0), trainer(nullptr), prg_rom(nullptr), prg_rom_size(0),
+    chr_rom(nullptr), chr_rom_size(0), mapper(0), vertical_mirroring(false), battery(false) {}
+
+ROMImage::~ROMImage()
 {
-    vector<uint8_t> header(16, 0);
-    stream.read((char *) header.data(), 16);
-    if (!stream)
-        throw runtime_error("invalid NES rom file");
-    if (header[0] != 'N' || header[1] != 'E' || header[2] != 'S' || header[3] != 0x1A)
+    if (mapping)
+        munmap(mapping, mapping_size);
+}
+
+void ROM::parse(ROMImage &image, const uint8_t *data, size_t size)
+{
+    if (size < HEADER_SIZE || data[0] != 'N' || data[1] != 'E' || data[2] != 'S' || data[3] != 0x1A)
         throw runtime_error("invalid NES rom file");
-    uint32_t prg_rom_len = header[4] << 14;
-    uint32_t chr_rom_len = header[5] << 13;
-    if ((header[6] & 0x04) == 0x04) {
-        trainer.resize(512, 0);
-        stream.read((char *) trainer.data(), 512);
-        if (!stream)
-            throw runtime_error("invalid NES rom file");
-    } else {
-        trainer.clear();
+    size_t offset = HEADER_SIZE;
+    if ((data[6] & 0x04) == 0x04) {
+        image.trainer = data + offset;
+        offset += TRAINER_SIZE;
     }
-    prg_rom.resize(prg_rom_len, 0);
-    stream.read((char *) prg_rom.data(), prg_rom_len);
-    if (!stream)
+    image.prg_rom_size = (size_t) data[4] << 14;
+    image.chr_rom_size = (size_t) data[5] << 13;
+    if (!image.prg_rom_size || size < offset + image.prg_rom_size + image.chr_rom_size)
         throw runtime_error("invalid NES rom file");
-    chr_rom.resize(chr_rom_len, 0);
-    stream.read((char *) chr_rom.data(), chr_rom_len);
-    if (!stream)
+    image.prg_rom = data + offset;
+    image.chr_rom = data + offset + image.prg_rom_size;
+    image.mapper = (data[7] & 0xF0) | (data[6] >> 4);
+    image.vertical_mirroring = data[6] & 0x01;
+    image.battery = data[6] & 0x02;
+}
+
+shared_ptr<const ROMImage> ROM::intern(unique_ptr<ROMImage> image, const uint8_t *data, size_t size)
+{
+    image->hash = content_hash(data, size);
+    lock_guard<mutex> lock(cache_mutex);
+    auto it = cache.find(image->hash);
+    if (it != cache.end()) {
+        shared_ptr<const ROMImage> cached = it->second.lock();
+        if (cached) {
+            const uint8_t *cached_data = cached->mapping ? (const uint8_t *) cached->mapping : cached->storage.data();
+            size_t cached_size = cached->mapping ? cached->mapping_size : cached->storage.size();
+            if (cached_size == size && !memcmp(cached_data, data, size))
+                return cached;
+            return shared_ptr<const ROMImage>(image.release());
+        }
+    }
+    for (auto entry = cache.begin(); entry != cache.end();) {
+        if (entry->second.expired())
+            entry = cache.erase(entry);
+        else
+            ++entry;
+    }
+    shared_ptr<const ROMImage> shared(image.release());
+    cache[shared->hash] = shared;
+    return shared;
+}
+
+shared_ptr<const ROMImage> ROM::open_image(const string &filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("unable to open rom file");
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) HEADER_SIZE) {
+        close(fd);
         throw runtime_error("invalid NES rom file");
+    }
+    FileKey key = {{ (uint64_t) st.st_dev, (uint64_t) st.st_ino, (uint64_t) st.st_size,
+                     (uint64_t) st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec }};
+    {
+        lock_guard<mutex> lock(cache_mutex);
+        auto it = file_cache.find(key);
+        if (it != file_cache.end()) {
+            shared_ptr<const ROMImage> cached = it->second.lock();
+            if (cached) {
+                close(fd);
+                return cached;
+            }
+            file_cache.erase(it);
+        }
+    }
+    void *mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        throw runtime_error("unable to map rom file");
+    unique_ptr<ROMImage> image(new ROMImage);
+    image->mapping = mapping;
+    image->mapping_size = st.st_size;
+    parse(*image, (const uint8_t *) mapping, st.st_size);
+    shared_ptr<const ROMImage> shared = intern(move(image), (const uint8_t *) mapping, st.st_size);
+    lock_guard<mutex> lock(cache_mutex);
+    file_cache[key] = shared;
+    return shared;
+}
+
+shared_ptr<const ROMImage> ROM::cartridge_image(const vector<uint8_t> &cartridge)
+{
+    unique_ptr<ROMImage> image(new ROMImage);
+    image->storage.assign(CARTRIDGE_PRG_SIZE, 0);
+    if (cartridge.size() > CARTRIDGE_PRG_OFFSET) {
+        size_t length = min(cartridge.size() - CARTRIDGE_PRG_OFFSET, CARTRIDGE_PRG_SIZE);
+        memcpy(image->storage.data(), &cartridge[CARTRIDGE_PRG_OFFSET], length);
+    }
+    image->prg_rom = image->storage.data();
+    image->prg_rom_size = CARTRIDGE_PRG_SIZE;
+    const uint8_t *data = image->storage.data();
+    return intern(move(image), data, CARTRIDGE_PRG_SIZE);
+}
+
+size_t ROM::cached_images()
+{
+    lock_guard<mutex> lock(cache_mutex);
+    size_t count = 0;
+    for (auto &entry : cache)
+        if (!entry.second.expired())
+            ++count;
+    return count;
+}
+
+void ROM::load_file(const string &filename)
+{
+    image = open_image(filename);
+}
+
+void ROM::load(istream &stream)
+{
+    unique_ptr<ROMImage> loaded(new ROMImage);
+    loaded->storage.assign(istreambuf_iterator<char>(stream), istreambuf_iterator<char>());
+    parse(*loaded, loaded->storage.data(), loaded->storage.size());
+    const uint8_t *data = loaded->storage.data();
+    size_t size = loaded->storage.size();
+    image = intern(move(loaded), data, size);
+}
+
+shared_ptr<const ROMImage> ROM::get_image()
+{
+    if (!image)
+        throw runtime_error("no rom loaded");
+    return image;
 }
 
 vector<uint8_t> ROM::to_cartridge()
 {
+    shared_ptr<const ROMImage> loaded = get_image();
     vector<uint8_t> ret(8160, 0);
-    ret.insert(ret.end(), chr_rom.begin(), chr_rom.end());
-    ret.insert(ret.end(), prg_rom.begin(), prg_rom.end());
+    ret.insert(ret.end(), loaded->chr_rom, loaded->chr_rom + loaded->chr_rom_size);
+    ret.insert(ret.end(), loaded->prg_rom, loaded->prg_rom + loaded->prg_rom_size);
     return ret;
 }
@@ -1,18 +1,47 @@
 #ifndef ROM_H
 #define ROM_H
 
+#include <cstddef>
 #include <cstdint>
+#include <istream>
+#include <memory>
 #include <string>
 #include <vector>
 
+class ROMImage {
+private:
+    void *mapping;
+    size_t mapping_size;
+    std::vector<uint8_t> storage;
+    friend class ROM;
+public:
+    uint64_t hash;
+    const uint8_t *trainer;
+    const uint8_t *prg_rom;
+    size_t prg_rom_size;
+    const uint8_t *chr_rom;
+    size_t chr_rom_size;
+    uint8_t mapper;
+    bool vertical_mirroring;
+    bool battery;
+    ROMImage();
+    ROMImage(const ROMImage &) = delete;
+    ROMImage &operator=(const ROMImage &) = delete;
+    ~ROMImage();
+};
+
 class ROM {
 private:
-    std::vector<uint8_t> trainer;
-    std::vector<uint8_t> prg_rom;
-    std::vector<uint8_t> chr_rom;
+    std::shared_ptr<const ROMImage> image;
+    static void parse(ROMImage &image, const uint8_t *data, size_t size);
+    static std::shared_ptr<const ROMImage> intern(std::unique_ptr<ROMImage> image, const uint8_t *data, size_t size);
 public:
+    static std::shared_ptr<const ROMImage> open_image(const std::string &filename);
+    static std::shared_ptr<const ROMImage> cartridge_image(const std::vector<uint8_t> &cartridge);
+    static size_t cached_images();
     void load_file(const std::string &filename);
     void load(std::istream &stream);
+    std::shared_ptr<const ROMImage> get_image();
     std::vector<uint8_t> to_cartridge();
 };
 
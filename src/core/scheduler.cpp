@@ -0,0 +1,109 @@
+#include "scheduler.h"
+
+using namespace std;
+
+void Scheduler::place(unsigned index, const Entry &entry)
+{
+    heap[index] = entry;
+    slots[entry.event] = index;
+}
+
+void Scheduler::sift_up(unsigned index)
+{
+    Entry entry = heap[index];
+    while (index > 0) {
+        unsigned parent = (index - 1) / 2;
+        if (heap[parent].cycle <= entry.cycle)
+            break;
+        place(index, heap[parent]);
+        index = parent;
+    }
+    place(index, entry);
+}
+
+void Scheduler::sift_down(unsigned index)
+{
+    Entry entry = heap[index];
+    for (;;) {
+        unsigned child = index * 2 + 1;
+        if (child >= count)
+            break;
+        if (child + 1 < count && heap[child + 1].cycle < heap[child].cycle)
+            ++child;
+        if (entry.cycle <= heap[child].cycle)
+            break;
+        place(index, heap[child]);
+        index = child;
+    }
+    place(index, entry);
+}
+
+void Scheduler::remove(unsigned index)
+{
+    slots[heap[index].event] = EVENTS;
+    if (index == --count)
+        return;
+    Event moved = heap[count].event;
+    place(index, heap[count]);
+    sift_down(index);
+    sift_up(slots[moved]);
+}
+
+Scheduler::Scheduler() : limit(nullptr)
+{
+    clear();
+}
+
+void Scheduler::set_limit(uint64_t *limit)
+{
+    this->limit = limit;
+}
+
+void Scheduler::schedule(Event event, uint64_t cycle)
+{
+    if (cycle == UINT64_MAX) {
+        cancel(event);
+        return;
+    }
+    unsigned index = slots[event];
+    if (index == EVENTS) {
+        index = count++;
+        place(index, { cycle, event });
+        sift_up(index);
+    } else if (cycle < heap[index].cycle) {
+        heap[index].cycle = cycle;
+        sift_up(index);
+    } else {
+        heap[index].cycle = cycle;
+        sift_down(index);
+    }
+    if (limit && cycle < *limit)
+        *limit = cycle;
+}
+
+void Scheduler::cancel(Event event)
+{
+    if (slots[event] != EVENTS)
+        remove(slots[event]);
+}
+
+uint64_t Scheduler::next_cycle()
+{
+    return count ? heap[0].cycle : UINT64_MAX;
+}
+
+bool Scheduler::pop(uint64_t cycle, Event &event)
+{
+    if (!count || heap[0].cycle > cycle)
+        return false;
+    event = heap[0].event;
+    remove(0);
+    return true;
+}
+
+void Scheduler::clear()
+{
+    count = 0;
+    for (unsigned i = 0; i < EVENTS; ++i)
+        slots[i] = EVENTS;
+}
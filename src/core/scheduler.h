@@ -0,0 +1,38 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <cstdint>
+
+class Scheduler {
+public:
+    enum Event {
+        EVENT_NMI,
+        EVENT_FRAME_IRQ,
+        EVENT_DMC_IRQ,
+        EVENT_MAPPER_IRQ,
+        EVENTS
+    };
+private:
+    struct Entry {
+        uint64_t cycle;
+        Event event;
+    };
+    Entry heap[EVENTS];
+    unsigned slots[EVENTS];
+    unsigned count;
+    uint64_t *limit;
+    void place(unsigned index, const Entry &entry);
+    void sift_up(unsigned index);
+    void sift_down(unsigned index);
+    void remove(unsigned index);
+public:
+    Scheduler();
+    void set_limit(uint64_t *limit);
+    void schedule(Event event, uint64_t cycle);
+    void cancel(Event event);
+    uint64_t next_cycle();
+    bool pop(uint64_t cycle, Event &event);
+    void clear();
+};
+
+#endif // SCHEDULER_H
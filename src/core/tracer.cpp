@@ -0,0 +1,101 @@
+#include "tracer.h"
+#include "cpu_ops.h"
+
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+Tracer::Tracer(const string &filename, size_t capacity) : head(0), tail(0), running(true)
+{
+    if (capacity == 0 || (capacity & (capacity - 1)))
+        throw runtime_error("trace buffer capacity must be a power of two");
+    file = fopen(filename.c_str(), "w");
+    if (!file)
+        throw runtime_error("unable to open trace file");
+    ring.resize(capacity);
+    mask = capacity - 1;
+    worker = thread(&Tracer::drain, this);
+}
+
+Tracer::~Tracer()
+{
+    running.store(false, memory_order_release);
+    worker.join();
+    fclose(file);
+}
+
+void Tracer::record(uint16_t pc, const uint8_t *bytes, const uint8_t *reg, uint8_t p, uint64_t cycles)
+{
+    size_t h = head.load(memory_order_relaxed);
+    while (h - tail.load(memory_order_acquire) > mask)
+        this_thread::yield();
+    Record &record = ring[h & mask];
+    record.cycles = cycles;
+    record.pc = pc;
+    memcpy(record.bytes, bytes, 3);
+    record.a = reg[0];
+    record.x = reg[1];
+    record.y = reg[2];
+    record.s = reg[3];
+    record.p = p;
+    head.store(h + 1, memory_order_release);
+}
+
+void Tracer::drain()
+{
+    for (;;) {
+        bool stopping = !running.load(memory_order_acquire);
+        size_t t = tail.load(memory_order_relaxed);
+        size_t h = head.load(memory_order_acquire);
+        for (; t != h; ++t) {
+            render(ring[t & mask]);
+            if ((t & 0xFF) == 0xFF)
+                tail.store(t + 1, memory_order_release);
+        }
+        tail.store(t, memory_order_release);
+        if (stopping)
+            break;
+        fflush(file);
+        this_thread::sleep_for(chrono::microseconds(200));
+    }
+    fflush(file);
+}
+
+void Tracer::render(const Record &record)
+{
+    uint8_t opcode = record.bytes[0];
+    uint8_t mode = op_mode_table[opcode];
+    uint8_t length = op_length_table[opcode];
+    uint8_t lo = record.bytes[1];
+    uint16_t word = lo | (record.bytes[2] << 8);
+    char hex[10];
+    char text[32];
+    switch (length) {
+    case 1: snprintf(hex, sizeof(hex), "%02X", opcode); break;
+    case 2: snprintf(hex, sizeof(hex), "%02X %02X", opcode, lo); break;
+    default: snprintf(hex, sizeof(hex), "%02X %02X %02X", opcode, lo, record.bytes[2]); break;
+    }
+    const char *name = strcmp(op_name_table[opcode], "none") ? op_name_table[opcode] : "???";
+    switch (mode) {
+    case MODE_A: snprintf(text, sizeof(text), "%.3s A", name); break;
+    case MODE_imm: snprintf(text, sizeof(text), "%.3s #$%02X", name, lo); break;
+    case MODE_zpg: snprintf(text, sizeof(text), "%.3s $%02X", name, lo); break;
+    case MODE_zpgX: snprintf(text, sizeof(text), "%.3s $%02X,X", name, lo); break;
+    case MODE_zpgY: snprintf(text, sizeof(text), "%.3s $%02X,Y", name, lo); break;
+    case MODE_abs: snprintf(text, sizeof(text), "%.3s $%04X", name, word); break;
+    case MODE_absX: snprintf(text, sizeof(text), "%.3s $%04X,X", name, word); break;
+    case MODE_absY: snprintf(text, sizeof(text), "%.3s $%04X,Y", name, word); break;
+    case MODE_ind: snprintf(text, sizeof(text), "%.3s ($%04X)", name, word); break;
+    case MODE_Xind: snprintf(text, sizeof(text), "%.3s ($%02X,X)", name, lo); break;
+    case MODE_indY: snprintf(text, sizeof(text), "%.3s ($%02X),Y", name, lo); break;
+    case MODE_rel:
+        snprintf(text, sizeof(text), "%.3s $%04X", name, (uint16_t) (record.pc + 2 + (int8_t) lo));
+        break;
+    default: snprintf(text, sizeof(text), "%.3s", name); break;
+    }
+    fprintf(file, "%04X  %-8s  %-31s A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu\n",
+            record.pc, hex, text, record.a, record.x, record.y, record.p, record.s,
+            (unsigned long long) record.cycles);
+}
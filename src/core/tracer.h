@@ -0,0 +1,43 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Tracer {
+private:
+    struct Record {
+        uint64_t cycles;
+        uint16_t pc;
+        uint8_t bytes[3];
+        uint8_t a;
+        uint8_t x;
+        uint8_t y;
+        uint8_t s;
+        uint8_t p;
+    };
+    std::vector<Record> ring;
+    size_t mask;
+    FILE *file;
+    uint8_t pad0[64];
+    std::atomic<size_t> head;
+    uint8_t pad1[64];
+    std::atomic<size_t> tail;
+    uint8_t pad2[64];
+    std::atomic<bool> running;
+    std::thread worker;
+    void drain();
+    void render(const Record &record);
+public:
+    Tracer(const std::string &filename, size_t capacity = 0x10000);
+    ~Tracer();
+    Tracer(const Tracer &) = delete;
+    Tracer &operator=(const Tracer &) = delete;
+    void record(uint16_t pc, const uint8_t *bytes, const uint8_t *reg, uint8_t p, uint64_t cycles);
+};
+
+#endif // TRACER_H
@@ -0,0 +1,5 @@
+#include "video.h"
+
+using namespace std;
+
+FrameSink::~FrameSink() {}
@@ -0,0 +1,19 @@
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include <cstdint>
+
+struct VideoFrame {
+    uint64_t frame;
+    uint64_t cycles;
+    uint8_t buttons[2];
+    const uint8_t *pixels;
+};
+
+class FrameSink {
+public:
+    virtual ~FrameSink();
+    virtual void write(const VideoFrame &frame) = 0;
+};
+
+#endif // VIDEO_H
@@ -1,19 +1,306 @@
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
+#include "core/capture.h"
+#include "core/movie.h"
 #include "core/nes.h"
+#ifdef USE_SHM
+#include "core/frame_ring.h"
+#endif // USE_SHM
+#ifdef USE_PERF
+#include "core/perf.h"
+#endif // USE_PERF
 
 using namespace std;
 
+struct Options {
+    string trace;
+    string engine;
+    string hash_file;
+    string verify_file;
+    string frame_ring;
+    string video_file;
+    string audio_file;
+    string policy;
+    string movie_file;
+    string record_file;
+    string profile_file;
+    string rom;
+    uint64_t frames;
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t checkpoint_interval;
+    uint64_t profile_period;
+    long pc;
+    bool counters;
+};
+
+static vector<uint64_t> read_hashes(const string &filename)
+{
+    FILE *file = fopen(filename.c_str(), "r");
+    if (!file)
+        throw runtime_error("unable to open hash file");
+    vector<uint64_t> hashes;
+    unsigned long long frame, hash;
+    while (fscanf(file, "%llu %llx", &frame, &hash) == 2) {
+        if (frame != hashes.size() + 1)
+            break;
+        hashes.push_back(hash);
+    }
+    fclose(file);
+    return hashes;
+}
+
+static bool next_input(Movie &movie, NES &nes, uint64_t frames, bool &desync)
+{
+    Movie::Event event;
+    while (movie.next(event)) {
+        if (event.type == Movie::EVENT_FRAME) {
+            nes.set_buttons(0, event.buttons[0]);
+            nes.set_buttons(1, event.buttons[1]);
+            return true;
+        }
+        uint64_t hash = nes.state_hash();
+        if (hash != event.hash) {
+            fprintf(stderr, "movie desync at frame %llu: expected %016llx got %016llx\n", (unsigned long long) frames,
+                    (unsigned long long) event.hash, (unsigned long long) hash);
+            desync = true;
+            return false;
+        }
+    }
+    return false;
+}
+
+static int run_headless(NES &nes, const Options &options, Capture *capture)
+{
+    FILE *hash_file = nullptr;
+    if (!options.hash_file.empty()) {
+        hash_file = fopen(options.hash_file.c_str(), "w");
+        if (!hash_file)
+            throw runtime_error("unable to open hash file");
+    }
+    vector<uint64_t> expected;
+    if (!options.verify_file.empty())
+        expected = read_hashes(options.verify_file);
+    unique_ptr<Movie> movie;
+    if (!options.movie_file.empty())
+        movie.reset(new Movie(options.movie_file));
+    unique_ptr<MovieWriter> recorder;
+    if (!options.record_file.empty())
+        recorder.reset(new MovieWriter(options.record_file));
+    bool stepping = options.instructions || options.pc >= 0;
+    uint64_t limit = options.instructions ? options.instructions : UINT64_MAX;
+    bool reached = false;
+    bool mismatch = false;
+    bool desync = false;
+    bool hash_error = false;
+    uint64_t frames = 0;
+    uint64_t instructions = 0;
+    auto start = chrono::steady_clock::now();
+    while (frames < options.frames && nes.get_cycles() < options.cycles && !reached && !mismatch) {
+        if (movie && !next_input(*movie, nes, frames, desync))
+            break;
+        uint64_t frame_end = nes.frame_end_cycle();
+        uint64_t end = min(frame_end, options.cycles);
+        if (stepping) {
+            while (nes.get_cycles() < end && instructions < limit) {
+                if (nes.step())
+                    ++instructions;
+                if (nes.get_cpu_state().pc == options.pc) {
+                    reached = true;
+                    break;
+                }
+            }
+            if (instructions >= limit)
+                break;
+        } else {
+            nes.run_cycles(end - nes.get_cycles());
+        }
+        if (nes.get_cycles() < frame_end)
+            continue;
+        nes.finish_frame();
+        uint64_t hash = nes.state_hash();
+        ++frames;
+        if (recorder) {
+            uint8_t buttons[2] = {nes.get_buttons(0), nes.get_buttons(1)};
+            recorder->frame(buttons);
+            if (options.checkpoint_interval && frames % options.checkpoint_interval == 0)
+                recorder->checkpoint(hash);
+        }
+        if (hash_file && fprintf(hash_file, "%llu %016llx\n", (unsigned long long) frames, (unsigned long long) hash) < 0)
+            hash_error = true;
+        if (!options.verify_file.empty() && (frames > expected.size() || expected[frames - 1] != hash)) {
+            fprintf(stderr, "hash mismatch at frame %llu\n", (unsigned long long) frames);
+            mismatch = true;
+        }
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (hash_file) {
+        hash_error |= ferror(hash_file) != 0;
+        hash_error |= fclose(hash_file) != 0;
+    }
+    CPU::State state = nes.get_cpu_state();
+    printf("frames %llu cycles %llu", (unsigned long long) frames, (unsigned long long) state.cycles);
+    if (stepping)
+        printf(" instructions %llu", (unsigned long long) instructions);
+    printf(" pc %04X seconds %.3f fps %.1f hash %016llx\n", state.pc, seconds,
+           seconds > 0 ? frames / seconds : 0.0, (unsigned long long) nes.state_hash());
+    if (hash_error) {
+        fprintf(stderr, "unable to write hash file\n");
+        return EXIT_FAILURE;
+    }
+    if (recorder) {
+        recorder->close();
+        if (recorder->get_errors()) {
+            fprintf(stderr, "movie write failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (capture) {
+        capture->finish();
+        if (capture->get_stats().write_errors) {
+            fprintf(stderr, "capture write failed\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (mismatch || desync)
+        return EXIT_FAILURE;
+    if (options.pc >= 0 && !reached) {
+        fprintf(stderr, "pc %04lX not reached\n", options.pc);
+        return EXIT_FAILURE;
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     try {
-        if (argc != 2) {
-            fprintf(stderr, "usage: %s rom\n", argv[0]);
+        Options options;
+        options.frames = UINT64_MAX;
+        options.cycles = UINT64_MAX;
+        options.instructions = 0;
+        options.checkpoint_interval = 60;
+        options.profile_period = 1000;
+        options.pc = -1;
+        options.counters = false;
+        bool headless = false;
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "-t" && i + 1 < argc) {
+                options.trace = argv[++i];
+            } else if (arg == "-e" && i + 1 < argc) {
+                options.engine = argv[++i];
+            } else if (arg == "-f" && i + 1 < argc) {
+                options.frames = strtoull(argv[++i], nullptr, 0);
+                headless = true;
+            } else if (arg == "-c" && i + 1 < argc) {
+                options.cycles = strtoull(argv[++i], nullptr, 0);
+                headless = true;
+            } else if (arg == "-n" && i + 1 < argc) {
+                options.instructions = strtoull(argv[++i], nullptr, 0);
+                headless = true;
+            } else if (arg == "-p" && i + 1 < argc) {
+                options.pc = strtol(argv[++i], nullptr, 16) & 0xFFFF;
+                headless = true;
+            } else if (arg == "-H" && i + 1 < argc) {
+                options.hash_file = argv[++i];
+            } else if (arg == "-V" && i + 1 < argc) {
+                options.verify_file = argv[++i];
+            } else if (arg == "-m" && i + 1 < argc) {
+                options.movie_file = argv[++i];
+                headless = true;
+            } else if (arg == "-r" && i + 1 < argc) {
+                options.record_file = argv[++i];
+                headless = true;
+            } else if (arg == "-k" && i + 1 < argc) {
+                options.checkpoint_interval = strtoull(argv[++i], nullptr, 0);
+            } else if (arg == "-g" && i + 1 < argc) {
+                options.profile_file = argv[++i];
+                headless = true;
+            } else if (arg == "-G" && i + 1 < argc) {
+                options.profile_period = strtoull(argv[++i], nullptr, 0);
+            } else if (arg == "-v" && i + 1 < argc) {
+                options.video_file = argv[++i];
+            } else if (arg == "-a" && i + 1 < argc) {
+                options.audio_file = argv[++i];
+            } else if (arg == "-P" && i + 1 < argc) {
+                options.policy = argv[++i];
+#ifdef USE_SHM
+            } else if (arg == "-s" && i + 1 < argc) {
+                options.frame_ring = argv[++i];
+#endif // USE_SHM
+#ifdef USE_PERF
+            } else if (arg == "-x") {
+                options.counters = true;
+                headless = true;
+#endif // USE_PERF
+            } else if (arg[0] != '-' && options.rom.empty()) {
+                options.rom = arg;
+            } else {
+                options.rom.clear();
+                break;
+            }
+        }
+        if (options.rom.empty() || (!options.frame_ring.empty() && !options.video_file.empty())) {
+            fprintf(stderr, "usage: %s [-t trace] [-e engine] [-f frames] [-c cycles] [-n instructions] [-p pc] "
+                    "[-H hashes] [-V hashes] [-m movie] [-r movie] [-k interval] [-g profile] [-G period] [-x] "
+                    "[-s ring | -v video.y4m] [-a audio.wav] [-P block|drop] rom\n", argv[0]);
             exit(EXIT_FAILURE);
         }
         NES nes;
-        nes.load_rom(argv[1]);
+        if (!options.engine.empty())
+            nes.set_engine(CPU::engine_by_name(options.engine));
+        nes.set_trace(options.trace);
+        nes.load_rom(options.rom);
+        unique_ptr<Profiler> profiler;
+        if (!options.profile_file.empty()) {
+            profiler.reset(new Profiler(options.profile_period));
+            nes.set_profiler(profiler.get());
+        }
+#ifdef USE_PERF
+        unique_ptr<PerfCounters> perf;
+        if (options.counters) {
+            perf.reset(new PerfCounters());
+            nes.set_perf(perf.get());
+        }
+#endif // USE_PERF
+        unique_ptr<FrameSink> frame_sink;
+#ifdef USE_SHM
+        if (!options.frame_ring.empty())
+            frame_sink.reset(new SharedFrameSink(options.frame_ring));
+#endif // USE_SHM
+        unique_ptr<Capture> capture;
+        if (!options.video_file.empty() || !options.audio_file.empty()) {
+            Capture::Policy policy = options.policy.empty() ? Capture::POLICY_BLOCK : Capture::policy_by_name(options.policy);
+            capture.reset(new Capture(options.video_file, options.audio_file, policy));
+            nes.set_audio_sink(capture.get());
+        }
+        nes.set_frame_sink(capture && !options.video_file.empty() ? capture.get() : frame_sink.get());
+        if (headless || !options.hash_file.empty() || !options.verify_file.empty() || frame_sink || capture) {
+            int status = run_headless(nes, options, capture.get());
+            if (profiler) {
+                profiler->write_folded(options.profile_file);
+                profiler->write_flat(stdout, 20);
+            }
+#ifdef USE_PERF
+            if (perf)
+                perf->print(stdout);
+#endif // USE_PERF
+            if (capture) {
+                Capture::Stats stats = capture->get_stats();
+                printf("capture frames %llu dropped %llu samples %llu dropped %llu errors %llu\n",
+                       (unsigned long long) stats.frames, (unsigned long long) stats.dropped_frames,
+                       (unsigned long long) stats.samples, (unsigned long long) stats.dropped_samples,
+                       (unsigned long long) stats.write_errors);
+            }
+            return status;
+        }
         nes.start();
         return 0;
     } catch(const exception& e) {
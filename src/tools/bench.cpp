@@ -0,0 +1,456 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/audio.h"
+#include "core/batch.h"
+#include "core/cpu.h"
+#include "core/cpu_simd.h"
+#include "core/dma.h"
+#include "core/nes.h"
+#include "core/rewind.h"
+
+using namespace std;
+
+static atomic<uint64_t> allocations(0);
+
+void *operator new(size_t size)
+{
+    allocations.fetch_add(1, memory_order_relaxed);
+    void *ptr = malloc(size ? size : 1);
+    if (!ptr)
+        throw bad_alloc();
+    return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+struct Workload {
+    const char *name;
+    vector<uint8_t> code;
+};
+
+static const vector<Workload> workloads = {
+    { "alu", {
+        0xA9, 0x00,             // 8000: LDA #$00
+        0x18,                   // 8002: CLC
+        0x69, 0x07,             // 8003: ADC #$07
+        0x49, 0x5A,             // 8005: EOR #$5A
+        0x29, 0xF7,             // 8007: AND #$F7
+        0x09, 0x21,             // 8009: ORA #$21
+        0x0A,                   // 800B: ASL A
+        0xE9, 0x03,             // 800C: SBC #$03
+        0xE8,                   // 800E: INX
+        0x4C, 0x02, 0x80        // 800F: JMP $8002
+    } },
+    { "memcpy", {
+        0xA2, 0x00,             // 8000: LDX #$00
+        0xBD, 0x00, 0x03,       // 8002: LDA $0300,X
+        0x9D, 0x00, 0x04,       // 8005: STA $0400,X
+        0xE8,                   // 8008: INX
+        0xD0, 0xF7,             // 8009: BNE $8002
+        0xEE, 0x00, 0x03,       // 800B: INC $0300
+        0x4C, 0x00, 0x80        // 800E: JMP $8000
+    } },
+    { "branch", {
+        0xE8,                   // 8000: INX
+        0x8A,                   // 8001: TXA
+        0x29, 0x03,             // 8002: AND #$03
+        0xF0, 0x06,             // 8004: BEQ $800C
+        0xC9, 0x02,             // 8006: CMP #$02
+        0x90, 0x04,             // 8008: BCC $800E
+        0xD0, 0xF4,             // 800A: BNE $8000
+        0x10, 0xF2,             // 800C: BPL $8000
+        0x30, 0xF0,             // 800E: BMI $8000
+        0x4C, 0x00, 0x80        // 8010: JMP $8000
+    } },
+    { "call", {
+        0x20, 0x10, 0x80,       // 8000: JSR $8010
+        0x20, 0x14, 0x80,       // 8003: JSR $8014
+        0x4C, 0x00, 0x80,       // 8006: JMP $8000
+        0xEA, 0xEA, 0xEA,       // 8009: NOP x7
+        0xEA, 0xEA, 0xEA, 0xEA,
+        0xE8,                   // 8010: INX
+        0x20, 0x14, 0x80,       // 8011: JSR $8014
+        0xC8,                   // 8014: INY
+        0x60                    // 8015: RTS
+    } },
+    { "indirect", {
+        0xA9, 0x00,             // 8000: LDA #$00
+        0x85, 0x10,             // 8002: STA $10
+        0xA9, 0x03,             // 8004: LDA #$03
+        0x85, 0x11,             // 8006: STA $11
+        0xA9, 0x14,             // 8008: LDA #$14
+        0x85, 0x14,             // 800A: STA $14
+        0xA9, 0x80,             // 800C: LDA #$80
+        0x85, 0x15,             // 800E: STA $15
+        0xA2, 0x00,             // 8010: LDX #$00
+        0xA0, 0x00,             // 8012: LDY #$00
+        0xB1, 0x10,             // 8014: LDA ($10),Y
+        0x49, 0xFF,             // 8016: EOR #$FF
+        0x91, 0x10,             // 8018: STA ($10),Y
+        0x01, 0x10,             // 801A: ORA ($10,X)
+        0xC8,                   // 801C: INY
+        0xD0, 0xF5,             // 801D: BNE $8014
+        0x6C, 0x14, 0x00        // 801F: JMP ($0014)
+    } }
+};
+
+static const vector<uint8_t> ppu_workload = {
+    0x78,                   // 8000: SEI
+    0xA2, 0xFF,             // 8001: LDX #$FF
+    0x9A,                   // 8003: TXS
+    0xA9, 0x00,             // 8004: LDA #$00
+    0x8D, 0x00, 0x20,       // 8006: STA $2000
+    0x8D, 0x01, 0x20,       // 8009: STA $2001
+    0x8D, 0x06, 0x20,       // 800C: STA $2006
+    0x8D, 0x06, 0x20,       // 800F: STA $2006
+    0xA0, 0x20,             // 8012: LDY #$20
+    0xA2, 0x00,             // 8014: LDX #$00
+    0x8A,                   // 8016: TXA
+    0x8D, 0x07, 0x20,       // 8017: STA $2007
+    0xE8,                   // 801A: INX
+    0xD0, 0xF9,             // 801B: BNE $8016
+    0x88,                   // 801D: DEY
+    0xD0, 0xF6,             // 801E: BNE $8016
+    0xA9, 0x20,             // 8020: LDA #$20
+    0x8D, 0x06, 0x20,       // 8022: STA $2006
+    0xA9, 0x00,             // 8025: LDA #$00
+    0x8D, 0x06, 0x20,       // 8027: STA $2006
+    0xA0, 0x04,             // 802A: LDY #$04
+    0x8A,                   // 802C: TXA
+    0x8D, 0x07, 0x20,       // 802D: STA $2007
+    0xE8,                   // 8030: INX
+    0xD0, 0xF9,             // 8031: BNE $802C
+    0x88,                   // 8033: DEY
+    0xD0, 0xF6,             // 8034: BNE $802C
+    0xA9, 0x3F,             // 8036: LDA #$3F
+    0x8D, 0x06, 0x20,       // 8038: STA $2006
+    0xA9, 0x00,             // 803B: LDA #$00
+    0x8D, 0x06, 0x20,       // 803D: STA $2006
+    0x8A,                   // 8040: TXA
+    0x8D, 0x07, 0x20,       // 8041: STA $2007
+    0xE8,                   // 8044: INX
+    0xE0, 0x20,             // 8045: CPX #$20
+    0xD0, 0xF7,             // 8047: BNE $8040
+    0xA2, 0x00,             // 8049: LDX #$00
+    0x8A,                   // 804B: TXA
+    0x9D, 0x00, 0x02,       // 804C: STA $0200,X
+    0xE8,                   // 804F: INX
+    0xD0, 0xF9,             // 8050: BNE $804B
+    0xA9, 0x02,             // 8052: LDA #$02
+    0x8D, 0x14, 0x40,       // 8054: STA $4014
+    0xA9, 0x00,             // 8057: LDA #$00
+    0x8D, 0x05, 0x20,       // 8059: STA $2005
+    0x8D, 0x05, 0x20,       // 805C: STA $2005
+    0xA9, 0x10,             // 805F: LDA #$10
+    0x8D, 0x00, 0x20,       // 8061: STA $2000
+    0xA9, 0x1E,             // 8064: LDA #$1E
+    0x8D, 0x01, 0x20,       // 8066: STA $2001
+    0xAD, 0x02, 0x20,       // 8069: LDA $2002
+    0x10, 0xFB,             // 806C: BPL $8069
+    0xA9, 0x00,             // 806E: LDA #$00
+    0x8D, 0x05, 0x20,       // 8070: STA $2005
+    0x8D, 0x05, 0x20,       // 8073: STA $2005
+    0xA9, 0x02,             // 8076: LDA #$02
+    0x8D, 0x14, 0x40,       // 8078: STA $4014
+    0x4C, 0x69, 0x80        // 807B: JMP $8069
+};
+
+static const vector<uint8_t> apu_workload = {
+    0xA9, 0x0F,             // 8000: LDA #$0F
+    0x8D, 0x15, 0x40,       // 8002: STA $4015
+    0xA9, 0xBF,             // 8005: LDA #$BF
+    0x8D, 0x00, 0x40,       // 8007: STA $4000
+    0xA9, 0x08,             // 800A: LDA #$08
+    0x8D, 0x01, 0x40,       // 800C: STA $4001
+    0xA9, 0xFD,             // 800F: LDA #$FD
+    0x8D, 0x02, 0x40,       // 8011: STA $4002
+    0xA9, 0x00,             // 8014: LDA #$00
+    0x8D, 0x03, 0x40,       // 8016: STA $4003
+    0xA9, 0xFF,             // 8019: LDA #$FF
+    0x8D, 0x08, 0x40,       // 801B: STA $4008
+    0xA9, 0x7E,             // 801E: LDA #$7E
+    0x8D, 0x0A, 0x40,       // 8020: STA $400A
+    0xA9, 0x00,             // 8023: LDA #$00
+    0x8D, 0x0B, 0x40,       // 8025: STA $400B
+    0xA9, 0x3F,             // 8028: LDA #$3F
+    0x8D, 0x0C, 0x40,       // 802A: STA $400C
+    0xA9, 0x03,             // 802D: LDA #$03
+    0x8D, 0x0E, 0x40,       // 802F: STA $400E
+    0xA9, 0x00,             // 8032: LDA #$00
+    0x8D, 0x0F, 0x40,       // 8034: STA $400F
+    0x4C, 0x37, 0x80        // 8037: JMP $8037
+};
+
+static const struct {
+    const char *name;
+    CPU::Engine engine;
+} engines[] = {
+    { "switch", CPU::ENGINE_SWITCH },
+    { "table", CPU::ENGINE_TABLE },
+    { "threaded", CPU::ENGINE_THREADED },
+    { "block", CPU::ENGINE_BLOCK },
+#ifdef USE_JIT
+    { "jit", CPU::ENGINE_JIT },
+#endif // USE_JIT
+};
+
+static vector<uint8_t> make_cartridge(const vector<uint8_t> &code)
+{
+    vector<uint8_t> cartridge(0xBFE0, 0xEA);
+    copy(code.begin(), code.end(), cartridge.begin() + (0x8000 - 0x4020));
+    cartridge[0xFFFC - 0x4020] = 0x00;
+    cartridge[0xFFFD - 0x4020] = 0x80;
+    return cartridge;
+}
+
+static void bench_state(const vector<uint8_t> &cartridge, unsigned iterations)
+{
+    DMA dma;
+    dma.load_cartridge(cartridge);
+    CPU cpu(dma);
+    cpu.set_engine(CPU::ENGINE_BLOCK);
+    cpu.reset();
+    cpu.run_cycles(100000);
+    vector<uint8_t> buffer(cpu.state_size() + dma.state_size());
+    uint8_t *cpu_state = buffer.data();
+    uint8_t *dma_state = cpu_state + cpu.state_size();
+    uint64_t start_allocations = allocations.load();
+    auto start = chrono::steady_clock::now();
+    for (unsigned i = 0; i < iterations; ++i) {
+        cpu.save_state(cpu_state);
+        dma.save_state(dma_state);
+    }
+    double save_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    start = chrono::steady_clock::now();
+    for (unsigned i = 0; i < iterations; ++i) {
+        cpu.load_state(cpu_state);
+        dma.load_state(dma_state);
+    }
+    double load_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    uint64_t allocated = allocations.load() - start_allocations;
+    printf("  \"state\": {\"bytes\": %zu, \"iterations\": %u, \"save_ns\": %.1f, "
+           "\"load_ns\": %.1f, \"allocations\": %llu},\n",
+           buffer.size(), iterations, save_seconds * 1e9 / iterations,
+           load_seconds * 1e9 / iterations, (unsigned long long) allocated);
+}
+
+static void bench_rewind(const vector<uint8_t> &cartridge, unsigned frames)
+{
+    static const uint64_t CYCLES_PER_FRAME = 29781;
+    DMA dma;
+    dma.load_cartridge(cartridge);
+    CPU cpu(dma);
+    cpu.set_engine(CPU::ENGINE_BLOCK);
+    cpu.reset();
+    vector<uint8_t> buffer(cpu.state_size() + dma.state_size());
+    Rewind rewind(buffer.size(), 4 << 20);
+    uint64_t start_allocations = allocations.load();
+    for (unsigned i = 0; i < frames; ++i) {
+        cpu.run_cycles(CYCLES_PER_FRAME);
+        cpu.save_state(buffer.data());
+        dma.save_state(buffer.data() + cpu.state_size());
+        rewind.push(buffer.data());
+    }
+    Rewind::Stats pushed = rewind.get_stats();
+    for (unsigned i = 0; i < frames / 2; ++i) {
+        const uint8_t *state = rewind.step_back();
+        cpu.load_state(state);
+        dma.load_state(state + cpu.state_size());
+    }
+    Rewind::Stats stats = rewind.get_stats();
+    uint64_t allocated = allocations.load() - start_allocations;
+    printf("  \"rewind\": {\"frames\": %zu, \"budget\": %zu, \"used\": %zu, \"keyframes\": %zu, "
+           "\"average_delta\": %zu, \"encode_us\": %.2f, \"decode_us\": %.2f, \"allocations\": %llu},\n",
+           pushed.frames, pushed.budget, pushed.used, pushed.keyframes, pushed.average_delta,
+           stats.encode_us, stats.decode_us, (unsigned long long) allocated);
+}
+
+static double time_batch(const vector<uint8_t> &cartridge, size_t instances, unsigned threads, unsigned frames)
+{
+    Batch batch(cartridge, instances, threads);
+    vector<uint8_t> inputs(instances * 2, 0);
+    batch.set_observed({ 0x0000, 0x0400 });
+    batch.run_frames(1, inputs.data());
+    auto start = chrono::steady_clock::now();
+    batch.run_frames(frames, inputs.data());
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void bench_batch(const vector<uint8_t> &cartridge, size_t instances, unsigned frames)
+{
+    unsigned threads = thread::hardware_concurrency();
+    if (!threads)
+        threads = 1;
+    double single = time_batch(cartridge, instances, 1, frames);
+    double parallel = time_batch(cartridge, instances, threads, frames);
+    printf("  \"batch\": {\"instances\": %zu, \"frames\": %u, \"threads\": %u, "
+           "\"single_seconds\": %.4f, \"parallel_seconds\": %.4f, \"speedup\": %.2f},\n",
+           instances, frames, threads, single, parallel, single / parallel);
+}
+
+static void bench_ppu(const vector<uint8_t> &cartridge, unsigned frames)
+{
+    NES nes;
+    nes.load_cartridge(cartridge);
+    for (unsigned i = 0; i < 8; ++i)
+        nes.run_frame();
+    PPU::Stats before = nes.ppu_stats();
+    auto start = chrono::steady_clock::now();
+    for (unsigned i = 0; i < frames; ++i)
+        nes.run_frame();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    PPU::Stats after = nes.ppu_stats();
+    double frame_count = after.frames - before.frames;
+    uint64_t syncs[PPU::SYNC_REASONS];
+    for (unsigned i = 0; i < PPU::SYNC_REASONS; ++i)
+        syncs[i] = after.syncs[i] - before.syncs[i];
+    printf("  \"ppu\": {\"frames\": %u, \"seconds\": %.4f, \"ms_per_frame\": %.3f, "
+           "\"register_syncs_per_frame\": %.1f, \"mapper_syncs_per_frame\": %.1f, \"oam_dma_syncs_per_frame\": %.1f, "
+           "\"event_syncs_per_frame\": %.1f, \"frame_syncs_per_frame\": %.1f},\n",
+           frames, seconds, seconds * 1e3 / frames, syncs[PPU::SYNC_REGISTER] / frame_count,
+           syncs[PPU::SYNC_MAPPER] / frame_count, syncs[PPU::SYNC_OAM_DMA] / frame_count, syncs[PPU::SYNC_EVENT] / frame_count,
+           syncs[PPU::SYNC_FRAME] / frame_count);
+}
+
+static double time_frames(const vector<uint8_t> &cartridge, AudioSink *sink, unsigned frames)
+{
+    NES nes;
+    nes.load_cartridge(cartridge);
+    nes.set_audio_sink(sink);
+    nes.run_frame();
+    auto start = chrono::steady_clock::now();
+    for (unsigned i = 0; i < frames; ++i)
+        nes.run_frame();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void bench_apu(const vector<uint8_t> &cartridge, unsigned frames)
+{
+    NullAudioSink sink;
+    double silent = time_frames(cartridge, nullptr, frames);
+    double audio = time_frames(cartridge, &sink, frames);
+    printf("  \"apu\": {\"frames\": %u, \"samples\": %llu, \"silent_ms_per_frame\": %.3f, "
+           "\"audio_ms_per_frame\": %.3f, \"overhead\": %.3f},\n",
+           frames, (unsigned long long) sink.get_samples(), silent * 1e3 / frames, audio * 1e3 / frames,
+           (audio - silent) / silent);
+}
+
+static void bench_simd(const vector<uint8_t> &cartridge, uint64_t cycles)
+{
+    unsigned lanes = SimdCPU::MAX_LANES;
+    vector<unique_ptr<DMA>> dmas;
+    vector<unique_ptr<CPU>> cpus;
+    for (unsigned i = 0; i < lanes; ++i) {
+        dmas.emplace_back(new DMA());
+        cpus.emplace_back(new CPU(*dmas.back()));
+        dmas.back()->load_cartridge(cartridge);
+        cpus.back()->reset();
+    }
+    auto start = chrono::steady_clock::now();
+    for (auto &cpu : cpus)
+        cpu->run_until(cycles);
+    double scalar = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    SimdCPU simd(cartridge, lanes);
+    simd.reset();
+    start = chrono::steady_clock::now();
+    simd.run_until(cycles);
+    double lockstep = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    SimdCPU::Stats stats = simd.get_stats();
+    printf("  \"simd\": {\"lanes\": %u, \"cycles\": %llu, \"scalar_seconds\": %.4f, \"simd_seconds\": %.4f, "
+           "\"speedup\": %.2f, \"occupancy\": %.2f}\n",
+           lanes, (unsigned long long) cycles, scalar, lockstep, scalar / lockstep,
+           stats.groups ? (double) stats.instructions / stats.groups : 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+    try {
+        uint64_t instructions = 50000000;
+        string only;
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "-n" && i + 1 < argc) {
+                instructions = strtoull(argv[++i], nullptr, 0);
+            } else if (arg == "-e" && i + 1 < argc) {
+                only = argv[++i];
+            } else {
+                fprintf(stderr, "usage: %s [-n instructions] [-e engine]\n", argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+        printf("{\n");
+        printf("  \"compiler\": \"%s\",\n", __VERSION__);
+#ifdef USE_JIT
+        printf("  \"jit\": true,\n");
+#else
+        printf("  \"jit\": false,\n");
+#endif // USE_JIT
+        printf("  \"instructions\": %llu,\n", (unsigned long long) instructions);
+        printf("  \"results\": [");
+        bool first = true;
+        for (const Workload &workload : workloads) {
+            vector<uint8_t> cartridge = make_cartridge(workload.code);
+            uint64_t target;
+            {
+                DMA dma;
+                dma.load_cartridge(cartridge);
+                CPU cpu(dma);
+                cpu.reset();
+                for (uint64_t i = 0; i < instructions; ++i)
+                    cpu.exec_one();
+                target = cpu.get_cycles();
+            }
+            for (const auto &engine : engines) {
+                if (!only.empty() && only != engine.name)
+                    continue;
+                DMA dma;
+                dma.load_cartridge(cartridge);
+                CPU cpu(dma);
+                cpu.set_engine(engine.engine);
+                cpu.reset();
+                uint64_t start_allocations = allocations.load();
+                auto start = chrono::steady_clock::now();
+                cpu.run_until(target);
+                double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+                uint64_t allocated = allocations.load() - start_allocations;
+                printf("%s\n    {\"workload\": \"%s\", \"engine\": \"%s\", \"cycles\": %llu, "
+                       "\"seconds\": %.6f, \"instructions_per_second\": %.0f, "
+                       "\"ns_per_instruction\": %.3f, \"allocations\": %llu}",
+                       first ? "" : ",", workload.name, engine.name,
+                       (unsigned long long) cpu.get_cycles(), seconds, instructions / seconds,
+                       seconds * 1e9 / instructions, (unsigned long long) allocated);
+                first = false;
+            }
+        }
+        printf("\n  ],\n");
+        bench_state(make_cartridge(workloads[1].code), 100000);
+        bench_rewind(make_cartridge(workloads[1].code), 600);
+        bench_batch(make_cartridge(workloads[1].code), 256, 10);
+        bench_ppu(make_cartridge(ppu_workload), 600);
+        bench_apu(make_cartridge(apu_workload), 600);
+        bench_simd(make_cartridge(workloads[0].code), 2000000);
+        printf("}\n");
+        return 0;
+    } catch(const exception& e) {
+        fprintf(stderr, "fatal: %s\n", e.what());
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,523 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "core/cpu_ops.h"
+#include "core/cpu_simd.h"
+#include "core/hash.h"
+#include "core/nes.h"
+#include "core/rom.h"
+
+using namespace std;
+
+struct Source {
+    vector<uint8_t> cartridge;
+    shared_ptr<const ROMImage> image;
+    uint8_t buttons[2];
+};
+
+struct Instance {
+    NES nes;
+    bool halted;
+    string error;
+    Instance(const Source &source, CPU::Engine engine) : halted(false)
+    {
+        if (source.image)
+            nes.load_image(source.image);
+        else
+            nes.load_cartridge(source.cartridge);
+        nes.set_engine(engine);
+        nes.set_buttons(0, source.buttons[0]);
+        nes.set_buttons(1, source.buttons[1]);
+    }
+    void advance(uint64_t cycle)
+    {
+        if (halted)
+            return;
+        try {
+            uint64_t now = nes.get_cycles();
+            nes.run_cycles(cycle > now ? cycle - now : 0);
+        } catch (const runtime_error &e) {
+            halted = true;
+            error = e.what();
+        }
+    }
+};
+
+struct Options {
+    string ref_name;
+    string test_name;
+    CPU::Engine ref_engine;
+    CPU::Engine test_engine;
+    uint64_t cycles;
+    uint64_t hash_interval;
+    string rom;
+    bool random;
+    unsigned seed;
+    unsigned count;
+    unsigned lanes;
+};
+
+static bool writable_page(unsigned page)
+{
+    return page < 0x08 || (page >= 0x41 && page < 0x80);
+}
+
+static bool same_state(const CPU::State &a, const CPU::State &b)
+{
+    return a.pc == b.pc && a.a == b.a && a.x == b.x && a.y == b.y &&
+           a.s == b.s && a.p == b.p && a.cycles == b.cycles;
+}
+
+static bool same_memory(Instance &a, Instance &b)
+{
+    for (unsigned page = 0; page < 0x100; ++page) {
+        if (writable_page(page) && memcmp(a.nes.host_page(page), b.nes.host_page(page), 0x100))
+            return false;
+    }
+    return true;
+}
+
+static uint64_t state_hash(Instance &instance)
+{
+    return fnv1a(&instance.halted, sizeof(instance.halted), instance.nes.state_hash());
+}
+
+static void print_state(const char *label, const CPU::State &state)
+{
+    printf("  %-6s PC:%04X A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu\n", label,
+           state.pc, state.a, state.x, state.y, state.p, state.s, (unsigned long long) state.cycles);
+}
+
+static void print_bytes(Instance &instance, uint16_t pc)
+{
+    printf("  bytes ");
+    for (uint16_t addr = pc; addr != (uint16_t) (pc + 3); ++addr) {
+        const uint8_t *page = instance.nes.host_page(addr >> 8);
+        if (page)
+            printf(" %02X", page[addr & 0xFF]);
+        else
+            printf(" ??");
+    }
+    printf("\n");
+}
+
+static void report(Instance &ref, Instance &test, const CPU::State *history, size_t history_size, uint64_t step)
+{
+    printf("divergence after %llu steps\n", (unsigned long long) step);
+    printf("last reference instructions:\n");
+    for (size_t i = 0; i < history_size; ++i) {
+        print_state("", history[i]);
+        print_bytes(ref, history[i].pc);
+    }
+    printf("after:\n");
+    print_state("ref", ref.nes.get_cpu_state());
+    print_state("test", test.nes.get_cpu_state());
+    if (ref.halted || test.halted)
+        printf("  halted ref:%s test:%s\n", ref.halted ? ref.error.c_str() : "no", test.halted ? test.error.c_str() : "no");
+    unsigned shown = 0;
+    for (unsigned page = 0; page < 0x100 && shown < 16; ++page) {
+        if (!writable_page(page))
+            continue;
+        const uint8_t *a = ref.nes.host_page(page);
+        const uint8_t *b = test.nes.host_page(page);
+        for (unsigned i = 0; i < 0x100 && shown < 16; ++i) {
+            if (a[i] != b[i]) {
+                printf("  mem %04X ref:%02X test:%02X\n", (page << 8) | i, a[i], b[i]);
+                ++shown;
+            }
+        }
+    }
+}
+
+static bool lockstep(Instance &ref, Instance &test, uint64_t limit)
+{
+    static const size_t HISTORY = 16;
+    CPU::State history[HISTORY];
+    uint64_t step = 0;
+    while (ref.nes.get_cycles() < limit && !ref.halted) {
+        history[step % HISTORY] = ref.nes.get_cpu_state();
+        ref.advance(ref.nes.get_cycles() + 1);
+        test.advance(test.nes.get_cycles() + 1);
+        ++step;
+        if (ref.halted != test.halted || !same_state(ref.nes.get_cpu_state(), test.nes.get_cpu_state()) ||
+            !same_memory(ref, test)) {
+            CPU::State ordered[HISTORY];
+            size_t count = step < HISTORY ? step : HISTORY;
+            for (size_t i = 0; i < count; ++i)
+                ordered[i] = history[(step - count + i) % HISTORY];
+            report(ref, test, ordered, count, step);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool run(const Source &source, const Options &options)
+{
+    unique_ptr<Instance> ref(new Instance(source, options.ref_engine));
+    unique_ptr<Instance> test(new Instance(source, options.test_engine));
+    if (!options.hash_interval)
+        return lockstep(*ref, *test, options.cycles);
+    uint64_t good = ref->nes.get_cycles();
+    while (good < options.cycles && !ref->halted) {
+        uint64_t target = good + options.hash_interval;
+        ref->advance(target);
+        test->advance(target);
+        if (state_hash(*ref) != state_hash(*test)) {
+            printf("hash mismatch between cycles %llu and %llu, replaying in lockstep\n",
+                   (unsigned long long) good, (unsigned long long) ref->nes.get_cycles());
+            ref.reset(new Instance(source, options.ref_engine));
+            test.reset(new Instance(source, options.test_engine));
+            ref->advance(good);
+            test->advance(good);
+            return lockstep(*ref, *test, options.cycles);
+        }
+        good = ref->nes.get_cycles();
+    }
+    return true;
+}
+
+static uint8_t lane_buttons(const Source &source, unsigned lane, unsigned port)
+{
+    return source.buttons[port] ^ (uint8_t) (lane * 0x9D);
+}
+
+static Instance *lane_instance(const Source &source, CPU::Engine engine, unsigned lane)
+{
+    Instance *instance = new Instance(source, engine);
+    for (unsigned port = 0; port < 2; ++port)
+        instance->nes.set_buttons(port, lane_buttons(source, lane, port));
+    return instance;
+}
+
+static void start_lanes(SimdCPU &simd, const Source &source)
+{
+    for (unsigned lane = 0; lane < simd.lane_count(); ++lane) {
+        for (unsigned port = 0; port < 2; ++port)
+            simd.set_buttons(lane, port, lane_buttons(source, lane, port));
+    }
+    simd.reset();
+}
+
+static bool same_lane(SimdCPU &simd, unsigned lane, Instance &ref)
+{
+    if (simd.is_halted(lane) != ref.halted)
+        return false;
+    if (ref.halted)
+        return simd.error(lane) == ref.error;
+    if (!same_state(simd.get_state(lane), ref.nes.get_cpu_state()))
+        return false;
+    for (unsigned page = 0; page < 0x100; ++page) {
+        if (!writable_page(page))
+            continue;
+        const uint8_t *host = ref.nes.host_page(page);
+        for (unsigned i = 0; i < 0x100; ++i) {
+            if (simd.peek(lane, (page << 8) | i) != host[i])
+                return false;
+        }
+    }
+    return true;
+}
+
+static void report_lane(SimdCPU &simd, unsigned lane, Instance &ref, const CPU::State *history, size_t history_size,
+                        uint64_t step)
+{
+    printf("divergence in lane %u after %llu steps\n", lane, (unsigned long long) step);
+    printf("last reference instructions:\n");
+    for (size_t i = 0; i < history_size; ++i) {
+        print_state("", history[i]);
+        print_bytes(ref, history[i].pc);
+    }
+    printf("after:\n");
+    print_state("ref", ref.nes.get_cpu_state());
+    print_state("simd", simd.get_state(lane));
+    if (ref.halted || simd.is_halted(lane))
+        printf("  halted ref:%s simd:%s\n", ref.halted ? ref.error.c_str() : "no",
+               simd.is_halted(lane) ? simd.error(lane).c_str() : "no");
+    unsigned shown = 0;
+    for (unsigned page = 0; page < 0x100 && shown < 16; ++page) {
+        if (!writable_page(page))
+            continue;
+        const uint8_t *host = ref.nes.host_page(page);
+        for (unsigned i = 0; i < 0x100 && shown < 16; ++i) {
+            uint8_t data = simd.peek(lane, (page << 8) | i);
+            if (host[i] != data) {
+                printf("  mem %04X ref:%02X simd:%02X\n", (page << 8) | i, host[i], data);
+                ++shown;
+            }
+        }
+    }
+}
+
+static bool lockstep_lane(const Source &source, const Options &options, unsigned lane, uint64_t start)
+{
+    static const size_t HISTORY = 16;
+    SimdCPU simd(source.cartridge, options.lanes);
+    start_lanes(simd, source);
+    unique_ptr<Instance> ref(lane_instance(source, options.ref_engine, lane));
+    simd.run_until(start);
+    ref->advance(start);
+    CPU::State history[HISTORY];
+    uint64_t step = 0;
+    while (ref->nes.get_cycles() < options.cycles && !ref->halted) {
+        history[step % HISTORY] = ref->nes.get_cpu_state();
+        uint64_t target = ref->nes.get_cycles() + 1;
+        ref->advance(target);
+        simd.run_until(target);
+        ++step;
+        if (simd.is_unsupported(lane))
+            break;
+        if (!same_lane(simd, lane, *ref)) {
+            CPU::State ordered[HISTORY];
+            size_t count = step < HISTORY ? step : HISTORY;
+            for (size_t i = 0; i < count; ++i)
+                ordered[i] = history[(step - count + i) % HISTORY];
+            report_lane(simd, lane, *ref, ordered, count, step);
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool run_simd(const Source &source, const Options &options)
+{
+    static const uint64_t DEFAULT_INTERVAL = 1000;
+    uint64_t interval = options.hash_interval ? options.hash_interval : DEFAULT_INTERVAL;
+    SimdCPU simd(source.cartridge, options.lanes);
+    start_lanes(simd, source);
+    vector<unique_ptr<Instance>> refs;
+    for (unsigned lane = 0; lane < options.lanes; ++lane)
+        refs.emplace_back(lane_instance(source, options.ref_engine, lane));
+    uint64_t live = (1ull << options.lanes) - 1;
+    unsigned unsupported = 0;
+    uint64_t good = refs[0]->nes.get_cycles();
+    while (good < options.cycles && live) {
+        uint64_t target = good + interval;
+        simd.run_until(target);
+        for (unsigned lane = 0; lane < options.lanes; ++lane) {
+            if (!(live >> lane & 1))
+                continue;
+            refs[lane]->advance(target);
+            if (simd.is_unsupported(lane)) {
+                live &= ~(1ull << lane);
+                ++unsupported;
+            } else if (!same_lane(simd, lane, *refs[lane])) {
+                printf("lane %u mismatch between cycles %llu and %llu, replaying in lockstep\n", lane,
+                       (unsigned long long) good, (unsigned long long) target);
+                return lockstep_lane(source, options, lane, good);
+            } else if (refs[lane]->halted) {
+                live &= ~(1ull << lane);
+            }
+        }
+        good = target;
+    }
+    if (unsupported)
+        printf("%u of %u lanes stopped at unsupported features\n", unsupported, options.lanes);
+    return true;
+}
+
+static Source random_source(unsigned seed)
+{
+    mt19937 rng(seed);
+    Source source;
+    vector<uint8_t> &cartridge = source.cartridge;
+    cartridge.resize(0xBFE0);
+    for (uint8_t &byte : cartridge) {
+        do
+            byte = rng();
+        while (op_kind_table[byte] == KIND_none);
+    }
+    static const uint8_t pad_ops[4] = { 0xAD, 0x2C, 0xAE, 0x8D };
+    for (size_t i = 0; i + 3 <= cartridge.size(); i += 3) {
+        if (rng() % 32)
+            continue;
+        cartridge[i] = pad_ops[rng() % 4];
+        cartridge[i + 1] = 0x16 | (rng() & 1);
+        cartridge[i + 2] = 0x40;
+    }
+    source.buttons[0] = rng();
+    source.buttons[1] = rng();
+    cartridge[0xFFFC - 0x4020] = rng();
+    cartridge[0xFFFD - 0x4020] = 0x80 | rng();
+    return source;
+}
+
+static bool simd_opcode(uint8_t opcode)
+{
+    uint8_t kind = op_kind_table[opcode];
+    uint8_t mode = op_mode_table[opcode];
+    if (kind == KIND_none || mode == MODE_Xind || mode == MODE_ind)
+        return false;
+    if (kind == KIND_addr && (mode == MODE_zpgX || mode == MODE_zpgY))
+        return false;
+    return opcode != 0x28 && opcode != 0x40 && opcode != 0x58 && opcode != 0x60;
+}
+
+static Source simd_source(unsigned seed)
+{
+    static const size_t ORIGIN = 0x8000 - 0x4020;
+    static const size_t END = 0xFFF0 - 0x4020;
+    static const uint8_t pad_ops[4] = { 0xAD, 0x2C, 0xAE, 0x8D };
+    mt19937 rng(seed);
+    Source source;
+    vector<uint8_t> &cartridge = source.cartridge;
+    cartridge.assign(0xBFE0, 0xEA);
+    vector<bool> starts(cartridge.size());
+    vector<size_t> fixups;
+    size_t pos = ORIGIN;
+    for (unsigned i = 0; i < 8; ++i) {
+        uint8_t init[8] = { 0xA9, (uint8_t) rng(), 0x85, (uint8_t) (0xF0 + i * 2),
+                            0xA9, (uint8_t) (0x02 + rng() % 5), 0x85, (uint8_t) (0xF1 + i * 2) };
+        for (unsigned j = 0; j < 8; j += 2)
+            starts[pos + j] = true;
+        copy(init, init + 8, cartridge.begin() + pos);
+        pos += 8;
+    }
+    size_t body = pos;
+    while (pos + 3 <= END) {
+        starts[pos] = true;
+        uint8_t opcode;
+        if (rng() % 16 == 0) {
+            opcode = pad_ops[rng() % 4];
+            cartridge[pos] = opcode;
+            cartridge[pos + 1] = opcode == 0x8D ? 0x16 : 0x16 | (rng() & 1);
+            cartridge[pos + 2] = 0x40;
+            pos += 3;
+            continue;
+        }
+        do
+            opcode = rng();
+        while (!simd_opcode(opcode));
+        uint8_t kind = op_kind_table[opcode];
+        uint8_t mode = op_mode_table[opcode];
+        cartridge[pos] = opcode;
+        if (mode == MODE_rel || opcode == 0x20 || opcode == 0x4C) {
+            fixups.push_back(pos);
+        } else if (mode == MODE_zpg) {
+            cartridge[pos + 1] = kind == KIND_addr ? rng() % 0xF0 : rng();
+        } else if (mode == MODE_indY) {
+            cartridge[pos + 1] = 0xF0 + (rng() % 8) * 2;
+        } else if (mode == MODE_abs || mode == MODE_absX || mode == MODE_absY) {
+            unsigned region = rng() % (kind == KIND_addr ? 2 : 3);
+            cartridge[pos + 1] = rng();
+            cartridge[pos + 2] = region == 0 ? 0x02 + rng() % 5 : region == 1 ? 0x41 + rng() % 0x3E : 0x80 + rng() % 0x7F;
+        } else if (op_length_table[opcode] >= 2) {
+            cartridge[pos + 1] = rng();
+        }
+        pos += op_length_table[opcode];
+    }
+    starts[pos] = true;
+    cartridge[pos] = 0x4C;
+    cartridge[pos + 1] = (0x4020 + body) & 0xFF;
+    cartridge[pos + 2] = (0x4020 + body) >> 8;
+    for (size_t fixup : fixups) {
+        size_t target;
+        do
+            target = body + rng() % (pos - body);
+        while (!starts[target]);
+        if (op_mode_table[cartridge[fixup]] == MODE_rel) {
+            long offset = (long) target - (long) (fixup + 2);
+            for (unsigned tries = 0; tries < 64 && (offset < -128 || offset > 127 || !starts[fixup + 2 + offset]); ++tries)
+                offset = (long) (rng() % 256) - 128;
+            if (!starts[fixup + 2 + offset])
+                offset = 0;
+            cartridge[fixup + 1] = (uint8_t) offset;
+        } else {
+            cartridge[fixup + 1] = (0x4020 + target) & 0xFF;
+            cartridge[fixup + 2] = (0x4020 + target) >> 8;
+        }
+    }
+    source.buttons[0] = rng();
+    source.buttons[1] = rng();
+    cartridge[0xFFFC - 0x4020] = 0x00;
+    cartridge[0xFFFD - 0x4020] = 0x80;
+    cartridge[0xFFFE - 0x4020] = (0x4020 + body) & 0xFF;
+    cartridge[0xFFFF - 0x4020] = (0x4020 + body) >> 8;
+    return source;
+}
+
+int main(int argc, char *argv[])
+{
+    try {
+        Options options;
+        options.ref_name = "switch";
+        options.test_name = "block";
+        options.cycles = 10000000;
+        options.hash_interval = 0;
+        options.random = false;
+        options.seed = 0;
+        options.count = 1;
+        options.lanes = 0;
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "-a" && i + 1 < argc) {
+                options.ref_name = argv[++i];
+            } else if (arg == "-b" && i + 1 < argc) {
+                options.test_name = argv[++i];
+            } else if (arg == "-c" && i + 1 < argc) {
+                options.cycles = strtoull(argv[++i], nullptr, 0);
+            } else if (arg == "-H" && i + 1 < argc) {
+                options.hash_interval = strtoull(argv[++i], nullptr, 0);
+            } else if (arg == "-r" && i + 1 < argc) {
+                options.random = true;
+                options.seed = strtoul(argv[++i], nullptr, 0);
+            } else if (arg == "-R" && i + 1 < argc) {
+                options.count = strtoul(argv[++i], nullptr, 0);
+            } else if (arg == "-L" && i + 1 < argc) {
+                options.lanes = strtoul(argv[++i], nullptr, 0);
+            } else if (arg[0] != '-' && options.rom.empty()) {
+                options.rom = arg;
+            } else {
+                options.rom.clear();
+                options.random = false;
+                break;
+            }
+        }
+        if (options.rom.empty() == !options.random) {
+            fprintf(stderr, "usage: %s [-a engine] [-b engine] [-c cycles] [-H interval] [-L lanes] (-r seed [-R count] | rom)\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        options.ref_engine = CPU::engine_by_name(options.ref_name);
+        options.test_engine = CPU::engine_by_name(options.test_name);
+        string engines = "-a " + options.ref_name + " -b " + options.test_name;
+        if (options.lanes) {
+            if (!options.random)
+                throw runtime_error("simd lanes need a random cartridge (-r)");
+            if (options.lanes > SimdCPU::MAX_LANES)
+                throw runtime_error("simd lane count must be between 1 and " + to_string(SimdCPU::MAX_LANES));
+            engines = "-a " + options.ref_name + " -L " + to_string(options.lanes);
+        }
+        if (!options.random) {
+            Source source;
+            source.image = ROM::open_image(options.rom);
+            source.buttons[0] = source.buttons[1] = 0;
+            if (!run(source, options)) {
+                printf("reproduce: %s %s -c %llu %s\n", argv[0], engines.c_str(),
+                       (unsigned long long) options.cycles, options.rom.c_str());
+                return EXIT_FAILURE;
+            }
+            printf("ok\n");
+            return 0;
+        }
+        for (unsigned i = 0; i < options.count; ++i) {
+            unsigned seed = options.seed + i;
+            Source source = options.lanes ? simd_source(seed) : random_source(seed);
+            if (!(options.lanes ? run_simd(source, options) : run(source, options))) {
+                printf("reproduce: %s %s -c %llu -r %u\n", argv[0], engines.c_str(),
+                       (unsigned long long) options.cycles, seed);
+                return EXIT_FAILURE;
+            }
+        }
+        printf("ok\n");
+        return 0;
+    } catch(const exception& e) {
+        fprintf(stderr, "fatal: %s\n", e.what());
+        exit(EXIT_FAILURE);
+    }
+}
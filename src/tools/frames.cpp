@@ -0,0 +1,76 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/frame_ring.h"
+#include "core/hash.h"
+
+using namespace std;
+
+static unique_ptr<SharedFrameReader> connect(const string &name, double timeout)
+{
+    auto start = chrono::steady_clock::now();
+    for (;;) {
+        try {
+            return unique_ptr<SharedFrameReader>(new SharedFrameReader(name));
+        } catch (const runtime_error &) {
+            if (chrono::duration<double>(chrono::steady_clock::now() - start).count() > timeout)
+                throw;
+        }
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    try {
+        uint64_t limit = UINT64_MAX;
+        double timeout = 2.0;
+        string name;
+        for (int i = 1; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "-n" && i + 1 < argc) {
+                limit = strtoull(argv[++i], nullptr, 0);
+            } else if (arg == "-w" && i + 1 < argc) {
+                timeout = strtod(argv[++i], nullptr);
+            } else if (arg[0] != '-' && name.empty()) {
+                name = arg;
+            } else {
+                name.clear();
+                break;
+            }
+        }
+        if (name.empty()) {
+            fprintf(stderr, "usage: %s [-n frames] [-w seconds] name\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        unique_ptr<SharedFrameReader> reader = connect(name, timeout);
+        vector<uint8_t> pixels(reader->width() * reader->height());
+        uint64_t count = 0;
+        auto idle = chrono::steady_clock::now();
+        while (count < limit) {
+            VideoFrame frame;
+            if (!reader->read(frame, pixels.data())) {
+                if (chrono::duration<double>(chrono::steady_clock::now() - idle).count() > timeout)
+                    break;
+                this_thread::sleep_for(chrono::microseconds(200));
+                continue;
+            }
+            idle = chrono::steady_clock::now();
+            printf("%llu %llu %02X %02X %016llx\n", (unsigned long long) frame.frame, (unsigned long long) frame.cycles,
+                   frame.buttons[0], frame.buttons[1], (unsigned long long) fnv1a(frame.pixels, pixels.size()));
+            ++count;
+        }
+        fprintf(stderr, "frames %llu dropped %llu\n", (unsigned long long) count,
+                (unsigned long long) reader->get_dropped());
+        return count ? 0 : EXIT_FAILURE;
+    } catch(const exception& e) {
+        fprintf(stderr, "fatal: %s\n", e.what());
+        exit(EXIT_FAILURE);
+    }
+}